@@ -0,0 +1,373 @@
+#include "cache.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A cache file is a CacheHeader followed by records, each a RecordHeader and
+// its bytes padded to 8. The first globalCount records are the names of the
+// globals in the order the compiler gave them slots, and the last one is the
+// script. A record refers to the objects of earlier records by their index.
+#define CACHE_MAGIC "DJC"
+#define NO_RECORD UINT32_MAX
+
+typedef enum { RECORD_STRING, RECORD_FN } RecordType;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t globalCount;
+    uint32_t recordCount;
+} CacheHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t size; // Before padding.
+} RecordHeader;
+
+// A RECORD_FN is a FnRecord followed by its constants, then a line for every
+// byte of its code, then the code. A function whose body was never compiled
+// has neither, and is compiled on its first call from where its body is in
+// the source.
+typedef struct {
+    int32_t arity;
+    int32_t upvalueCount;
+    int32_t count; // Bytes of code.
+    int32_t constantCount;
+    uint32_t name; // A string record, or NO_RECORD for the script.
+    int32_t lazyLine; // 0 unless the body was never compiled.
+    uint32_t lazyOffset;
+    uint32_t padding;
+} FnRecord;
+
+// A constant is either a value that holds no object, or one of the objects
+// loaded from an earlier record.
+typedef struct {
+    uint32_t isObj;
+    uint32_t record;
+    Value value;
+} CachedConstant;
+
+typedef struct {
+    FILE *file;
+    const char *source;
+    uint32_t recordCount;
+    bool isCacheable; // False once a constant turns out not to be storable.
+} Writer;
+
+// A Loader rebuilds the objects of a mapped cache file for the source it was
+// written from.
+typedef struct {
+    CacheFile *file;
+    const char *source;
+    size_t sourceLength;
+} Loader;
+
+static ObjFn *loadRecords(Loader *loader);
+static Obj *loadRecord(Loader *loader, const RecordHeader *record);
+static ObjFn *loadFn(Loader *loader, const uint8_t *data, uint32_t size);
+static bool isLoaded(uint32_t record, ObjType type);
+static bool loadGlobals(uint32_t count);
+
+static uint32_t writeString(Writer *writer, ObjString *str);
+static uint32_t writeFn(Writer *writer, ObjFn *fn);
+static void writeRecordHeader(Writer *writer, RecordType type, size_t size);
+static void writePadding(Writer *writer, size_t size);
+static size_t paddedSize(size_t size);
+
+// The objects loaded so far, kept from the collector until the script is.
+static ISOLATE_LOCAL ValueArray records;
+
+// cacheKey hashes the source with FNV-1a, together with the backend it is
+// compiled for.
+uint64_t cacheKey(const char *source) {
+    uint64_t hash = 14695981039346656037u;
+    for (const char *c = source; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 1099511628211u;
+    }
+    return (hash ^ (uint8_t)getBackend()) * 1099511628211u;
+}
+
+// loadCache maps the cache file at path and returns the script it holds, or
+// NULL when there is none for key, made of source. file must be closed with
+// closeCache once the VM is reset, even when nothing was loaded. The file is
+// trusted to have been written by saveCache: its records are checked, its
+// bytecode is not.
+ObjFn *loadCache(const char *path, uint64_t key, const char *source,
+                 CacheFile *file) {
+    file->data = NULL;
+    file->size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    file->data = data;
+    file->size = st.st_size;
+
+    const CacheHeader *header = data;
+    if (memcmp(header->magic, CACHE_MAGIC, 4) != 0 ||
+        header->version != CACHE_VERSION || header->key != key) {
+        closeCache(file);
+        return NULL;
+    }
+    Loader loader = {file, source, strlen(source)};
+    ObjFn *script = loadRecords(&loader);
+    freeValueArray(&records);
+    initValueArray(&records);
+    return script;
+}
+
+void closeCache(CacheFile *file) {
+    if (file->data) {
+        munmap(file->data, file->size);
+        file->data = NULL;
+    }
+}
+
+void markCacheRoots() {
+    for (int i = 0; i < records.count; i++) {
+        markValue(records.values[i]);
+    }
+}
+
+static ObjFn *loadRecords(Loader *loader) {
+    CacheFile *file = loader->file;
+    const CacheHeader *header = file->data;
+    size_t offset = sizeof(CacheHeader);
+    for (uint32_t i = 0; i < header->recordCount; i++) {
+        if (file->size - offset < sizeof(RecordHeader)) {
+            return NULL;
+        }
+        const RecordHeader *record =
+            (const RecordHeader *)((uint8_t *)file->data + offset);
+        offset += sizeof(RecordHeader);
+        if (file->size - offset < record->size) {
+            return NULL;
+        }
+        Obj *obj = loadRecord(loader, record);
+        if (obj == NULL) {
+            return NULL;
+        }
+        push(OBJ_VAL(obj));
+        writeValueArray(&records, OBJ_VAL(obj));
+        pop();
+        offset += paddedSize(record->size);
+        if (offset > file->size) {
+            offset = file->size;
+        }
+    }
+    if (!loadGlobals(header->globalCount) ||
+        !isLoaded(header->recordCount - 1, OBJ_FN)) {
+        return NULL;
+    }
+    return AS_FN(records.values[records.count - 1]);
+}
+
+static Obj *loadRecord(Loader *loader, const RecordHeader *record) {
+    const uint8_t *data = (const uint8_t *)(record + 1);
+    switch (record->type) {
+    case RECORD_STRING:
+        return (Obj *)newObjString((const char *)data, (int)record->size);
+    case RECORD_FN:
+        return (Obj *)loadFn(loader, data, record->size);
+    default:
+        return NULL;
+    }
+}
+
+// loadFn creates the function of a RECORD_FN. Its code and lines are used
+// where they are in the mapping, and only its constants are copied.
+static ObjFn *loadFn(Loader *loader, const uint8_t *data, uint32_t size) {
+    const FnRecord *record = (const FnRecord *)data;
+    if (size < sizeof(FnRecord) || record->count < 0 ||
+        record->constantCount < 0 || record->lazyLine < 0 ||
+        (record->lazyLine > 0 && record->lazyOffset >= loader->sourceLength) ||
+        size != sizeof(FnRecord) +
+                    record->constantCount * sizeof(CachedConstant) +
+                    record->count * (sizeof(int) + sizeof(uint8_t))) {
+        return NULL;
+    }
+    const CachedConstant *constants = (const CachedConstant *)(record + 1);
+    for (int i = 0; i < record->constantCount; i++) {
+        if (constants[i].isObj && !isLoaded(constants[i].record, OBJ_FN) &&
+            !isLoaded(constants[i].record, OBJ_STRING)) {
+            return NULL;
+        }
+    }
+    if (record->name != NO_RECORD && !isLoaded(record->name, OBJ_STRING)) {
+        return NULL;
+    }
+
+    ObjFn *fn = newObjFn();
+    push(OBJ_VAL(fn));
+    fn->arity = record->arity;
+    fn->upvalueCount = record->upvalueCount;
+    if (record->name != NO_RECORD) {
+        fn->name = AS_STRING(records.values[record->name]);
+    }
+    for (int i = 0; i < record->constantCount; i++) {
+        Value value = constants[i].isObj ? records.values[constants[i].record]
+                                         : constants[i].value;
+        writeValueArray(&fn->chunk.constants, value);
+    }
+    fn->chunk.lines = (int *)(constants + record->constantCount);
+    fn->chunk.codes = (uint8_t *)(fn->chunk.lines + record->count);
+    fn->chunk.count = record->count;
+    fn->chunk.isMapped = true;
+    if (record->lazyLine > 0) {
+        fn->lazySource = loader->source + record->lazyOffset;
+        fn->lazyLine = record->lazyLine;
+    }
+    pop();
+    return fn;
+}
+
+static bool isLoaded(uint32_t record, ObjType type) {
+    return record < (uint32_t)records.count &&
+           AS_OBJ(records.values[record])->type == type;
+}
+
+// loadGlobals gives the globals the slots the compiler gave them, which the
+// code refers to them by.
+static bool loadGlobals(uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (!isLoaded(i, OBJ_STRING) ||
+            globalSlot(AS_STRING(records.values[i])) != (int)i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// saveCache writes script, compiled from source, which key was made of, to
+// the cache file at path. The bodies of global functions are written as far
+// as they have been compiled on their first call. The file is written under
+// another name and renamed over path, so that a run that maps it never sees
+// half of it. A cache that cannot be written is silently left out.
+void saveCache(const char *path, uint64_t key, const char *source,
+               ObjFn *script) {
+    size_t length = strlen(path);
+    char *tmpPath = ALLOCATE(char, length + 8);
+    memcpy(tmpPath, path, length);
+    memcpy(tmpPath + length, ".XXXXXX", 8);
+    int fd = mkstemp(tmpPath);
+    if (fd == -1) {
+        FREE(char, tmpPath);
+        return;
+    }
+    fchmod(fd, 0644);
+    Writer writer = {fdopen(fd, "wb"), source, 0, true};
+    if (writer.file == NULL) {
+        close(fd);
+        unlink(tmpPath);
+        FREE(char, tmpPath);
+        return;
+    }
+
+    CacheHeader header = {CACHE_MAGIC, CACHE_VERSION, key, 0, 0};
+    fwrite(&header, sizeof(header), 1, writer.file);
+    for (int i = 0; i < vm.globalNames.count; i++) {
+        writeString(&writer, AS_STRING(vm.globalNames.values[i]));
+    }
+    writeFn(&writer, script);
+    header.globalCount = vm.globalNames.count;
+    header.recordCount = writer.recordCount;
+    rewind(writer.file);
+    fwrite(&header, sizeof(header), 1, writer.file);
+
+    bool isWritten = writer.isCacheable && !ferror(writer.file);
+    if (fclose(writer.file) != 0 || !isWritten ||
+        rename(tmpPath, path) != 0) {
+        unlink(tmpPath);
+    }
+    FREE(char, tmpPath);
+}
+
+static uint32_t writeString(Writer *writer, ObjString *str) {
+    writeRecordHeader(writer, RECORD_STRING, str->length);
+    if (str->length > 0) {
+        fwrite(str->str, sizeof(char), str->length, writer->file);
+    }
+    writePadding(writer, str->length);
+    return writer->recordCount++;
+}
+
+// writeFn writes the functions and strings among the constants of fn before
+// fn itself, and returns the record fn is in.
+static uint32_t writeFn(Writer *writer, ObjFn *fn) {
+    Chunk *chunk = &fn->chunk;
+    int constantCount = chunk->constants.count;
+    CachedConstant *constants = ALLOCATE(CachedConstant, constantCount);
+    for (int i = 0; i < constantCount; i++) {
+        Value value = chunk->constants.values[i];
+        bool isObj = IS_OBJ(value);
+        constants[i] = (CachedConstant){isObj, 0, isObj ? NIL_VAL : value};
+        if (IS_FN(value)) {
+            constants[i].record = writeFn(writer, AS_FN(value));
+        } else if (IS_STRING(value)) {
+            constants[i].record = writeString(writer, AS_STRING(value));
+        } else if (IS_OBJ(value)) {
+            writer->isCacheable = false;
+        }
+    }
+    FnRecord record = {
+        .arity = fn->arity,
+        .upvalueCount = fn->upvalueCount,
+        .count = chunk->count,
+        .constantCount = constantCount,
+        .name = fn->name ? writeString(writer, fn->name) : NO_RECORD,
+    };
+    if (fn->lazySource) {
+        record.lazyLine = fn->lazyLine;
+        record.lazyOffset = (uint32_t)(fn->lazySource - writer->source);
+    }
+
+    size_t size = sizeof(record) + sizeof(CachedConstant) * constantCount +
+                  (sizeof(int) + sizeof(uint8_t)) * chunk->count;
+    writeRecordHeader(writer, RECORD_FN, size);
+    fwrite(&record, sizeof(record), 1, writer->file);
+    if (constantCount > 0) {
+        fwrite(constants, sizeof(CachedConstant), constantCount, writer->file);
+    }
+    if (chunk->count > 0) {
+        fwrite(chunk->lines, sizeof(int), chunk->count, writer->file);
+        fwrite(chunk->codes, sizeof(uint8_t), chunk->count, writer->file);
+    }
+    writePadding(writer, size);
+    FREE(CachedConstant, constants);
+    return writer->recordCount++;
+}
+
+static void writeRecordHeader(Writer *writer, RecordType type, size_t size) {
+    RecordHeader header = {type, (uint32_t)size};
+    fwrite(&header, sizeof(header), 1, writer->file);
+}
+
+static void writePadding(Writer *writer, size_t size) {
+    static const uint8_t zeros[8] = {0};
+    fwrite(zeros, sizeof(uint8_t), paddedSize(size) - size, writer->file);
+}
+
+static size_t paddedSize(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
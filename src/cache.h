@@ -0,0 +1,27 @@
+#ifndef dojo_cache_h
+#define dojo_cache_h
+
+#include "common.h"
+#include "object.h"
+
+// Bump CACHE_VERSION whenever the bytecode the compiler emits, or the layout
+// of a cache file, changes, so that older cache files are recompiled.
+#define CACHE_VERSION 2
+
+// A CacheFile is a cache file mapped into memory. The code, line tables and
+// strings of the functions loaded from it stay in the mapping, so it is only
+// closed once the VM has freed them.
+typedef struct {
+    void *data; // NULL when no file is mapped.
+    size_t size;
+} CacheFile;
+
+uint64_t cacheKey(const char *source);
+ObjFn *loadCache(const char *path, uint64_t key, const char *source,
+                 CacheFile *file);
+void saveCache(const char *path, uint64_t key, const char *source,
+               ObjFn *script);
+void closeCache(CacheFile *file);
+void markCacheRoots();
+
+#endif
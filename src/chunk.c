@@ -1,9 +1,21 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
+#include "trace.h"
 #include "vm.h"
 #include <stdint.h>
 
 static void growLinesAndCodes(Chunk *chunk);
+static int instructionCells(Chunk *chunk, int offset);
+static bool hasInlineCache(Chunk *chunk, int offset);
+static Cell *threadInstruction(Chunk *chunk, int offset, Cell *cell,
+                               Cell *cells, int *cellIndex,
+                               InlineCache **cache,
+                               const void *const *handlers);
+static uint16_t readJump(Chunk *chunk, int end);
+static int stackEffect(const uint8_t *bytes);
+static int namedSlots(const uint8_t *bytes);
+static bool isFallingThrough(Opcode op);
 
 void initChunk(Chunk *chunk) {
     chunk->capacity = 0;
@@ -11,11 +23,14 @@ void initChunk(Chunk *chunk) {
     chunk->lines = NULL;
     chunk->codes = NULL;
     initValueArray(&chunk->constants);
+    chunk->isMapped = false;
 }
 
 void freeChunk(Chunk *chunk) {
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    FREE_ARRAY(uint8_t, chunk->codes, chunk->capacity);
+    if (!chunk->isMapped) {
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+        FREE_ARRAY(uint8_t, chunk->codes, chunk->capacity);
+    }
     freeValueArray(&chunk->constants);
 }
 
@@ -45,4 +60,493 @@ int addConstantToChunk(Chunk *chunk, Value value) {
 
 Value getConstantAtIndex(Chunk *chunk, int index) {
     return chunk->constants.values[index];
-}
\ No newline at end of file
+}
+int instructionLength(Chunk *chunk, int offset) {
+    switch (chunk->codes[offset]) {
+    case OP_CLOSURE: {
+        ObjFn *fn = AS_FN(getConstantAtIndex(chunk, chunk->codes[offset + 1]));
+        return 2 + fn->upvalueCount * 2;
+    }
+    case OP_SUPER_INVOKE:
+    case OP_INVOKE:
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_ADD_LOCALS:
+    case OP_SUBTRACT_LOCALS:
+    case OP_MULTIPLY_LOCALS:
+    case OP_DIVIDE_LOCALS:
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_MOVE:
+    case OP_LOAD_CONSTANT:
+        return 3;
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+        return 4;
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RR:
+    case OP_JUMP_IF_NOT_GREATER_RR:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RR:
+    case OP_JUMP_IF_NOT_LESS_RK:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RK:
+    case OP_JUMP_IF_NOT_GREATER_RK:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RK:
+        return 5;
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_CONSTANT:
+    case OP_TEMPLATE:
+    case OP_POPN:
+    case OP_RETURN_CONSTANT:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+// jumpTarget returns the offset an instruction may jump to, or -1 if it does
+// not jump. The jump distance is always the last two bytes of an instruction
+// and is relative to the instruction that follows it.
+int jumpTarget(Chunk *chunk, int offset) {
+    int length = instructionLength(chunk, offset);
+    switch (chunk->codes[offset]) {
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RR:
+    case OP_JUMP_IF_NOT_GREATER_RR:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RR:
+    case OP_JUMP_IF_NOT_LESS_RK:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RK:
+    case OP_JUMP_IF_NOT_GREATER_RK:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RK:
+        return offset + length + readJump(chunk, offset + length);
+    case OP_LOOP:
+        return offset + length - readJump(chunk, offset + length);
+    default:
+        return -1;
+    }
+}
+
+// maxStackDepth returns the most slots the code of chunk has in use at once,
+// in a frame whose first depth slots, its callee and arguments, are there
+// when it starts. The compiler emits structured code, so a single pass sees
+// every forward jump before its target, and a loop always returns to the
+// depth it started at.
+int maxStackDepth(Chunk *chunk, int depth) {
+    int *targetDepths = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++) {
+        targetDepths[i] = -1;
+    }
+    int maxDepth = depth;
+    bool isReached = true;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        int targetDepth = targetDepths[offset];
+        if (targetDepth != -1 && (!isReached || targetDepth > depth)) {
+            depth = targetDepth;
+        }
+        const uint8_t *bytes = &chunk->codes[offset];
+        depth += stackEffect(bytes);
+        int slots = namedSlots(bytes);
+        if (depth > maxDepth) {
+            maxDepth = depth;
+        }
+        if (slots > maxDepth) {
+            maxDepth = slots;
+        }
+        int target = jumpTarget(chunk, offset);
+        if (target > offset && depth > targetDepths[target]) {
+            targetDepths[target] = depth;
+        }
+        isReached = isFallingThrough(bytes[0]);
+    }
+    FREE(int, targetDepths);
+    return maxDepth;
+}
+
+// stackEffect returns how many values the instruction at bytes leaves on the
+// stack, less those it takes. A call counts the value it returns, as the
+// frame of the callee reserves its own slots.
+static int stackEffect(const uint8_t *bytes) {
+    switch (bytes[0]) {
+    case OP_CLASS:
+    case OP_CLOSURE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_CONSTANT:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NIL:
+    case OP_ADD_LOCALS:
+    case OP_SUBTRACT_LOCALS:
+    case OP_MULTIPLY_LOCALS:
+    case OP_DIVIDE_LOCALS:
+    case OP_GET_LOCAL_PROPERTY:
+        return 1;
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_DEFINE_GLOBAL:
+    case OP_CLOSE_UPVALUE:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_ASSIGN:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_AND:
+    case OP_OR:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_BITWISE_AND:
+    case OP_BITWISE_OR:
+    case OP_BITWISE_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    case OP_POP:
+        return -1;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return -2;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return -bytes[1];
+    case OP_INVOKE:
+        return -bytes[2];
+    case OP_SUPER_INVOKE:
+        // The superclass is on top of the arguments.
+        return -bytes[2] - 1;
+    case OP_TEMPLATE:
+        // Every span is an expression and a string, after the head.
+        return -bytes[1] * 2;
+    case OP_POPN:
+        return -bytes[1];
+    default:
+        return 0;
+    }
+}
+
+// namedSlots returns how many slots a register op needs for the slots it
+// names, which may be above the temporaries on the stack, or 0 for any other
+// instruction.
+static int namedSlots(const uint8_t *bytes) {
+    int count;
+    switch (bytes[0]) {
+    case OP_LOAD_CONSTANT:
+    case OP_JUMP_IF_NOT_LESS_RK:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RK:
+    case OP_JUMP_IF_NOT_GREATER_RK:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RK:
+        count = 1;
+        break;
+    case OP_MOVE:
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RR:
+    case OP_JUMP_IF_NOT_GREATER_RR:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RR:
+        count = 2;
+        break;
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+        count = 3;
+        break;
+    default:
+        return 0;
+    }
+    int slots = 0;
+    for (int i = 1; i <= count; i++) {
+        if (bytes[i] + 1 > slots) {
+            slots = bytes[i] + 1;
+        }
+    }
+    return slots;
+}
+
+// isFallingThrough tells whether the instruction after op may run next.
+static bool isFallingThrough(Opcode op) {
+    switch (op) {
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_RETURN:
+    case OP_RETURN_CONSTANT:
+        return false;
+    default:
+        return true;
+    }
+}
+
+void initThreadedCode(ThreadedCode *code) {
+    code->count = 0;
+    code->cells = NULL;
+    code->offsets = NULL;
+    code->cacheCount = 0;
+    code->caches = NULL;
+    code->stackSize = 0;
+}
+
+void freeThreadedCode(ThreadedCode *code) {
+    FREE_ARRAY(Cell, code->cells, code->count);
+    FREE_ARRAY(int, code->offsets, code->count);
+    FREE_ARRAY(InlineCache, code->caches, code->cacheCount);
+    initThreadedCode(code);
+}
+
+// threadChunk decodes the bytecode once so the VM no longer has to. Jump
+// offsets become cell pointers, so the first pass records where every
+// instruction lands before the second pass fills in the cells.
+void threadChunk(Chunk *chunk, ThreadedCode *code,
+                 const void *const *handlers) {
+    int *cellIndex = ALLOCATE(int, chunk->count);
+    int count = 0;
+    int cacheCount = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        cellIndex[offset] = count;
+        count += instructionCells(chunk, offset);
+        cacheCount += hasInlineCache(chunk, offset);
+    }
+
+    Cell *cells = GC_ALLOCATE(Cell, count);
+    int *offsets = GC_ALLOCATE(int, count);
+    InlineCache *caches = GC_ALLOCATE(InlineCache, cacheCount);
+    Cell *cell = cells;
+    InlineCache *cache = caches;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        Cell *next = threadInstruction(chunk, offset, cell, cells, cellIndex,
+                                       &cache, handlers);
+        while (cell < next) {
+            offsets[cell++ - cells] = offset;
+        }
+    }
+    FREE(int, cellIndex);
+
+    code->cells = cells;
+    code->offsets = offsets;
+    code->count = count;
+    code->caches = caches;
+    code->cacheCount = cacheCount;
+}
+
+// cellAtOffset finds the first cell of the instruction at offset.
+Cell *cellAtOffset(ThreadedCode *code, int offset) {
+    int low = 0;
+    int high = code->count - 1;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (code->offsets[mid] < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return &code->cells[low];
+}
+
+static int instructionCells(Chunk *chunk, int offset) {
+    if (chunk->codes[offset] == OP_LOOP) {
+        // The target cell and the countdown to recording a trace.
+        return 3;
+    }
+    if (hasInlineCache(chunk, offset)) {
+        // The cache goes in a cell after the operands.
+        return instructionLength(chunk, offset) + 1;
+    }
+    if (jumpTarget(chunk, offset) != -1) {
+        // The two jump bytes collapse into a single target cell.
+        return instructionLength(chunk, offset) - 1;
+    }
+    return instructionLength(chunk, offset);
+}
+
+static bool hasInlineCache(Chunk *chunk, int offset) {
+    switch (chunk->codes[offset]) {
+    case OP_INVOKE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_LOCAL_PROPERTY:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static Cell *threadInstruction(Chunk *chunk, int offset, Cell *cell,
+                               Cell *cells, int *cellIndex,
+                               InlineCache **cache,
+                               const void *const *handlers) {
+    uint8_t *bytes = &chunk->codes[offset];
+#ifdef DOJO_COMPUTED_GOTO
+    (cell++)->handler = handlers[bytes[0]];
+#else
+    (cell++)->opcode = bytes[0];
+#endif
+    switch (bytes[0]) {
+    case OP_CLOSURE: {
+        (cell++)->value = getConstantAtIndex(chunk, bytes[1]);
+        int length = instructionLength(chunk, offset);
+        for (int i = 2; i < length; i++) {
+            (cell++)->operand = bytes[i];
+        }
+        break;
+    }
+    case OP_SUPER_INVOKE:
+    case OP_INVOKE:
+        (cell++)->string = AS_STRING(getConstantAtIndex(chunk, bytes[1]));
+        (cell++)->operand = bytes[2];
+        break;
+    case OP_LOOP:
+        (cell++)->target = cells + cellIndex[jumpTarget(chunk, offset)];
+        (cell++)->counter = (LoopCounter){TRACE_THRESHOLD, TRACE_ATTEMPTS};
+        break;
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        (cell++)->target = cells + cellIndex[jumpTarget(chunk, offset)];
+        break;
+    case OP_ADD_LOCALS:
+    case OP_SUBTRACT_LOCALS:
+    case OP_MULTIPLY_LOCALS:
+    case OP_DIVIDE_LOCALS:
+        (cell++)->operand = bytes[1];
+        (cell++)->operand = bytes[2];
+        break;
+    case OP_GET_LOCAL_PROPERTY:
+        (cell++)->operand = bytes[1];
+        (cell++)->string = AS_STRING(getConstantAtIndex(chunk, bytes[2]));
+        break;
+    case OP_MOVE:
+        (cell++)->operand = bytes[1];
+        (cell++)->operand = bytes[2];
+        break;
+    case OP_LOAD_CONSTANT:
+        (cell++)->operand = bytes[1];
+        (cell++)->value = getConstantAtIndex(chunk, bytes[2]);
+        break;
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+        (cell++)->operand = bytes[1];
+        (cell++)->operand = bytes[2];
+        (cell++)->operand = bytes[3];
+        break;
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+        (cell++)->operand = bytes[1];
+        (cell++)->operand = bytes[2];
+        (cell++)->value = getConstantAtIndex(chunk, bytes[3]);
+        break;
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RR:
+    case OP_JUMP_IF_NOT_GREATER_RR:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RR:
+        (cell++)->operand = bytes[1];
+        (cell++)->operand = bytes[2];
+        (cell++)->target = cells + cellIndex[jumpTarget(chunk, offset)];
+        break;
+    case OP_JUMP_IF_NOT_LESS_RK:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RK:
+    case OP_JUMP_IF_NOT_GREATER_RK:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RK:
+        (cell++)->operand = bytes[1];
+        (cell++)->value = getConstantAtIndex(chunk, bytes[2]);
+        (cell++)->target = cells + cellIndex[jumpTarget(chunk, offset)];
+        break;
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+        (cell++)->string = AS_STRING(getConstantAtIndex(chunk, bytes[1]));
+        break;
+    case OP_CONSTANT:
+    case OP_RETURN_CONSTANT:
+        (cell++)->value = getConstantAtIndex(chunk, bytes[1]);
+        break;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+        (cell++)->operand = (int)AS_NUMBER(getConstantAtIndex(chunk, bytes[1]));
+        break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_TEMPLATE:
+    case OP_POPN:
+        (cell++)->operand = bytes[1];
+        break;
+    default:
+        break;
+    }
+    if (hasInlineCache(chunk, offset)) {
+        (*cache)->count = 0;
+        (cell++)->cache = (*cache)++;
+    }
+    return cell;
+}
+
+// readJump reads the jump distance stored in the two bytes before end.
+static uint16_t readJump(Chunk *chunk, int end) {
+    return (uint16_t)((chunk->codes[end - 2] << 8) | chunk->codes[end - 1]);
+}
@@ -12,7 +12,14 @@ typedef enum {
     OP_SUPER_INVOKE,
     OP_INVOKE,
     OP_CALL,
+    // A call in tail position. A closure takes over the frame of the caller;
+    // any other callee is called as by OP_CALL and the OP_RETURN that always
+    // follows returns its result.
+    OP_TAIL_CALL,
     OP_RETURN,
+    // Gives the value on top of the stack to the fiber that resumed the
+    // running one, and is replaced by the value of the next resume.
+    OP_YIELD,
     // Variable
     OP_DEFINE_GLOBAL,
     OP_GET_GLOBAL,
@@ -44,6 +51,13 @@ typedef enum {
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+    // Integer-only binary ops, on ints and on doubles holding one.
+    OP_MODULO,
+    OP_BITWISE_AND,
+    OP_BITWISE_OR,
+    OP_BITWISE_XOR,
+    OP_SHIFT_LEFT,
+    OP_SHIFT_RIGHT,
     // Unary
     OP_NOT,
     OP_NEGATE,
@@ -56,7 +70,74 @@ typedef enum {
     // Stack Op
     OP_POP,
     OP_POPN,
-    OP_PUSH
+    OP_PUSH,
+    // Superinstructions
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_LESS_EQUAL,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_EQUAL,
+    OP_ADD_LOCALS,
+    OP_SUBTRACT_LOCALS,
+    OP_MULTIPLY_LOCALS,
+    OP_DIVIDE_LOCALS,
+    OP_GET_LOCAL_PROPERTY,
+    OP_RETURN_CONSTANT,
+    // Register backend: three-address ops on frame slots. The RR forms take
+    // two slots, the RK forms a slot and a constant.
+    OP_MOVE,
+    OP_LOAD_CONSTANT,
+    OP_ADD_RR,
+    OP_SUBTRACT_RR,
+    OP_MULTIPLY_RR,
+    OP_DIVIDE_RR,
+    OP_ADD_RK,
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RK,
+    OP_JUMP_IF_NOT_LESS_RR,
+    OP_JUMP_IF_NOT_LESS_EQUAL_RR,
+    OP_JUMP_IF_NOT_GREATER_RR,
+    OP_JUMP_IF_NOT_GREATER_EQUAL_RR,
+    OP_JUMP_IF_NOT_LESS_RK,
+    OP_JUMP_IF_NOT_LESS_EQUAL_RK,
+    OP_JUMP_IF_NOT_GREATER_RK,
+    OP_JUMP_IF_NOT_GREATER_EQUAL_RK,
+    // Only in threaded code: an OP_LOOP whose loop runs as a compiled trace.
+    OP_LOOP_TRACE,
+    // Only in threaded code: quickened forms the VM rewrites an instruction
+    // to once it has seen what it works on. A quickened call checks that its
+    // callee is still a closure of the right arity, and turns back into
+    // OP_CALL when it is not. A global that has been defined stays defined.
+    // The _INT and _NUM forms of arithmetic and compares take two ints or two
+    // doubles, and turn back into the generic op on anything else, or when
+    // the int result would overflow.
+    OP_CALL_CLOSURE,
+    OP_GET_GLOBAL_DEFINED,
+    OP_SET_GLOBAL_DEFINED,
+    OP_ADD_INT,
+    OP_ADD_NUM,
+    OP_SUBTRACT_INT,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_INT,
+    OP_MULTIPLY_NUM,
+    OP_LESS_INT,
+    OP_LESS_NUM,
+    OP_LESS_EQUAL_INT,
+    OP_LESS_EQUAL_NUM,
+    OP_GREATER_INT,
+    OP_GREATER_NUM,
+    OP_GREATER_EQUAL_INT,
+    OP_GREATER_EQUAL_NUM,
+    OP_JUMP_IF_NOT_LESS_INT,
+    OP_JUMP_IF_NOT_LESS_NUM,
+    OP_JUMP_IF_NOT_LESS_EQUAL_INT,
+    OP_JUMP_IF_NOT_LESS_EQUAL_NUM,
+    OP_JUMP_IF_NOT_GREATER_INT,
+    OP_JUMP_IF_NOT_GREATER_NUM,
+    OP_JUMP_IF_NOT_GREATER_EQUAL_INT,
+    OP_JUMP_IF_NOT_GREATER_EQUAL_NUM
 } Opcode;
 
 typedef struct {
@@ -65,12 +146,79 @@ typedef struct {
     int *lines;
     uint8_t *codes;
     ValueArray constants;
+    bool isMapped; // The lines and codes are in a cache file, not owned.
 } Chunk;
 
+// An InlineCache remembers where a property access or method call found its
+// name, for up to IC_ENTRIES instance shapes. A site that sees more shapes
+// than that is megamorphic and always looks the name up.
+#define IC_ENTRIES 4
+#define IC_MEGAMORPHIC (IC_ENTRIES + 1)
+
+typedef struct {
+    struct ObjShape *shape;
+    struct ObjShape *next; // The shape after a set adds the field, or NULL.
+    int version;  // The class version when the entry was filled.
+    int index;    // The field's slot in the instance's fields, or -1.
+    Value method; // The method found when index is -1.
+} CacheEntry;
+
+typedef struct InlineCache {
+    int count;
+    CacheEntry entries[IC_ENTRIES];
+} InlineCache;
+
+// A LoopCounter counts down the back-edges of a loop to recording a trace.
+typedef struct {
+    int countdown;
+    int attempts; // Recordings left before the loop is given up on.
+} LoopCounter;
+
+// A Cell is one word of pre-decoded code. The first cell of an instruction
+// holds its handler (or its opcode when the VM dispatches with a switch), and
+// the following cells hold its operands already resolved.
+typedef union Cell {
+    const void *handler;
+    int opcode;
+    int operand;
+    Value value;
+    struct ObjString *string;
+    union Cell *target;
+    LoopCounter counter;
+    struct Trace *trace;
+    InlineCache *cache;
+} Cell;
+
+typedef struct {
+    int count;
+    Cell *cells;
+    int *offsets; // Bytecode offset of the instruction each cell came from.
+    int cacheCount;
+    InlineCache *caches; // One for every property access and invoke.
+    int stackSize;       // The most slots a frame of the chunk uses.
+} ThreadedCode;
+
+// Machine code the JIT compiled a chunk into. calls counts the calls made
+// while the chunk is still interpreted, so hot chunks can be tiered up.
+typedef struct {
+    int calls;
+    size_t size;
+    void *entry; // NULL until the chunk is compiled.
+} JitCode;
+
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void addCodeToChunk(Chunk *chunk, Opcode code, int line);
 int addConstantToChunk(Chunk *chunk, Value value);
 Value getConstantAtIndex(Chunk *chunk, int index);
+int instructionLength(Chunk *chunk, int offset);
+int jumpTarget(Chunk *chunk, int offset);
+int maxStackDepth(Chunk *chunk, int depth);
+
+void initThreadedCode(ThreadedCode *code);
+void freeThreadedCode(ThreadedCode *code);
+NOINLINE void threadChunk(Chunk *chunk, ThreadedCode *code,
+                          const void *const *handlers);
+Cell *cellAtOffset(ThreadedCode *code, int offset);
 
 #endif
\ No newline at end of file
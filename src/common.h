@@ -8,6 +8,56 @@
 #include <stdlib.h>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+
+// Threaded dispatch relies on the "labels as values" extension. Build with
+// DISPATCH=switch to force the portable switch loop.
+#if defined(__GNUC__) && !defined(DOJO_NO_COMPUTED_GOTO)
+#define DOJO_COMPUTED_GOTO
+#endif
+
+// Keeps rarely taken slow paths from being inlined into the hot call path.
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+// Marks the branch a fast path is expected to take, which GCC would otherwise
+// lay out of line when it tests for equality.
+#ifdef __GNUC__
+#define LIKELY(condition) __builtin_expect(!!(condition), 1)
+#else
+#define LIKELY(condition) (condition)
+#endif
+
+// Integer arithmetic that reports whether the result overflowed int32. Without
+// the GCC builtins the result is computed in 64 bits, which no int32 sum,
+// difference or product can overflow, and checked against the int32 range.
+#ifdef __GNUC__
+#define ADD_OVERFLOW_INT32(a, b, result) __builtin_add_overflow(a, b, result)
+#define SUB_OVERFLOW_INT32(a, b, result) __builtin_sub_overflow(a, b, result)
+#define MUL_OVERFLOW_INT32(a, b, result) __builtin_mul_overflow(a, b, result)
+#else
+static inline bool narrowInt32(int64_t wide, int32_t *result) {
+    *result = (int32_t)wide;
+    return wide < INT32_MIN || wide > INT32_MAX;
+}
+#define ADD_OVERFLOW_INT32(a, b, result)                                       \
+    narrowInt32((int64_t)(a) + (int64_t)(b), result)
+#define SUB_OVERFLOW_INT32(a, b, result)                                       \
+    narrowInt32((int64_t)(a) - (int64_t)(b), result)
+#define MUL_OVERFLOW_INT32(a, b, result)                                       \
+    narrowInt32((int64_t)(a) * (int64_t)(b), result)
+#endif
+
+// Marks the state of the isolate a thread has entered: the VM, the garbage
+// collector, the frontend, the compiler and the JITs. A thread runs one
+// isolate at a time, and enterIsolate swaps in another of those it created;
+// an isolate never moves to another thread. Scripts on different threads
+// share nothing that either writes. The options set from the command line
+// are read by all of them.
+#define ISOLATE_LOCAL _Thread_local
+
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 // #define DEBUG_LOG_BYTECODE
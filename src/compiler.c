@@ -10,24 +10,71 @@
 #include "scanner.h"
 #include "value.h"
 #include "vm.h"
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define NOT_INITIALIZED -1
 #define JUMP_PLACEHOLDER 0xff
 
+// A GlobalUse is a constant of fn that a compile worker left holding the name
+// of a global, which has no slot until the body is adopted.
+typedef struct {
+    ObjFn *fn;
+    int index;
+} GlobalUse;
+
+typedef enum {
+    JOB_QUEUED,
+    JOB_COMPILING,
+    JOB_TAKEN, // Compiled on the thread that queued it after all.
+    JOB_DONE,
+} JobState;
+
+// A CompileJob is the body of a global function, which a compile worker
+// compiles from the tree compile parsed it into. The worker compiles it into
+// objects of its own, which the function's first call adopts into the heap.
+struct CompileJob {
+    struct CompileJob *nextQueued;
+    struct CompileJob *nextOwned; // In the jobs of the isolate that queued it.
+    JobState state;
+    Node *decl;
+    NodeBlock *nodes; // Freed once decl is compiled.
+    ObjFn *body;      // NULL after an error.
+    Obj *objs;        // Every object compiling body allocated.
+    size_t size;      // The bytes objs hold.
+    GlobalUse *globals;
+    int globalCount;
+    int globalCapacity;
+    char *errors; // What the compiler reported.
+    size_t errorsSize;
+};
+
+// The CompilePool is shared by the isolates of every thread, whose jobs its
+// workers take in order. The workers are started with the first job, and
+// wait for more until the process exits.
+typedef struct {
+    CompileJob *head;
+    CompileJob *tail;
+    int workerCount;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+} CompilePool;
+
 static void initLoopState(LoopState *state);
 static void initLocalState(LocalState *state);
 static void claimFirstLocal(LocalState *state, FnType type);
 
 static void compileStmts(Node *node);
 static void compileNode(Node *node);
-static void freeStmts(Node *AST);
-static void freeNode(Node *node);
 
 static void compileHeritage(Token *child, Node *heritage);
-static void compileCall(Node *call);
+static void compileCall(Node *call, Opcode op);
+static bool isTailCall(Node *expr);
 static void compileSuperInvocation(Node *call);
 static void compileInvocation(Node *call);
 static void compileVar(Token *name);
@@ -37,11 +84,44 @@ static void compileVarDeclValue(Node *operand);
 static void compileAssignVariable(Node *assignment);
 static void compileAssignProperty(Node *assignment);
 static void compileFn(Node *fn, FnType type);
+static ObjFn *compileFnCode(Compiler *compiler, Node *fn, FnType type);
+static ObjFn *declareLazyFn(Node *fn);
+static bool compileLazyTree(ObjFn *fn, Node *decl);
+static int countParams(Node *params);
 static void compileParams(Node *params);
 static uint8_t compileArgs(Token *fnName, Node *args);
 static void compileFnBody(Node *body);
 static void emitUpvalues(UpvalueState *state, int count);
 
+/* ------------------------------ COMPILE JOBS ------------------------------ */
+static void queueJob(ObjFn *fn, Node *decl);
+static void startCompileWorkers();
+static void *runCompileWorker(void *arg);
+static void compileJob(CompileJob *job);
+static uint8_t useGlobal(ObjString *name);
+static bool finishJob(ObjFn *fn);
+static bool adoptJob(ObjFn *fn, CompileJob *job);
+static ObjString *adoptString(ObjString *str);
+static void unqueueJob(CompileJob *job);
+static void freeJob(CompileJob *job);
+
+/* --------------------------------- CHECKS --------------------------------- */
+static void checkFn(Node *fn, FnType type);
+static void checkStmts(Node *stmts);
+static void checkNode(Node *node);
+static void checkHeritage(Token *child, Node *heritage);
+static void checkArgs(Token *fnName, Node *args);
+static void checkVar(Token *name);
+static void endCheckedScope();
+static bool isThisAllowed(Node *node);
+static void errorIfSuperNotAllowed(Node *node);
+static void errorIfOutsideLoop(Node *node);
+static void errorIfReturnNotAllowed(Node *node);
+static void errorIfYieldNotAllowed(Node *node);
+static void errorIfNotAssignable(Node *assignment);
+static void errorIfSelfInheritance(Token *child, Node *heritage);
+static void errorIfTooManyArgs(Token *fnName, int argCount);
+
 /* ---------------------------------- SCOPE --------------------------------- */
 
 static bool isGlobalScope();
@@ -76,9 +156,10 @@ static bool isAssignable(Node *lhs);
 /* -------------------------------- EMIT OPS -------------------------------- */
 static void emitConstant(Value value);
 static uint8_t pushIdentifier(Token *name);
+static uint8_t pushGlobal(Token *name);
 static uint8_t pushConstant(Value constant);
 static bool findIdentifierConstantIdx(ObjString *identifier, Value *receiver);
-static void emitBranch(Node *branch);
+static void emitBranch(Node *branch, bool popCondition);
 static int emitJump(uint8_t jumpInstruction);
 static void emitLoop(int loopStart);
 static void patchJump(int offset);
@@ -90,6 +171,33 @@ static void emitImplicitReturn();
 static void emitBytes(uint8_t byte1, uint8_t byte2);
 static void emitByte(uint8_t byte);
 
+/* ---------------------------- SUPERINSTRUCTIONS --------------------------- */
+static void emitSuperinstructions(Chunk *chunk);
+static void markJumpTargets(Chunk *chunk, bool *isTarget);
+static int fuseInstruction(Chunk *chunk, int offset, bool *isTarget,
+                           Chunk *fused, int *oldTargets);
+static int fuseCompareJump(Chunk *chunk, int offset, bool *isTarget,
+                           Chunk *fused, int *oldTargets);
+static Opcode compareJumpOpcode(Opcode compare);
+static Opcode localsOpcode(Opcode arithmetic);
+static void copyInstruction(Chunk *chunk, int offset, Chunk *fused,
+                            int *oldTargets);
+static void patchFusedJumps(Chunk *chunk, int *oldTargets, int *newOffsets);
+
+/* ---------------------------- REGISTER BACKEND ---------------------------- */
+static int compileCondition(Node *condition, bool *leavesValue);
+static bool compileRegisterAssignment(Node *assignment);
+static bool isRegisterCondition(Node *condition);
+static int registerExpressionSize(Node *node);
+static int emitRegisterCondition(Node *condition);
+static void emitRegisterExpression(int dst, Node *node, int temp);
+static int emitRegisterOperand(Node *node, int *temp);
+static Opcode registerArithmeticOpcode(TokenType op, bool isConstant);
+static Opcode registerCompareOpcode(TokenType op, bool isConstant);
+static int findLocalSlot(Token *name);
+static uint8_t pushNumber(Node *number);
+static Value numberValue(Node *number);
+
 /* ----------------------------- COMPILER HELPER ---------------------------- */
 static void compilerError(Token *token, const char *msg);
 static void compilerInternalError(const char *msg);
@@ -98,15 +206,27 @@ static LoopState *currentLoopState();
 static Chunk *currentChunk();
 
 /* ------------------------------- STATIC DATA ------------------------------ */
-Compiler *current;
-static ClassState *currentClass = NULL;
-static bool compilerHadError = false;
+ISOLATE_LOCAL Compiler *current;
+static ISOLATE_LOCAL ClassState *currentClass = NULL;
+static ISOLATE_LOCAL bool compilerHadError = false;
+// The jobs the script of this isolate queued, and the job this thread
+// compiles when it is a compile worker.
+static ISOLATE_LOCAL CompileJob *ownedJobs = NULL;
+static ISOLATE_LOCAL CompileJob *compilingJob = NULL;
+static CompilePool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+static Backend backend = BACKEND_STACK;
+// How many workers compile the bodies of global functions while the script
+// runs, or 1 to compile each on the thread of its first call.
+static int compileJobs = 1;
 static Token superToken = {
     .type = TOKEN_EMPTY,
     .length = 5,
     .start = "super",
     .line = -1,
-    .next = NULL,
 };
 
 static Token thisToken = {
@@ -114,14 +234,24 @@ static Token thisToken = {
     .length = 4,
     .start = "this",
     .line = -1,
-    .next = NULL,
 };
 
+void setBackend(Backend selected) {
+    backend = selected;
+}
+
+Backend getBackend() {
+    return backend;
+}
+
+void setCompileJobs(int count) {
+    compileJobs = count;
+}
+
 void initCompiler(Compiler *compiler, FnType type) {
     compiler->enclosing = current;
     compiler->type = type;
     compiler->fn = NULL;
-    compiler->stmts = NULL;
     initLoopState(&compiler->loopState);
     initLocalState(&compiler->localState);
     initMap(&compiler->stringConstants);
@@ -157,8 +287,10 @@ static void claimFirstLocal(LocalState *state, FnType type) {
 }
 
 ObjFn *terminateCompiler(Compiler *compiler) {
+    if (!compilerHadError) {
+        emitSuperinstructions(&compiler->fn->chunk);
+    }
     current = compiler->enclosing;
-    freeStmts(compiler->stmts);
     freeMap(&compiler->stringConstants);
     return compiler->fn;
 }
@@ -172,20 +304,58 @@ void markCompilerRoots() {
     }
 }
 
+// compile compiles source a declaration at a time, so that only the tree of
+// the declaration being compiled is in memory. Once the parser has found an
+// error, the rest is only parsed, for the errors in it. The bodies of global
+// functions are parsed but left for compileLazyFn. With more than 1 compile
+// job, their trees are kept for the compile workers, which compile them while
+// the script runs.
 ObjFn *compile(const char *source) {
     Compiler compiler;
     bool parserError = false;
-    initParser(source);
+    compilerHadError = false;
+    initParser(source, 1);
     initCompiler(&compiler, FN_SCRPIT);
-    current->stmts = parse(&parserError);
-    if (parserError) {
-        terminateCompiler(&compiler);
-        return NULL;
+    Node *decl;
+    while ((decl = parseDeclaration(&parserError)) != NULL) {
+        if (!parserError) {
+            compileNode(decl);
+        }
     }
-    compileStmts(current->stmts);
+    terminateParser();
     emitImplicitReturn();
     ObjFn *script = terminateCompiler(&compiler);
-    return compilerHadError ? NULL : script;
+    return compilerHadError || parserError ? NULL : script;
+}
+
+// compileLazyFn compiles the body of fn, which compile left for its first
+// call. A body queued for a compile worker is finished by finishJob. Any other
+// is compiled from its source, which parsed once already, so only the errors
+// the compiler finds can make it return false.
+bool compileLazyFn(ObjFn *fn) {
+    if (fn->job) {
+        return finishJob(fn);
+    }
+    bool parserError = false;
+    initParser(fn->lazySource, fn->lazyLine);
+    Node *decl = parseFnDeclaration(&parserError);
+    bool isCompiled = !parserError && compileLazyTree(fn, decl);
+    terminateParser();
+    return isCompiled;
+}
+
+// compileLazyTree compiles decl, the declaration of fn, into fn.
+static bool compileLazyTree(ObjFn *fn, Node *decl) {
+    Compiler compiler;
+    compilerHadError = false;
+    ObjFn *body = compileFnCode(&compiler, decl, FN_FN);
+    if (compilerHadError) {
+        return false;
+    }
+    fn->chunk = body->chunk;
+    initChunk(&body->chunk);
+    fn->lazySource = NULL;
+    return true;
 }
 
 static void compileStmts(Node *script) {
@@ -207,12 +377,11 @@ static void compileNode(Node *node) {
     switch (node->type) {
     case ND_CLASS_DECL: {
         if (isGlobalScope()) {
-            uint8_t index = pushIdentifier(node->token);
-            emitBytes(OP_CLASS, index);
-            emitBytes(OP_DEFINE_GLOBAL, index);
+            emitBytes(OP_CLASS, pushIdentifier(&node->token));
+            defineGlobal(&node->token);
         } else {
-            declareLocal(node->token);
-            emitBytes(OP_CLASS, currentLocalState()->count - 1);
+            declareLocal(&node->token);
+            emitBytes(OP_CLASS, pushIdentifier(&node->token));
             defineLatestLocal();
         }
         ClassState state;
@@ -220,8 +389,8 @@ static void compileNode(Node *node) {
         state.hasSuperClass = false;
         currentClass = &state;
 
-        compileHeritage(node->token, node->operand);
-        compileVar(node->token);
+        compileHeritage(&node->token, node->operand);
+        compileVar(&node->token);
 
         Node *method = node->thenBranch;
         while (method) {
@@ -238,9 +407,9 @@ static void compileNode(Node *node) {
         break;
     }
     case ND_METHOD: {
-        uint8_t index = pushIdentifier(node->token);
-        FnType type = isIdentifiersEqual("init", 4, node->token->start,
-                                         node->token->length)
+        uint8_t index = pushIdentifier(&node->token);
+        FnType type = isIdentifiersEqual("init", 4, node->token.start,
+                                         node->token.length)
                           ? FN_INIT
                           : FN_METHOD;
         compileFn(node, type);
@@ -248,15 +417,8 @@ static void compileNode(Node *node) {
         break;
     }
     case ND_SUPER: {
-        if (!currentClass) {
-            compilerError(node->token,
-                          "Cannot use 'super' outside of a class.");
-        }
-        if (!currentClass->hasSuperClass) {
-            compilerError(node->token,
-                          "Cannot user 'super' in a class with no superclass.");
-        }
-        uint8_t index = pushIdentifier(node->token);
+        errorIfSuperNotAllowed(node);
+        uint8_t index = pushIdentifier(&node->token);
         compileThis();
         compileSuper();
         emitBytes(OP_GET_SUPER, index);
@@ -264,26 +426,31 @@ static void compileNode(Node *node) {
     }
     case ND_FN_DECL:
         if (isGlobalScope()) {
-            compileFn(node, FN_FN);
-            defineGlobal(node->token);
+            checkFn(node, FN_FN);
+            ObjFn *fn = declareLazyFn(node);
+            defineGlobal(&node->token);
+            // Queued last, as a worker may free the tree of node at once.
+            if (compileJobs > 1) {
+                queueJob(fn, node);
+            }
         } else {
             // Recursive function "uses" itself before it is fully defined.
             // So we have to allow this.
-            declareLocal(node->token);
+            declareLocal(&node->token);
             defineLatestLocal();
             compileFn(node, FN_FN);
         }
         break;
     case ND_PARAM:
-        declareLocal(node->token);
+        declareLocal(&node->token);
         defineLatestLocal();
         break;
     case ND_VAR_DECL: {
         if (isGlobalScope()) {
             compileVarDeclValue(node->operand);
-            defineGlobal(node->token);
+            defineGlobal(&node->token);
         } else {
-            declareLocal(node->token);
+            declareLocal(&node->token);
             compileVarDeclValue(node->operand);
             defineLatestLocal();
         }
@@ -297,17 +464,21 @@ static void compileNode(Node *node) {
         compileNode(node->init);
         beginLoop();
         int jumpToEnd = NOT_INITIALIZED;
+        bool leavesValue = false;
         LoopState *state = currentLoopState();
         if (node->operand) {
-            compileNode(node->operand);
-            jumpToEnd = emitJump(OP_JUMP_IF_FALSE);
-            emitByte(OP_POP);
+            jumpToEnd = compileCondition(node->operand, &leavesValue);
+            if (leavesValue) {
+                emitByte(OP_POP);
+            }
         }
         if (node->increment) {
             int jumpToBody = emitJump(OP_JUMP);
             int incrementStart = currentChunk()->count;
-            compileNode(node->increment);
-            emitByte(OP_POP);
+            if (!compileRegisterAssignment(node->increment)) {
+                compileNode(node->increment);
+                emitByte(OP_POP);
+            }
             emitLoop(state->innermostLoopStart);
             state->innermostLoopStart = incrementStart;
             patchJump(jumpToBody);
@@ -317,7 +488,9 @@ static void compileNode(Node *node) {
         emitLoop(state->innermostLoopStart);
         if (jumpToEnd != NOT_INITIALIZED) {
             patchJump(jumpToEnd);
-            emitByte(OP_POP);
+            if (leavesValue) {
+                emitByte(OP_POP);
+            }
         }
         patchBreaks();
         endLoop();
@@ -327,49 +500,44 @@ static void compileNode(Node *node) {
     case ND_WHILE: {
         beginLoop();
         int loopStart = currentChunk()->count;
-        compileNode(node->operand);
-        int jumpToEnd = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        bool leavesValue;
+        int jumpToEnd = compileCondition(node->operand, &leavesValue);
+        if (leavesValue) {
+            emitByte(OP_POP);
+        }
         compileNode(node->thenBranch);
         emitLoop(loopStart);
         patchJump(jumpToEnd);
-        emitByte(OP_POP);
+        if (leavesValue) {
+            emitByte(OP_POP);
+        }
         patchBreaks();
         endLoop();
         break;
     }
     case ND_CONTINUE: {
-        if (!isInLoop()) {
-            compilerError(
-                node->token,
-                "Cannot use continue statement outside a loop statement. ");
-        }
+        errorIfOutsideLoop(node);
         popOrCloseDeeperLocals(currentLoopState()->innermostLoopScopeDepth);
         emitLoop(currentLoopState()->innermostLoopStart);
         break;
     }
     case ND_BREAK: {
-        if (!isInLoop()) {
-            compilerError(
-                node->token,
-                "Cannot use break statement outside a break statement. ");
-        }
+        errorIfOutsideLoop(node);
         popOrCloseDeeperLocals(currentLoopState()->innermostLoopScopeDepth);
         emitJump(OP_JUMP);
         break;
     }
     case ND_TERNARY:
     case ND_IF: {
-        compileNode(node->operand);
-
-        int jumpToElse = emitJump(OP_JUMP_IF_FALSE);
+        bool leavesValue;
+        int jumpToElse = compileCondition(node->operand, &leavesValue);
 
-        emitBranch(node->thenBranch);
+        emitBranch(node->thenBranch, leavesValue);
 
         int jumpToEnd = emitJump(OP_JUMP);
         patchJump(jumpToElse);
 
-        emitBranch(node->elseBranch);
+        emitBranch(node->elseBranch, leavesValue);
 
         patchJump(jumpToEnd);
         break;
@@ -381,24 +549,22 @@ static void compileNode(Node *node) {
         break;
     }
     case ND_RETURN: {
-        if (current->type == FN_SCRPIT) {
-            compilerError(node->token, "Cannot return from top-level code.");
-        }
-        if (current->type == FN_INIT) {
-            compilerError(node->token,
-                          "Cannot return a value form an initializer");
-        }
-        if (node->operand) {
-            compileNode(node->operand);
-        } else {
+        errorIfReturnNotAllowed(node);
+        if (!node->operand) {
             emitByte(OP_NIL);
+        } else if (isTailCall(node->operand)) {
+            compileCall(node->operand, OP_TAIL_CALL);
+        } else {
+            compileNode(node->operand);
         }
         emitByte(OP_RETURN);
         break;
     }
     case ND_EXPRESSION: {
-        compileNode(node->operand);
-        emitByte(OP_POP);
+        if (!compileRegisterAssignment(node->operand)) {
+            compileNode(node->operand);
+            emitByte(OP_POP);
+        }
         break;
     }
     case ND_CALL: {
@@ -407,15 +573,13 @@ static void compileNode(Node *node) {
         } else if (node->lhs->type == ND_SUPER) {
             compileSuperInvocation(node);
         } else {
-            compileCall(node);
+            compileCall(node, OP_CALL);
         }
 
         break;
     }
     case ND_ASSIGNMENT: {
-        if (!isAssignable(node->lhs)) {
-            compilerError(node->token, "Invalid assignment target.");
-        }
+        errorIfNotAssignable(node);
         compileNode(node->rhs);
         if (node->lhs->type == ND_PROPERTY) {
             compileAssignProperty(node);
@@ -442,7 +606,7 @@ static void compileNode(Node *node) {
         break;
     }
     case ND_BINARY: {
-        TokenType op = node->token->type;
+        TokenType op = node->token.type;
         compileNode(node->lhs);
         compileNode(node->rhs);
         emitBinaryOp(op);
@@ -450,56 +614,64 @@ static void compileNode(Node *node) {
     }
     case ND_UNARY: {
         compileNode(node->operand);
-        Opcode code = node->token->type == TOKEN_BANG ? OP_NOT : OP_NEGATE;
+        Opcode code = node->token.type == TOKEN_BANG ? OP_NOT : OP_NEGATE;
         emitByte(code);
         break;
     }
+    case ND_YIELD: {
+        errorIfYieldNotAllowed(node);
+        if (!node->operand) {
+            emitByte(OP_NIL);
+        } else {
+            compileNode(node->operand);
+        }
+        emitByte(OP_YIELD);
+        break;
+    }
     case ND_PROPERTY: {
         compileNode(node->lhs);
-        uint8_t index = pushIdentifier(node->token);
+        uint8_t index = pushIdentifier(&node->token);
         emitBytes(OP_GET_PROPERTY, index);
         break;
     }
     case ND_THIS: {
-        if (!currentClass) {
-            compilerError(node->token,
-                          "Cannot use 'this' keyword outside of class");
+        if (!isThisAllowed(node)) {
             break;
         }
-        compileVar(node->token);
+        compileVar(&node->token);
         break;
     }
     case ND_VAR: {
-        compileVar(node->token);
+        compileVar(&node->token);
         break;
     }
     case ND_NUMBER:
-        emitConstant(NUMBER_VAL(strtod(node->token->start, NULL)));
+        emitConstant(numberValue(node));
         break;
 
     case ND_STRING:
         emitConstant(
-            newObjStringInVal(node->token->start + 1, node->token->length - 2));
+            newObjStringInVal(node->token.start + 1, node->token.length - 2));
         break;
     case ND_TEMPLATE_HEAD:
         compileNode(node->operand);
         emitConstant(
-            newObjStringInVal(node->token->start + 1, node->token->length - 1));
+            newObjStringInVal(node->token.start + 1, node->token.length - 1));
         emitBytes(OP_TEMPLATE, (uint8_t)(node->count));
         break;
     case ND_TEMPLATE_SPAN: {
-        int len = (node->token->type == TOKEN_AFTER_TEMPLATE)
-                      ? node->token->length - 1
-                      : node->token->length;
+        int len = (node->token.type == TOKEN_AFTER_TEMPLATE)
+                      ? node->token.length - 1
+                      : node->token.length;
         if (node->next != NULL) {
             compileNode(node->next);
         }
-        emitConstant(newObjStringInVal(node->token->start, len));
+        emitConstant(newObjStringInVal(node->token.start, len));
         compileNode(node->operand);
         break;
     }
     case ND_LITERAL: {
-        TokenType op = node->token->type;
+        TokenType op = node->token.type;
         if (op == TOKEN_FALSE) {
             emitByte(OP_FALSE);
         } else if (op == TOKEN_TRUE) {
@@ -520,7 +692,7 @@ static void compileNode(Node *node) {
 static void compileHeritage(Token *child, Node *heritage) {
     if (heritage) {
         currentClass->hasSuperClass = true;
-        compileVar(heritage->token);
+        compileVar(&heritage->token);
 
         beginScope();
         Token superToken = syntheticToken("super", 5);
@@ -528,47 +700,57 @@ static void compileHeritage(Token *child, Node *heritage) {
         defineLatestLocal();
 
         compileVar(child);
-        if (isIdentifiersEqual(child->start, child->length,
-                               heritage->token->start,
-                               heritage->token->length)) {
-            compilerError(heritage->token,
-                          "A class cannot inherit from itself");
-        }
+        errorIfSelfInheritance(child, heritage);
         emitByte(OP_INHERIT);
     }
 }
 
-static void compileCall(Node *call) {
-    Node *args = call->operand;
+static void compileCall(Node *call, Opcode op) {
+    Node *args = call->args;
     compileNode(call->lhs);
-    uint8_t argCount = compileArgs(call->lhs->token, args);
-    emitBytes(OP_CALL, argCount);
+    uint8_t argCount = compileArgs(&call->lhs->token, args);
+    emitBytes(op, argCount);
+}
+
+// isTailCall tells whether a returned expr can be compiled to OP_TAIL_CALL.
+// Method invocations keep their own opcodes.
+static bool isTailCall(Node *expr) {
+    return expr->type == ND_CALL && expr->lhs->type != ND_PROPERTY &&
+           expr->lhs->type != ND_SUPER;
 }
 
 static void compileSuperInvocation(Node *call) {
     compileThis();
-    Node *args = call->operand;
-    uint8_t argCount = compileArgs(call->lhs->token, args);
+    Node *args = call->args;
+    uint8_t argCount = compileArgs(&call->lhs->token, args);
     compileSuper();
-    uint8_t index = pushIdentifier(call->lhs->token);
+    uint8_t index = pushIdentifier(&call->lhs->token);
     emitBytes(OP_SUPER_INVOKE, index);
     emitByte(argCount);
 }
 
 static void compileInvocation(Node *call) {
     compileNode(call->lhs->lhs);
-    uint8_t index = pushIdentifier(call->lhs->token);
-    Node *args = call->operand;
-    uint8_t argCount = compileArgs(call->lhs->token, args);
+    uint8_t index = pushIdentifier(&call->lhs->token);
+    Node *args = call->args;
+    uint8_t argCount = compileArgs(&call->lhs->token, args);
     emitBytes(OP_INVOKE, index);
     emitByte(argCount);
 }
 
 static void compileFn(Node *fn, FnType type) {
     Compiler fnCompiler;
-    initCompiler(&fnCompiler, type);
+    ObjFn *resFn = compileFnCode(&fnCompiler, fn, type);
+    emitBytes(OP_CLOSURE, pushConstant(OBJ_VAL(resFn)));
+    emitUpvalues(&fnCompiler.upvalueState, resFn->upvalueCount);
+}
+
+// compileFnCode compiles the function fn declares with compiler, which is
+// left holding the upvalues the function captures.
+static ObjFn *compileFnCode(Compiler *compiler, Node *fn, FnType type) {
+    initCompiler(compiler, type);
     beginScope();
-    current->fn->name = newObjString(fn->token->start, fn->token->length);
+    current->fn->name = newObjString(fn->token.start, fn->token.length);
     compileParams(fn->operand);
     compileFnBody(fn->thenBranch);
     if (type == FN_INIT) {
@@ -576,9 +758,569 @@ static void compileFn(Node *fn, FnType type) {
     } else {
         emitImplicitReturn();
     }
-    ObjFn *resFn = terminateCompiler(&fnCompiler);
-    emitBytes(OP_CLOSURE, pushConstant(OBJ_VAL(resFn)));
-    emitUpvalues(&fnCompiler.upvalueState, resFn->upvalueCount);
+    return terminateCompiler(compiler);
+}
+
+// declareLazyFn makes the closure of a global function, whose body is
+// compiled by compileLazyFn. A global function captures no upvalues.
+static ObjFn *declareLazyFn(Node *fn) {
+    ObjFn *lazyFn = newObjFn();
+    emitBytes(OP_CLOSURE, pushConstant(OBJ_VAL(lazyFn)));
+    lazyFn->name = newObjString(fn->token.start, fn->token.length);
+    lazyFn->arity = countParams(fn->operand);
+    lazyFn->lazySource = fn->token.start;
+    lazyFn->lazyLine = fn->token.line;
+    return lazyFn;
+}
+
+// checkFn runs the checks of the compiler over the body of fn without
+// compiling it, so that the errors in a global function are reported when
+// the script is compiled, whether or not it is called. Only a jump or loop
+// too long to encode is left for the body's first call to report.
+static void checkFn(Node *fn, FnType type) {
+    Compiler checker;
+    initCompiler(&checker, type);
+    beginScope();
+    checkStmts(fn->operand);
+    checkNode(fn->thenBranch);
+    current = checker.enclosing;
+    freeMap(&checker.stringConstants);
+}
+
+static void checkStmts(Node *stmts) {
+    for (; stmts; stmts = stmts->next) {
+        checkNode(stmts);
+    }
+}
+
+// checkNode walks node as compileNode compiles it, declaring and resolving
+// the same variables in the same scopes, and emits nothing.
+static void checkNode(Node *node) {
+    if (node == NULL)
+        return;
+
+    Node *prev = current->currentNode;
+    current->currentNode = node;
+
+    switch (node->type) {
+    case ND_CLASS_DECL: {
+        declareLocal(&node->token);
+        defineLatestLocal();
+        ClassState state;
+        state.enclosing = currentClass;
+        state.hasSuperClass = false;
+        currentClass = &state;
+        checkHeritage(&node->token, node->operand);
+        checkVar(&node->token);
+        checkStmts(node->thenBranch);
+        if (currentClass->hasSuperClass) {
+            endCheckedScope();
+        }
+        currentClass = currentClass->enclosing;
+        break;
+    }
+    case ND_METHOD:
+        checkFn(node, isIdentifiersEqual("init", 4, node->token.start,
+                                         node->token.length)
+                          ? FN_INIT
+                          : FN_METHOD);
+        break;
+    case ND_SUPER:
+        errorIfSuperNotAllowed(node);
+        checkVar(&thisToken);
+        checkVar(&superToken);
+        break;
+    case ND_FN_DECL:
+        declareLocal(&node->token);
+        defineLatestLocal();
+        checkFn(node, FN_FN);
+        break;
+    case ND_PARAM:
+        declareLocal(&node->token);
+        defineLatestLocal();
+        break;
+    case ND_VAR_DECL:
+        declareLocal(&node->token);
+        checkNode(node->operand);
+        defineLatestLocal();
+        break;
+    case ND_FOR:
+        beginScope();
+        checkNode(node->init);
+        beginLoop();
+        checkNode(node->operand);
+        checkNode(node->increment);
+        checkNode(node->thenBranch);
+        endLoop();
+        endCheckedScope();
+        break;
+    case ND_WHILE:
+        beginLoop();
+        checkNode(node->operand);
+        checkNode(node->thenBranch);
+        endLoop();
+        break;
+    case ND_CONTINUE:
+    case ND_BREAK:
+        errorIfOutsideLoop(node);
+        break;
+    case ND_TERNARY:
+    case ND_IF:
+        checkNode(node->operand);
+        checkNode(node->thenBranch);
+        checkNode(node->elseBranch);
+        break;
+    case ND_BLOCK:
+        beginScope();
+        checkStmts(node->operand);
+        endCheckedScope();
+        break;
+    case ND_RETURN:
+        errorIfReturnNotAllowed(node);
+        checkNode(node->operand);
+        break;
+    case ND_CALL:
+        if (node->lhs->type == ND_PROPERTY) {
+            checkNode(node->lhs->lhs);
+            checkArgs(&node->lhs->token, node->args);
+        } else if (node->lhs->type == ND_SUPER) {
+            checkVar(&thisToken);
+            checkArgs(&node->lhs->token, node->args);
+            checkVar(&superToken);
+        } else {
+            checkNode(node->lhs);
+            checkArgs(&node->lhs->token, node->args);
+        }
+        break;
+    case ND_ASSIGNMENT:
+        errorIfNotAssignable(node);
+        checkNode(node->rhs);
+        if (node->lhs->type == ND_PROPERTY) {
+            checkNode(node->lhs->lhs);
+        } else if (node->lhs->type == ND_VAR) {
+            checkVar(&node->lhs->token);
+        }
+        break;
+    case ND_AND:
+    case ND_OR:
+    case ND_BINARY:
+        checkNode(node->lhs);
+        checkNode(node->rhs);
+        break;
+    case ND_YIELD:
+        errorIfYieldNotAllowed(node);
+        checkNode(node->operand);
+        break;
+    case ND_EXPRESSION:
+    case ND_UNARY:
+    case ND_TEMPLATE_HEAD:
+        checkNode(node->operand);
+        break;
+    case ND_TEMPLATE_SPAN:
+        checkNode(node->next);
+        checkNode(node->operand);
+        break;
+    case ND_PROPERTY:
+        checkNode(node->lhs);
+        break;
+    case ND_THIS:
+        if (isThisAllowed(node)) {
+            checkVar(&node->token);
+        }
+        break;
+    case ND_VAR:
+        checkVar(&node->token);
+        break;
+    case ND_NUMBER:
+    case ND_STRING:
+    case ND_LITERAL:
+    case ND_EMPTY:
+        break;
+    }
+
+    current->currentNode = prev;
+}
+
+static void checkHeritage(Token *child, Node *heritage) {
+    if (heritage) {
+        currentClass->hasSuperClass = true;
+        checkVar(&heritage->token);
+        beginScope();
+        Token superToken = syntheticToken("super", 5);
+        declareLocal(&superToken);
+        defineLatestLocal();
+        checkVar(child);
+        errorIfSelfInheritance(child, heritage);
+    }
+}
+
+static void checkArgs(Token *fnName, Node *args) {
+    int argCount = 0;
+    for (; args; args = args->next) {
+        argCount++;
+        checkNode(args);
+        errorIfTooManyArgs(fnName, argCount);
+    }
+}
+
+// checkVar resolves name as compileVar does, capturing it if it is an
+// upvalue.
+static void checkVar(Token *name) {
+    if (resolveLocal(currentLocalState(), name) == -1) {
+        resolveUpvalue(current, name);
+    }
+}
+
+// endCheckedScope is endScope without the code that pops the locals.
+static void endCheckedScope() {
+    LocalState *state = currentLocalState();
+    state->scopeDepth--;
+    while (state->count > 0 &&
+           state->locals[state->count - 1].depth > state->scopeDepth) {
+        state->count--;
+    }
+}
+
+static bool isThisAllowed(Node *node) {
+    if (!currentClass) {
+        compilerError(&node->token,
+                      "Cannot use 'this' keyword outside of class");
+        return false;
+    }
+    return true;
+}
+
+static void errorIfSuperNotAllowed(Node *node) {
+    if (!currentClass) {
+        compilerError(&node->token, "Cannot use 'super' outside of a class.");
+    } else if (!currentClass->hasSuperClass) {
+        compilerError(&node->token,
+                      "Cannot user 'super' in a class with no superclass.");
+    }
+}
+
+static void errorIfOutsideLoop(Node *node) {
+    if (isInLoop()) {
+        return;
+    }
+    if (node->type == ND_CONTINUE) {
+        compilerError(&node->token,
+                      "Cannot use continue statement outside a loop "
+                      "statement. ");
+    } else {
+        compilerError(&node->token,
+                      "Cannot use break statement outside a break "
+                      "statement. ");
+    }
+}
+
+static void errorIfReturnNotAllowed(Node *node) {
+    if (current->type == FN_SCRPIT) {
+        compilerError(&node->token, "Cannot return from top-level code.");
+    }
+    if (current->type == FN_INIT) {
+        compilerError(&node->token,
+                      "Cannot return a value form an initializer");
+    }
+}
+
+static void errorIfYieldNotAllowed(Node *node) {
+    if (current->type == FN_SCRPIT) {
+        compilerError(&node->token, "Cannot yield from top-level code.");
+    }
+}
+
+static void errorIfNotAssignable(Node *assignment) {
+    if (!isAssignable(assignment->lhs)) {
+        compilerError(&assignment->token, "Invalid assignment target.");
+    }
+}
+
+static void errorIfSelfInheritance(Token *child, Node *heritage) {
+    if (isIdentifiersEqual(child->start, child->length, heritage->token.start,
+                           heritage->token.length)) {
+        compilerError(&heritage->token, "A class cannot inherit from itself");
+    }
+}
+
+static void errorIfTooManyArgs(Token *fnName, int argCount) {
+    if (argCount == 255) {
+        compilerError(fnName, "Can't have more than 255 arguments");
+    }
+}
+
+static int countParams(Node *params) {
+    int count = 0;
+    for (; params; params = params->next) {
+        count++;
+    }
+    return count;
+}
+
+// queueJob hands the tree of the global function fn declares to a compile
+// worker, which may free it at once.
+static void queueJob(ObjFn *fn, Node *decl) {
+    CompileJob *job = ALLOCATE(CompileJob, 1);
+    *job = (CompileJob){
+        .nextOwned = ownedJobs,
+        .state = JOB_QUEUED,
+        .decl = decl,
+        .nodes = detachNodes(),
+    };
+    ownedJobs = job;
+    fn->job = job;
+
+    pthread_mutex_lock(&pool.lock);
+    startCompileWorkers();
+    if (pool.tail) {
+        pool.tail->nextQueued = job;
+    } else {
+        pool.head = job;
+    }
+    pool.tail = job;
+    pthread_cond_signal(&pool.queued);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// startCompileWorkers starts the workers of the pool with its first job.
+static void startCompileWorkers() {
+    for (; pool.workerCount < compileJobs; pool.workerCount++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, runCompileWorker, NULL) != 0) {
+            fprintf(stderr, "Could not start a worker.\n");
+            exit(71);
+        }
+        pthread_detach(worker);
+    }
+}
+
+// runCompileWorker compiles the jobs of the pool as they are queued. It only
+// has the context compiling needs, which lasts as long as the worker.
+static void *runCompileWorker(void *arg) {
+    initCompileContext();
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.head == NULL) {
+            pthread_cond_wait(&pool.queued, &pool.lock);
+        }
+        CompileJob *job = pool.head;
+        unqueueJob(job);
+        job->state = JOB_COMPILING;
+        pthread_mutex_unlock(&pool.lock);
+
+        compileJob(job);
+
+        pthread_mutex_lock(&pool.lock);
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&pool.done);
+    }
+    return NULL;
+}
+
+// compileJob compiles the body of job on a worker, whose heap keeps none of
+// the objects it allocates for it. What the compiler reports is kept for the
+// first call, as compileLazyFn would report it then.
+static void compileJob(CompileJob *job) {
+    FILE *err = open_memstream(&job->errors, &job->errorsSize);
+    if (err == NULL) {
+        fprintf(stderr, "Not enough memory to compile a function.\n");
+        exit(74);
+    }
+    setOutput(stdout, err);
+    size_t allocated = gc.allocated;
+    compilingJob = job;
+    compilerHadError = false;
+    Compiler compiler;
+    ObjFn *body = compileFnCode(&compiler, job->decl, FN_FN);
+    compilingJob = NULL;
+    setOutput(stdout, stderr);
+    fclose(err);
+    freeNodeBlocks(job->nodes);
+    job->nodes = NULL;
+    // Each job interns its strings anew, as adoptJob interns them again.
+    freeMap(&vm.stringLiterals);
+    initMap(&vm.stringLiterals);
+    job->body = compilerHadError ? NULL : body;
+    job->objs = vm.objs;
+    job->size = gc.allocated - allocated;
+    vm.objs = NULL;
+}
+
+// useGlobal returns the constant a compile worker leaves the name of a global
+// in, which adoptJob replaces with its slot.
+static uint8_t useGlobal(ObjString *name) {
+    CompileJob *job = compilingJob;
+    ValueArray *constants = &currentChunk()->constants;
+    for (int i = 0; i < job->globalCount; i++) {
+        GlobalUse *use = &job->globals[i];
+        if (use->fn == current->fn &&
+            constants->values[use->index] == OBJ_VAL(name)) {
+            return (uint8_t)use->index;
+        }
+    }
+    uint8_t index = pushConstant(OBJ_VAL(name));
+    if (IS_EXCEEDING_CAPACITY(job->globalCount, job->globalCapacity)) {
+        int capacity = GROW_CAPACITY(job->globalCapacity);
+        job->globals =
+            reallocate(job->globals, sizeof(GlobalUse) * job->globalCapacity,
+                       sizeof(GlobalUse) * capacity);
+        job->globalCapacity = capacity;
+    }
+    job->globals[job->globalCount++] = (GlobalUse){current->fn, index};
+    return index;
+}
+
+// finishJob gives fn the body of its job on the first call. A job no worker
+// has taken yet is compiled here from its tree, and one being compiled is
+// waited for. Later calls of a body that failed compile it from its source
+// again, to report its errors again.
+static bool finishJob(ObjFn *fn) {
+    CompileJob *job = fn->job;
+    fn->job = NULL;
+    pthread_mutex_lock(&pool.lock);
+    if (job->state == JOB_QUEUED) {
+        unqueueJob(job);
+        job->state = JOB_TAKEN;
+    }
+    while (job->state == JOB_COMPILING) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (job->state == JOB_TAKEN) {
+        bool isCompiled = compileLazyTree(fn, job->decl);
+        freeNodeBlocks(job->nodes);
+        job->nodes = NULL;
+        return isCompiled;
+    }
+    return adoptJob(fn, job);
+}
+
+// adoptJob moves the objects of the body a worker compiled for fn into the
+// heap, and makes them refer to its strings and globals.
+static bool adoptJob(ObjFn *fn, CompileJob *job) {
+    gc.allocated += job->size;
+    if (job->body == NULL) {
+        fwrite(job->errors, sizeof(char), job->errorsSize, vm.err);
+        freeObjs(job->objs);
+        job->objs = NULL;
+        return false;
+    }
+
+    int fnCount = 0;
+    Obj *last = job->objs;
+    for (Obj *obj = job->objs; obj; obj = obj->next) {
+        fnCount += obj->type == OBJ_FN;
+        last = obj;
+    }
+    ObjFn **fns = ALLOCATE(ObjFn *, fnCount);
+    fnCount = 0;
+    for (Obj *obj = job->objs; obj; obj = obj->next) {
+        if (obj->type == OBJ_FN) {
+            fns[fnCount++] = (ObjFn *)obj;
+        }
+    }
+    // Every object is reachable from the body, which keeps them all from the
+    // collector while the strings and globals are looked up.
+    last->next = vm.objs;
+    vm.objs = job->objs;
+    job->objs = NULL;
+    push(OBJ_VAL(job->body));
+
+    for (int i = 0; i < fnCount; i++) {
+        ValueArray *constants = &fns[i]->chunk.constants;
+        for (int j = 0; j < constants->count; j++) {
+            if (IS_STRING(constants->values[j])) {
+                constants->values[j] =
+                    OBJ_VAL(adoptString(AS_STRING(constants->values[j])));
+            }
+        }
+        if (fns[i]->name) {
+            fns[i]->name = adoptString(fns[i]->name);
+        }
+    }
+    for (int i = 0; i < job->globalCount; i++) {
+        GlobalUse *use = &job->globals[i];
+        Value *constant = &use->fn->chunk.constants.values[use->index];
+        *constant = NUMBER_VAL((double)globalSlot(AS_STRING(*constant)));
+    }
+    reallocate(fns, sizeof(ObjFn *) * fnCount, 0);
+
+    fn->chunk = job->body->chunk;
+    initChunk(&job->body->chunk);
+    fn->lazySource = NULL;
+    pop();
+    return true;
+}
+
+// adoptString returns the string of the heap equal to str, a string of a
+// compile worker, which becomes that string when there is none.
+static ObjString *adoptString(ObjString *str) {
+    ObjString *interned =
+        mapFindString(&vm.stringLiterals, str->str, str->length, str->hash);
+    if (interned) {
+        return interned;
+    }
+    mapPut(&vm.stringLiterals, str, NIL_VAL);
+    return str;
+}
+
+// discardCompileJobs frees the jobs of the script that ran last. The workers
+// compiling any of them are waited for, as its tree points into the source.
+void discardCompileJobs() {
+    while (ownedJobs) {
+        CompileJob *job = ownedJobs;
+        ownedJobs = job->nextOwned;
+        pthread_mutex_lock(&pool.lock);
+        if (job->state == JOB_QUEUED) {
+            unqueueJob(job);
+        }
+        while (job->state == JOB_COMPILING) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+        freeJob(job);
+    }
+}
+
+void saveCompilerState(CompilerState *state) {
+    state->current = current;
+    state->currentClass = currentClass;
+    state->hadError = compilerHadError;
+    state->ownedJobs = ownedJobs;
+}
+
+void loadCompilerState(CompilerState *state) {
+    current = state->current;
+    currentClass = state->currentClass;
+    compilerHadError = state->hadError;
+    ownedJobs = state->ownedJobs;
+}
+
+// unqueueJob takes job out of the queue of the pool, with its lock held.
+static void unqueueJob(CompileJob *job) {
+    CompileJob *prev = NULL;
+    CompileJob **link = &pool.head;
+    while (*link != job) {
+        prev = *link;
+        link = &prev->nextQueued;
+    }
+    *link = job->nextQueued;
+    if (pool.tail == job) {
+        pool.tail = prev;
+    }
+    job->nextQueued = NULL;
+}
+
+static void freeJob(CompileJob *job) {
+    freeNodeBlocks(job->nodes);
+    if (job->objs) {
+        gc.allocated += job->size;
+        freeObjs(job->objs);
+    }
+    reallocate(job->globals, sizeof(GlobalUse) * job->globalCapacity, 0);
+    free(job->errors);
+    FREE(CompileJob, job);
 }
 
 static void compileParams(Node *params) {
@@ -595,9 +1337,7 @@ static uint8_t compileArgs(Token *fnName, Node *args) {
         argCount++;
         Node *next = args->next;
         compileNode(args);
-        if (argCount == 255) {
-            compilerError(fnName, "Can't have more than 255 arguments");
-        }
+        errorIfTooManyArgs(fnName, argCount);
         args = next;
     }
     return (uint8_t)argCount;
@@ -621,8 +1361,7 @@ static void compileVar(Token *name) {
     } else if ((pos = resolveUpvalue(current, name)) != -1) {
         emitBytes(OP_GET_UPVALUE, pos);
     } else {
-        uint8_t index = pushIdentifier(name);
-        emitBytes(OP_GET_GLOBAL, index);
+        emitBytes(OP_GET_GLOBAL, pushGlobal(name));
     }
 }
 
@@ -643,20 +1382,19 @@ static void compileVarDeclValue(Node *operand) {
 }
 
 static void compileAssignVariable(Node *assignment) {
-    int pos = resolveLocal(currentLocalState(), assignment->lhs->token);
+    int pos = resolveLocal(currentLocalState(), &assignment->lhs->token);
     if (pos != -1) {
         emitBytes(OP_SET_LOCAL, pos);
-    } else if ((pos = resolveUpvalue(current, assignment->lhs->token)) != -1) {
+    } else if ((pos = resolveUpvalue(current, &assignment->lhs->token)) != -1) {
         emitBytes(OP_SET_UPVALUE, pos);
     } else {
-        uint8_t index = pushIdentifier(assignment->lhs->token);
-        emitBytes(OP_SET_GLOBAL, index);
+        emitBytes(OP_SET_GLOBAL, pushGlobal(&assignment->lhs->token));
     }
 }
 
 static void compileAssignProperty(Node *assignment) {
     compileNode(assignment->lhs->lhs);
-    uint8_t index = pushIdentifier(assignment->lhs->token);
+    uint8_t index = pushIdentifier(&assignment->lhs->token);
     emitBytes(OP_SET_PROPERTY, index);
 }
 
@@ -706,9 +1444,7 @@ static bool isInLoop() {
 }
 
 static void defineGlobal(Token *name) {
-    uint8_t index = pushIdentifier(name);
-    emitBytes(OP_DEFINE_GLOBAL, index);
-    return;
+    emitBytes(OP_DEFINE_GLOBAL, pushGlobal(name));
 }
 
 static int resolveLocal(LocalState *state, Token *ident) {
@@ -796,7 +1532,7 @@ static int pushNewUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
         return dupIndex;
     }
     if (count == UINT8_COUNT) {
-        compilerError(compiler->currentNode->token,
+        compilerError(&compiler->currentNode->token,
                       "Too many closure variables in function.");
         return 0;
     }
@@ -845,6 +1581,24 @@ static uint8_t pushIdentifier(Token *name) {
     return (uint8_t)idx;
 }
 
+// pushGlobal resolves name to its slot among the VM's globals, and returns
+// the constant holding the slot. A compile worker has no globals to look in,
+// and leaves that to adoptJob.
+static uint8_t pushGlobal(Token *name) {
+    ObjString *identifier = newObjString(name->start, name->length);
+    if (compilingJob) {
+        return useGlobal(identifier);
+    }
+    Value slot = NUMBER_VAL((double)globalSlot(identifier));
+    ValueArray *constants = &currentChunk()->constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (constants->values[i] == slot) {
+            return (uint8_t)i;
+        }
+    }
+    return pushConstant(slot);
+}
+
 static bool findIdentifierConstantIdx(ObjString *identifier, Value *receiver) {
     if (mapGet(&current->stringConstants, identifier, receiver)) {
         return true;
@@ -888,6 +1642,24 @@ static void emitBinaryOp(TokenType type) {
     case TOKEN_MINUS:
         emitByte(OP_SUBTRACT);
         return;
+    case TOKEN_PERCENT:
+        emitByte(OP_MODULO);
+        return;
+    case TOKEN_AMPERSAND:
+        emitByte(OP_BITWISE_AND);
+        return;
+    case TOKEN_PIPE:
+        emitByte(OP_BITWISE_OR);
+        return;
+    case TOKEN_CARET:
+        emitByte(OP_BITWISE_XOR);
+        return;
+    case TOKEN_LESS_LESS:
+        emitByte(OP_SHIFT_LEFT);
+        return;
+    case TOKEN_GREATER_GREATER:
+        emitByte(OP_SHIFT_RIGHT);
+        return;
     case TOKEN_AND:
         emitByte(OP_AND);
         return;
@@ -900,8 +1672,10 @@ static void emitBinaryOp(TokenType type) {
     }
 }
 
-static void emitBranch(Node *branch) {
-    emitByte(OP_POP);
+static void emitBranch(Node *branch, bool popCondition) {
+    if (popCondition) {
+        emitByte(OP_POP);
+    }
     compileNode(branch);
 }
 
@@ -914,7 +1688,7 @@ static int emitJump(uint8_t jumpInstruction) {
 
 static void patchJump(int offset) {
     if (offset > UINT16_MAX) {
-        compilerError(current->currentNode->token,
+        compilerError(&current->currentNode->token,
                       "Exceeded the maximum allowed jump distance");
         return;
     }
@@ -945,7 +1719,7 @@ static void emitLoop(int loopStart) {
     emitByte(OP_LOOP);
     int offset = currentChunk()->count - loopStart + 2;
     if (offset > UINT16_MAX) {
-        compilerError(current->currentNode->token, "Loop body too large.");
+        compilerError(&current->currentNode->token, "Loop body too large.");
         return;
     }
     emitByte((offset >> 8) & 0xff);
@@ -969,102 +1743,381 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
 }
 
 static void emitByte(uint8_t byte) {
-    addCodeToChunk(currentChunk(), byte, current->currentNode->token->line);
+    addCodeToChunk(currentChunk(), byte, current->currentNode->token.line);
 }
 
-static void freeStmts(Node *script) {
-    Node *current = script;
-    while (current) {
-        Node *next = current->next;
-        freeNode(current);
-        current = next;
+// emitSuperinstructions rewrites the finished chunk, fusing the hottest
+// opcode sequences into single instructions. A sequence is only fused when
+// no jump lands inside of it, and every jump is re-targeted afterwards
+// since the code shrinks.
+static void emitSuperinstructions(Chunk *chunk) {
+    bool *isTarget = ALLOCATE(bool, chunk->count + 1);
+    int *newOffsets = ALLOCATE(int, chunk->count + 1);
+    int *oldTargets = ALLOCATE(int, chunk->count);
+    markJumpTargets(chunk, isTarget);
+
+    Chunk fused;
+    initChunk(&fused);
+    for (int offset = 0; offset < chunk->count;) {
+        newOffsets[offset] = fused.count;
+        offset = fuseInstruction(chunk, offset, isTarget, &fused, oldTargets);
     }
+    newOffsets[chunk->count] = fused.count;
+
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(uint8_t, chunk->codes, chunk->capacity);
+    chunk->lines = fused.lines;
+    chunk->codes = fused.codes;
+    chunk->count = fused.count;
+    chunk->capacity = fused.capacity;
+    patchFusedJumps(chunk, oldTargets, newOffsets);
+
+    FREE(bool, isTarget);
+    FREE(int, newOffsets);
+    FREE(int, oldTargets);
 }
 
-static void freeNode(Node *node) {
-    if (!node)
-        return;
+static void markJumpTargets(Chunk *chunk, bool *isTarget) {
+    memset(isTarget, 0, sizeof(bool) * (chunk->count + 1));
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        int target = jumpTarget(chunk, offset);
+        if (target == -1) {
+            continue;
+        }
+        isTarget[target] = true;
+        // A fused compare-and-jump skips the OP_POP it would land on.
+        if (chunk->codes[target] == OP_POP) {
+            isTarget[target + 1] = true;
+        }
+    }
+}
 
-    switch (node->type) {
-    case ND_PROPERTY:
-        freeNode(node->lhs);
-        FREE(Node, node);
-        return;
-    case ND_CLASS_DECL: {
-        freeStmts(node->thenBranch);
-        freeNode(node->operand);
-        FREE(Node, node);
-        return;
+static int fuseInstruction(Chunk *chunk, int offset, bool *isTarget,
+                           Chunk *fused, int *oldTargets) {
+    uint8_t *codes = chunk->codes;
+    int line = chunk->lines[offset];
+    int remaining = chunk->count - offset;
+
+    switch (codes[offset]) {
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+        return fuseCompareJump(chunk, offset, isTarget, fused, oldTargets);
+    case OP_GET_LOCAL:
+        // GET_LOCAL a, GET_LOCAL b, <arithmetic>
+        if (remaining > 4 && codes[offset + 2] == OP_GET_LOCAL &&
+            localsOpcode(codes[offset + 4]) != OP_PUSH &&
+            !isTarget[offset + 2] && !isTarget[offset + 4]) {
+            addCodeToChunk(fused, localsOpcode(codes[offset + 4]), line);
+            addCodeToChunk(fused, codes[offset + 1], line);
+            addCodeToChunk(fused, codes[offset + 3], line);
+            return offset + 5;
+        }
+        // GET_LOCAL a, GET_PROPERTY name
+        if (remaining > 3 && codes[offset + 2] == OP_GET_PROPERTY &&
+            !isTarget[offset + 2]) {
+            addCodeToChunk(fused, OP_GET_LOCAL_PROPERTY, line);
+            addCodeToChunk(fused, codes[offset + 1], line);
+            addCodeToChunk(fused, codes[offset + 3], line);
+            return offset + 4;
+        }
+        break;
+    case OP_CONSTANT:
+        // CONSTANT k, RETURN
+        if (remaining > 2 && codes[offset + 2] == OP_RETURN &&
+            !isTarget[offset + 2]) {
+            addCodeToChunk(fused, OP_RETURN_CONSTANT, line);
+            addCodeToChunk(fused, codes[offset + 1], line);
+            return offset + 3;
+        }
+        break;
+    default:
+        break;
     }
-    case ND_CALL: {
-        freeNode(node->lhs);
-        freeStmts(node->operand);
-        FREE(Node, node);
-        return;
+    copyInstruction(chunk, offset, fused, oldTargets);
+    return offset + instructionLength(chunk, offset);
+}
+
+// <compare>, JUMP_IF_FALSE target, POP becomes a single compare-and-jump
+// that never pushes the boolean. Both paths of the original sequence pop
+// it, so the fused jump lands one past the OP_POP at the target.
+static int fuseCompareJump(Chunk *chunk, int offset, bool *isTarget,
+                           Chunk *fused, int *oldTargets) {
+    uint8_t *codes = chunk->codes;
+    int jump = offset + 1;
+    int pop = jump + 3;
+    if (pop >= chunk->count || codes[jump] != OP_JUMP_IF_FALSE ||
+        codes[pop] != OP_POP || isTarget[jump] || isTarget[pop]) {
+        copyInstruction(chunk, offset, fused, oldTargets);
+        return offset + 1;
     }
-    case ND_BLOCK:
-        freeStmts(node->operand);
-        FREE(Node, node);
-        return;
-    case ND_FOR:
-        freeNode(node->init);
-        freeNode(node->operand);
-        freeNode(node->increment);
-        freeNode(node->thenBranch);
-        FREE(Node, node);
-        return;
-    case ND_METHOD:
-    case ND_FN_DECL:
-    case ND_WHILE:
-        freeNode(node->operand);
-        freeNode(node->thenBranch);
-        FREE(Node, node);
-        return;
-    case ND_TERNARY:
-    case ND_IF:
-        freeNode(node->elseBranch);
-        freeNode(node->thenBranch);
-        freeNode(node->operand);
-        FREE(Node, node);
-        return;
-    case ND_ASSIGNMENT:
-    case ND_AND:
-    case ND_OR:
-    case ND_BINARY:
-        freeNode(node->lhs);
-        freeNode(node->rhs);
-        FREE(Node, node);
-        return;
-    case ND_PARAM:
-        freeNode(node->next);
-        FREE(Node, node);
-        return;
-    case ND_TEMPLATE_SPAN:
-        freeNode(node->next);
-        freeNode(node->operand);
-        FREE(Node, node);
-        return;
-    case ND_TEMPLATE_HEAD:
-    case ND_RETURN:
-    case ND_VAR_DECL:
-    case ND_EXPRESSION:
-    case ND_UNARY:
-        freeNode(node->operand);
-        FREE(Node, node);
-        return;
-    case ND_SUPER:
-    case ND_BREAK:
-    case ND_CONTINUE:
+    int target = jumpTarget(chunk, jump);
+    if (codes[target] != OP_POP) {
+        copyInstruction(chunk, offset, fused, oldTargets);
+        return offset + 1;
+    }
+
+    int line = chunk->lines[offset];
+    oldTargets[fused->count] = target + 1;
+    addCodeToChunk(fused, compareJumpOpcode(codes[offset]), line);
+    addCodeToChunk(fused, JUMP_PLACEHOLDER, line);
+    addCodeToChunk(fused, JUMP_PLACEHOLDER, line);
+    return pop + 1;
+}
+
+static Opcode compareJumpOpcode(Opcode compare) {
+    switch (compare) {
+    case OP_LESS:
+        return OP_JUMP_IF_NOT_LESS;
+    case OP_LESS_EQUAL:
+        return OP_JUMP_IF_NOT_LESS_EQUAL;
+    case OP_GREATER:
+        return OP_JUMP_IF_NOT_GREATER;
+    case OP_GREATER_EQUAL:
+        return OP_JUMP_IF_NOT_GREATER_EQUAL;
+    case OP_EQUAL:
+        return OP_JUMP_IF_NOT_EQUAL;
+    default:
+        return OP_JUMP_IF_EQUAL;
+    }
+}
+
+// localsOpcode returns OP_PUSH when the arithmetic has no fused form.
+static Opcode localsOpcode(Opcode arithmetic) {
+    switch (arithmetic) {
+    case OP_ADD:
+        return OP_ADD_LOCALS;
+    case OP_SUBTRACT:
+        return OP_SUBTRACT_LOCALS;
+    case OP_MULTIPLY:
+        return OP_MULTIPLY_LOCALS;
+    case OP_DIVIDE:
+        return OP_DIVIDE_LOCALS;
+    default:
+        return OP_PUSH;
+    }
+}
+
+static void copyInstruction(Chunk *chunk, int offset, Chunk *fused,
+                            int *oldTargets) {
+    int target = jumpTarget(chunk, offset);
+    if (target != -1) {
+        oldTargets[fused->count] = target;
+    }
+    int length = instructionLength(chunk, offset);
+    for (int i = 0; i < length; i++) {
+        addCodeToChunk(fused, chunk->codes[offset + i], chunk->lines[offset]);
+    }
+}
+
+static void patchFusedJumps(Chunk *chunk, int *oldTargets, int *newOffsets) {
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (jumpTarget(chunk, offset) == -1) {
+            continue;
+        }
+        int end = offset + instructionLength(chunk, offset);
+        int target = newOffsets[oldTargets[offset]];
+        int jump = chunk->codes[offset] == OP_LOOP ? end - target
+                                                   : target - end;
+        chunk->codes[end - 2] = (jump >> 8) & 0xff;
+        chunk->codes[end - 1] = jump & 0xff;
+    }
+}
+
+// compileCondition compiles the condition of an if, ternary or loop followed
+// by a jump taken when it is false, and returns that jump for patching. The
+// stack backend leaves the condition on the stack for both paths to pop,
+// which is reported through leavesValue.
+static int compileCondition(Node *condition, bool *leavesValue) {
+    if (isRegisterCondition(condition)) {
+        *leavesValue = false;
+        return emitRegisterCondition(condition);
+    }
+    *leavesValue = true;
+    compileNode(condition);
+    return emitJump(OP_JUMP_IF_FALSE);
+}
+
+// compileRegisterAssignment compiles an assignment to a local straight into
+// its frame slot when the value is arithmetic on locals and numbers. It
+// returns false when the assignment needs the stack instead. Only statements
+// may use it, as nothing is left on the stack for the result.
+static bool compileRegisterAssignment(Node *assignment) {
+    if (backend != BACKEND_REGISTER || assignment->type != ND_ASSIGNMENT ||
+        assignment->lhs->type != ND_VAR) {
+        return false;
+    }
+    int dst = findLocalSlot(&assignment->lhs->token);
+    int size = registerExpressionSize(assignment->rhs);
+    if (dst == -1 || size == -1 ||
+        currentLocalState()->count + size > UINT8_COUNT) {
+        return false;
+    }
+    emitRegisterExpression(dst, assignment->rhs, currentLocalState()->count);
+    return true;
+}
+
+static bool isRegisterCondition(Node *condition) {
+    // A ternary is an expression, so the slots above the locals may already
+    // hold temporaries of the enclosing expression.
+    if (backend != BACKEND_REGISTER ||
+        current->currentNode->type == ND_TERNARY ||
+        condition->type != ND_BINARY ||
+        registerCompareOpcode(condition->token.type, false) == OP_PUSH) {
+        return false;
+    }
+    int lhs = registerExpressionSize(condition->lhs);
+    int rhs = registerExpressionSize(condition->rhs);
+    return lhs != -1 && rhs != -1 &&
+           currentLocalState()->count + lhs + rhs <= UINT8_COUNT;
+}
+
+// registerExpressionSize returns the number of nodes in an expression the
+// register backend can evaluate, which bounds the temporary slots it needs,
+// or -1 if the expression has to be evaluated on the stack.
+static int registerExpressionSize(Node *node) {
+    switch (node->type) {
     case ND_VAR:
-    case ND_THIS:
-    case ND_STRING:
+        return findLocalSlot(&node->token) == -1 ? -1 : 1;
     case ND_NUMBER:
-    case ND_LITERAL:
-        FREE(Node, node);
-        return;
-    case ND_EMPTY:
-        return;
+        return 1;
+    case ND_BINARY: {
+        if (registerArithmeticOpcode(node->token.type, false) == OP_PUSH) {
+            return -1;
+        }
+        int lhs = registerExpressionSize(node->lhs);
+        int rhs = registerExpressionSize(node->rhs);
+        return lhs == -1 || rhs == -1 ? -1 : lhs + rhs + 1;
     }
+    default:
+        return -1;
+    }
+}
+
+static int emitRegisterCondition(Node *condition) {
+    int temp = currentLocalState()->count;
+    int lhs = emitRegisterOperand(condition->lhs, &temp);
+    bool isConstant = condition->rhs->type == ND_NUMBER;
+    int rhs = isConstant ? pushNumber(condition->rhs)
+                         : emitRegisterOperand(condition->rhs, &temp);
+    emitBytes(registerCompareOpcode(condition->token.type, isConstant), lhs);
+    emitByte(rhs);
+    emitByte(JUMP_PLACEHOLDER);
+    emitByte(JUMP_PLACEHOLDER);
+    return currentChunk()->count - 2;
+}
+
+// emitRegisterExpression evaluates node into the slot dst. Intermediate
+// results go to the free slots from temp upwards, so dst is only written once
+// all of its operands have been read.
+static void emitRegisterExpression(int dst, Node *node, int temp) {
+    Node *prev = current->currentNode;
+    current->currentNode = node;
+
+    switch (node->type) {
+    case ND_VAR: {
+        int src = findLocalSlot(&node->token);
+        if (src != dst) {
+            emitBytes(OP_MOVE, dst);
+            emitByte(src);
+        }
+        break;
+    }
+    case ND_NUMBER:
+        emitBytes(OP_LOAD_CONSTANT, dst);
+        emitByte(pushNumber(node));
+        break;
+    case ND_BINARY: {
+        int lhs = emitRegisterOperand(node->lhs, &temp);
+        bool isConstant = node->rhs->type == ND_NUMBER;
+        int rhs = isConstant ? pushNumber(node->rhs)
+                             : emitRegisterOperand(node->rhs, &temp);
+        emitBytes(registerArithmeticOpcode(node->token.type, isConstant),
+                  dst);
+        emitBytes(lhs, rhs);
+        break;
+    }
+    default:
+        break;
+    }
+
+    current->currentNode = prev;
+}
+
+// emitRegisterOperand returns the slot holding the value of node. Locals are
+// read in place, anything else is evaluated into the next temporary slot.
+static int emitRegisterOperand(Node *node, int *temp) {
+    if (node->type == ND_VAR) {
+        return findLocalSlot(&node->token);
+    }
+    int slot = (*temp)++;
+    emitRegisterExpression(slot, node, *temp);
+    return slot;
+}
+
+// registerArithmeticOpcode returns OP_PUSH when op has no register form.
+static Opcode registerArithmeticOpcode(TokenType op, bool isConstant) {
+    switch (op) {
+    case TOKEN_PLUS:
+        return isConstant ? OP_ADD_RK : OP_ADD_RR;
+    case TOKEN_MINUS:
+        return isConstant ? OP_SUBTRACT_RK : OP_SUBTRACT_RR;
+    case TOKEN_STAR:
+        return isConstant ? OP_MULTIPLY_RK : OP_MULTIPLY_RR;
+    case TOKEN_SLASH:
+        return isConstant ? OP_DIVIDE_RK : OP_DIVIDE_RR;
+    default:
+        return OP_PUSH;
+    }
+}
+
+// registerCompareOpcode returns OP_PUSH when op has no register form.
+static Opcode registerCompareOpcode(TokenType op, bool isConstant) {
+    switch (op) {
+    case TOKEN_LESS:
+        return isConstant ? OP_JUMP_IF_NOT_LESS_RK : OP_JUMP_IF_NOT_LESS_RR;
+    case TOKEN_LESS_EQUAL:
+        return isConstant ? OP_JUMP_IF_NOT_LESS_EQUAL_RK
+                          : OP_JUMP_IF_NOT_LESS_EQUAL_RR;
+    case TOKEN_GREATER:
+        return isConstant ? OP_JUMP_IF_NOT_GREATER_RK
+                          : OP_JUMP_IF_NOT_GREATER_RR;
+    case TOKEN_GREATER_EQUAL:
+        return isConstant ? OP_JUMP_IF_NOT_GREATER_EQUAL_RK
+                          : OP_JUMP_IF_NOT_GREATER_EQUAL_RR;
+    default:
+        return OP_PUSH;
+    }
+}
+
+// findLocalSlot is resolveLocal without the error reporting, leaving locals
+// that are still being initialized to the stack backend.
+static int findLocalSlot(Token *name) {
+    LocalState *state = currentLocalState();
+    for (int i = state->count - 1; i >= 0; i--) {
+        Local *local = &state->locals[i];
+        if (isIdentifiersEqual(local->name, local->length, name->start,
+                               name->length)) {
+            return local->depth == NOT_INITIALIZED ? -1 : i;
+        }
+    }
+    return -1;
+}
+
+static uint8_t pushNumber(Node *number) {
+    return pushConstant(numberValue(number));
+}
+
+// numberValue reads a number literal, which is an int when it is an integer
+// that fits one.
+static Value numberValue(Node *number) {
+    double num = strtod(number->token.start, NULL);
+    return isInt32(num) ? INT_VAL((int32_t)num) : NUMBER_VAL(num);
 }
 
 static Chunk *currentChunk() {
@@ -38,10 +38,14 @@ typedef struct {
 
 typedef enum { FN_SCRPIT, FN_FN, FN_METHOD, FN_INIT } FnType;
 
+// The stack backend evaluates every expression on the VM stack. The register
+// backend compiles arithmetic on locals into three-address ops on frame slots
+// where it can, and falls back to the stack everywhere else.
+typedef enum { BACKEND_STACK, BACKEND_REGISTER } Backend;
+
 typedef struct Compiler {
     FnType type;
     ObjFn *fn;
-    Node *stmts;
     Node *currentNode;
     UpvalueState upvalueState;
     LocalState localState;
@@ -50,14 +54,32 @@ typedef struct Compiler {
     Hashmap stringConstants;
 } Compiler;
 
+typedef struct CompileJob CompileJob;
+
 typedef struct ClassState {
     struct ClassState *enclosing;
     bool hasSuperClass;
 } ClassState;
 
+// The compiler state of an isolate, which enterIsolate swaps with the
+// thread's.
+typedef struct {
+    Compiler *current;
+    ClassState *currentClass;
+    bool hadError;
+    CompileJob *ownedJobs;
+} CompilerState;
+
+void setBackend(Backend backend);
+Backend getBackend();
+void setCompileJobs(int count);
 void initCompiler(Compiler *compiler, FnType type);
 ObjFn *terminateCompiler(Compiler *compiler);
 void markCompilerRoots();
 ObjFn *compile(const char *source);
+bool compileLazyFn(ObjFn *fn);
+void discardCompileJobs();
+void saveCompilerState(CompilerState *state);
+void loadCompilerState(CompilerState *state);
 
 #endif
\ No newline at end of file
@@ -10,7 +10,11 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset);
 static int jumpInstruction(const char *name, int sign, Chunk *chunk,
                            int offset);
 static int invokeInstruction(const char *name, Chunk *chunk, int offset);
+static int localsInstruction(const char *name, Chunk *chunk, int offset);
+static int localPropertyInstruction(const char *name, Chunk *chunk,
+                                    int offset);
 static int constantInstruction(const char *name, Chunk *chunk, int offset);
+static int registerInstruction(const char *name, Chunk *chunk, int offset);
 static int simpleInstruction(const char *name, int offset);
 
 void disassembleChunk(Chunk *chunk, const char *name) {
@@ -53,6 +57,8 @@ int disassembleInstruction(Chunk *chunk, int offset) {
         return invokeInstruction("OP_INVOKE", chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_DEFINE_GLOBAL:
         return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
@@ -68,7 +74,7 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     case OP_SET_UPVALUE:
         return byteInstruction("OP_SET_UPVALUE", chunk, offset);
     case OP_CLOSE_UPVALUE:
-        return byteInstruction("OP_CLOSE_UPVALUE", chunk, offset);
+        return simpleInstruction("OP_CLOSE_UPVALUE", offset);
     case OP_GET_PROPERTY:
         return constantInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
@@ -103,6 +109,18 @@ int disassembleInstruction(Chunk *chunk, int offset) {
         return simpleInstruction("OP_DIVIDE", offset);
     case OP_MULTIPLY:
         return simpleInstruction("OP_MULTIPLY", offset);
+    case OP_MODULO:
+        return simpleInstruction("OP_MODULO", offset);
+    case OP_BITWISE_AND:
+        return simpleInstruction("OP_BITWISE_AND", offset);
+    case OP_BITWISE_OR:
+        return simpleInstruction("OP_BITWISE_OR", offset);
+    case OP_BITWISE_XOR:
+        return simpleInstruction("OP_BITWISE_XOR", offset);
+    case OP_SHIFT_LEFT:
+        return simpleInstruction("OP_SHIFT_LEFT", offset);
+    case OP_SHIFT_RIGHT:
+        return simpleInstruction("OP_SHIFT_RIGHT", offset);
     case OP_TEMPLATE:
         return constantInstruction("OP_TEMPLATE", chunk, offset);
     case OP_NEGATE:
@@ -119,10 +137,74 @@ int disassembleInstruction(Chunk *chunk, int offset) {
         return simpleInstruction("OP_NIL", offset);
     case OP_RETURN:
         return simpleInstruction("OP_RETURN", offset);
+    case OP_YIELD:
+        return simpleInstruction("OP_YIELD", offset);
     case OP_POP:
         return simpleInstruction("OP_POP", offset);
     case OP_POPN:
         return constantInstruction("OP_POPN", chunk, offset);
+    case OP_JUMP_IF_NOT_LESS:
+        return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_NOT_LESS_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:
+        return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL", 1, chunk,
+                               offset);
+    case OP_JUMP_IF_NOT_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+    case OP_ADD_LOCALS:
+        return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+    case OP_SUBTRACT_LOCALS:
+        return localsInstruction("OP_SUBTRACT_LOCALS", chunk, offset);
+    case OP_MULTIPLY_LOCALS:
+        return localsInstruction("OP_MULTIPLY_LOCALS", chunk, offset);
+    case OP_DIVIDE_LOCALS:
+        return localsInstruction("OP_DIVIDE_LOCALS", chunk, offset);
+    case OP_GET_LOCAL_PROPERTY:
+        return localPropertyInstruction("OP_GET_LOCAL_PROPERTY", chunk,
+                                        offset);
+    case OP_RETURN_CONSTANT:
+        return constantInstruction("OP_RETURN_CONSTANT", chunk, offset);
+    case OP_MOVE:
+        return registerInstruction("OP_MOVE", chunk, offset);
+    case OP_LOAD_CONSTANT:
+        return registerInstruction("OP_LOAD_CONSTANT", chunk, offset);
+    case OP_ADD_RR:
+        return registerInstruction("OP_ADD_RR", chunk, offset);
+    case OP_SUBTRACT_RR:
+        return registerInstruction("OP_SUBTRACT_RR", chunk, offset);
+    case OP_MULTIPLY_RR:
+        return registerInstruction("OP_MULTIPLY_RR", chunk, offset);
+    case OP_DIVIDE_RR:
+        return registerInstruction("OP_DIVIDE_RR", chunk, offset);
+    case OP_ADD_RK:
+        return registerInstruction("OP_ADD_RK", chunk, offset);
+    case OP_SUBTRACT_RK:
+        return registerInstruction("OP_SUBTRACT_RK", chunk, offset);
+    case OP_MULTIPLY_RK:
+        return registerInstruction("OP_MULTIPLY_RK", chunk, offset);
+    case OP_DIVIDE_RK:
+        return registerInstruction("OP_DIVIDE_RK", chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_RR:
+        return registerInstruction("OP_JUMP_IF_NOT_LESS_RR", chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RR:
+        return registerInstruction("OP_JUMP_IF_NOT_LESS_EQUAL_RR", chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER_RR:
+        return registerInstruction("OP_JUMP_IF_NOT_GREATER_RR", chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RR:
+        return registerInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL_RR", chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_RK:
+        return registerInstruction("OP_JUMP_IF_NOT_LESS_RK", chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RK:
+        return registerInstruction("OP_JUMP_IF_NOT_LESS_EQUAL_RK", chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER_RK:
+        return registerInstruction("OP_JUMP_IF_NOT_GREATER_RK", chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RK:
+        return registerInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL_RK", chunk, offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
@@ -164,6 +246,23 @@ static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
     return offset + 3;
 }
 
+static int localsInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t a = chunk->codes[offset + 1];
+    uint8_t b = chunk->codes[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int localPropertyInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+    uint8_t slot = chunk->codes[offset + 1];
+    uint8_t constant = chunk->codes[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int constantInstruction(const char *name, Chunk *chunk, int offset) {
     uint8_t constant = chunk->codes[offset + 1];
     printf("%-16s %4d '", name, constant);
@@ -171,6 +270,23 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
     return offset + 2;
 }
 
+// registerInstruction prints the slot and constant operands of a register op,
+// followed by the jump target if it has one.
+static int registerInstruction(const char *name, Chunk *chunk, int offset) {
+    int length = instructionLength(chunk, offset);
+    int target = jumpTarget(chunk, offset);
+    int operands = target == -1 ? length : length - 2;
+    printf("%-16s", name);
+    for (int i = 1; i < operands; i++) {
+        printf(" %4d", chunk->codes[offset + i]);
+    }
+    if (target != -1) {
+        printf(" -> %d", target);
+    }
+    printf("\n");
+    return offset + length;
+}
+
 static int simpleInstruction(const char *name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -4,8 +4,8 @@
 #include <stdarg.h>
 #include <stdio.h>
 
-#define START_PRINT_RED fprintf(stderr, RED)
-#define END_PRINT_RED fprintf(stderr, RESET)
+#define START_PRINT_RED fprintf(vm.err, RED)
+#define END_PRINT_RED fprintf(vm.err, RESET)
 #define RED "\x1B[31m"
 #define RESET "\x1B[0m"
 
@@ -13,24 +13,24 @@ static void printStackTrace();
 
 void errorAtToken(Token *token, const char *message) {
     START_PRINT_RED;
-    fprintf(stderr, "[line %d] Error", token->line);
+    fprintf(vm.err, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(vm.err, " at end");
     } else if (token->type == TOKEN_NEWLINE) {
-        fprintf(stderr, " at newline character");
+        fprintf(vm.err, " at newline character");
     } else if (token->type == TOKEN_ERROR) {
 
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(vm.err, " at '%.*s'", token->length, token->start);
     }
-    fprintf(stderr, ": %s\n", message);
+    fprintf(vm.err, ": %s\n", message);
     END_PRINT_RED;
 }
 
 void internalError(const char *message) {
     START_PRINT_RED;
-    fprintf(stderr, "[Internal Error]: %s", message);
+    fprintf(vm.err, "[Internal Error]: %s", message);
     END_PRINT_RED;
 }
 
@@ -38,9 +38,9 @@ void runtimeError(const char *format, ...) {
     START_PRINT_RED;
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm.err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm.err);
 
     printStackTrace();
 
@@ -49,14 +49,15 @@ void runtimeError(const char *format, ...) {
 
 static void printStackTrace() {
     for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame *frame = &vm.frames[i];
+        CallFrame *frame = frameAt(i);
         ObjFn *fn = frame->closure->fn;
-        size_t instruction = frame->ip - fn->chunk.codes - 1;
-        fprintf(stderr, "[Line %d] in ", fn->chunk.lines[instruction]);
+        size_t cell = frame->ip - fn->threaded.cells - 1;
+        int instruction = fn->threaded.offsets[cell];
+        fprintf(vm.err, "[Line %d] in ", fn->chunk.lines[instruction]);
         if (fn->name == NULL) {
-            fprintf(stderr, "script\n");
+            fprintf(vm.err, "script\n");
         } else {
-            fprintf(stderr, "%.*s\n", fn->name->length, fn->name->str);
+            fprintf(vm.err, "%.*s\n", fn->name->length, fn->name->str);
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,65 @@
+#include "isolate.h"
+
+static void saveIsolate(Isolate *isolate);
+static void loadIsolate(Isolate *isolate);
+
+// The isolate whose state the thread holds, or NULL.
+static ISOLATE_LOCAL Isolate *entered = NULL;
+
+// newIsolate creates an isolate on the calling thread and enters it.
+Isolate *newIsolate() {
+    Isolate *isolate = ALLOCATE(Isolate, 1);
+    isolate->thread = pthread_self();
+    if (entered != NULL) {
+        saveIsolate(entered);
+    }
+    loadCompilerState(&(CompilerState){0});
+    entered = isolate;
+    initVM();
+    return isolate;
+}
+
+// enterIsolate makes isolate the one the thread runs, and returns false if
+// it was created on another thread.
+bool enterIsolate(Isolate *isolate) {
+    if (!pthread_equal(isolate->thread, pthread_self())) {
+        return false;
+    }
+    if (isolate == entered) {
+        return true;
+    }
+    if (entered != NULL) {
+        saveIsolate(entered);
+    }
+    loadIsolate(isolate);
+    entered = isolate;
+    return true;
+}
+
+// freeIsolate frees isolate, which must have been created on the calling
+// thread, and enters again the isolate that was entered before, if another.
+void freeIsolate(Isolate *isolate) {
+    Isolate *previous = entered == isolate ? NULL : entered;
+    enterIsolate(isolate);
+    terminateVM();
+    freeNodes();
+    entered = NULL;
+    FREE(Isolate, isolate);
+    if (previous != NULL) {
+        enterIsolate(previous);
+    }
+}
+
+static void saveIsolate(Isolate *isolate) {
+    isolate->vm = vm;
+    isolate->gc = gc;
+    isolate->nodes = detachNodes();
+    saveCompilerState(&isolate->compiler);
+}
+
+static void loadIsolate(Isolate *isolate) {
+    vm = isolate->vm;
+    gc = isolate->gc;
+    attachNodes(isolate->nodes);
+    loadCompilerState(&isolate->compiler);
+}
@@ -0,0 +1,34 @@
+#ifndef dojo_isolate_h
+#define dojo_isolate_h
+
+#include "common.h"
+#include "compiler.h"
+#include "memory.h"
+#include "node.h"
+#include "vm.h"
+#include <pthread.h>
+
+// An Isolate is a VM with everything that runs its scripts: the heap and
+// globals, the collector, the nodes of the frontend and the compiler with the
+// jobs it queued. Its JIT state is the native code of its functions, which is
+// kept with them on its heap. The scanner, the parser and the JITs hold state
+// only while they compile a script, a body or a trace, which is never left
+// halfway, so the isolates of a thread share theirs.
+//
+// The state of the entered isolate is the thread's own, for the VM to reach
+// without a pointer, and enterIsolate swaps it with that of another. Native
+// code bakes in the addresses of the thread's state, so an isolate stays on
+// the thread that created it.
+typedef struct Isolate {
+    VM vm;
+    GC gc;
+    NodeBlock *nodes;
+    CompilerState compiler;
+    pthread_t thread; // The thread that created it, the only one it runs on.
+} Isolate;
+
+Isolate *newIsolate();
+bool enterIsolate(Isolate *isolate);
+void freeIsolate(Isolate *isolate);
+
+#endif
@@ -0,0 +1,830 @@
+#include "jit.h"
+#include "chunk.h"
+#include "error.h"
+#include "hashmap.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include "x64.h"
+#include <stdint.h>
+
+static bool isEnabled = true;
+
+void setJitEnabled(bool enabled) {
+    isEnabled = enabled;
+}
+
+bool isJitEnabled() {
+    return isEnabled;
+}
+
+void initJitCode(JitCode *code) {
+    code->calls = 0;
+    code->size = 0;
+    code->entry = NULL;
+}
+
+#ifndef DOJO_JIT
+
+void freeJitCode(JitCode *code) {
+    initJitCode(code);
+}
+
+bool jitCompile(ObjFn *fn) {
+    return false;
+}
+
+bool jitRun(CallFrame *frame) {
+    return false;
+}
+
+#else
+
+// The compiled code of a function is entered with its frame and returns
+// false on a runtime error. Otherwise the frame is popped and its result
+// left on top of the stack, just like a return in the interpreter.
+typedef bool (*JitEntry)(CallFrame *frame);
+
+// The operand stack stays in vm.stack, so the collector finds every value
+// the compiled code is working on once STACK is written back to STACK_TOP.
+#define STACK RBX     // One past the value on top of the stack.
+#define SLOTS R12     // frame->slots.
+#define FRAME R13     // The CallFrame being run.
+#define STACK_TOP R14 // &vm.stackTop.
+
+#define XMM0 0
+#define XMM1 1
+
+// An Operand of a template is either a memory location or a constant.
+typedef struct {
+    bool isConstant;
+    Register base;
+    int32_t disp;
+    Value value;
+} Operand;
+
+// A Fixup is a rel32 at waiting for the native offset of target.
+typedef struct {
+    int at;
+    int target;
+} Fixup;
+
+typedef struct {
+    int count;
+    int capacity;
+    Fixup *fixups;
+} FixupArray;
+
+typedef struct {
+    ObjFn *fn;
+    Assembler as;
+    int *labels;    // Native offset of every bytecode offset.
+    int *cellIndex; // First threaded cell of every bytecode offset.
+    FixupArray jumps;   // Targets are bytecode offsets.
+    FixupArray exits;   // Jumps to the error exit.
+    FixupArray numbers; // Targets are the offsets of failed number checks.
+    FixupArray globals; // Targets are the offsets of undefined global uses.
+} Jit;
+
+static ISOLATE_LOCAL Jit jit;
+
+static void initJit(ObjFn *fn);
+static void freeJit();
+static bool compileInstruction(int offset);
+static JitCode finishCode();
+static void resolveFixups(FixupArray *array, int *labels);
+
+/* ------------------------------- TEMPLATES -------------------------------- */
+
+static void emitPrologue();
+static void emitEpilogue();
+static void emitRestore();
+static void emitErrorExit();
+static void emitNumberErrors();
+static void emitGlobalErrors();
+static void emitPush(Register reg);
+static void emitLoadOperand(Register reg, Operand operand);
+static void emitStoreOperand(Operand operand, Register reg);
+static void emitIntToDouble(Register reg);
+static void emitNumberOperands(int offset, Operand a, Operand b);
+static void emitArithmetic(int offset, SseOp op, Operand a, Operand b);
+static void emitStackArithmetic(int offset, SseOp op);
+static void emitCompare(int offset, Opcode op, Operand a, Operand b);
+static void emitCompareJump(int offset, Opcode op, Operand a, Operand b,
+                            int drop);
+static void emitEqualityJump(int offset, Condition cc);
+static void emitBool(Condition cc);
+static void emitFalseyJumps(int *zero, int *falsey);
+static void emitUpvalueLocation(int slot);
+static void emitGlobalValues();
+static void emitDefinedCheck(int offset, Register reg);
+static void emitCallVM(int offset, void *fn, bool canFail);
+static void emitCallVMAt(Cell *ip, void *fn, bool canFail);
+static void emitReturn();
+static void emitTailCall(int offset, int argCount);
+
+static Operand slotOperand(int slot);
+static Operand stackOperand(int depth);
+static Operand constantOperand(Value value);
+static Value readConstant(int offset, int index);
+static ObjString *readString(int offset, int index);
+static int readGlobalSlot(int offset);
+static InlineCache *readCache(int offset);
+static int jumpTargetOf(int offset);
+
+static void addFixup(FixupArray *array, int at, int target);
+
+/* -------------------------------- RUNTIME --------------------------------- */
+
+static void jitOperandsError();
+static void jitReturn(CallFrame *frame, Value result);
+
+void freeJitCode(JitCode *code) {
+    freeMachineCode(code->entry, code->size);
+    initJitCode(code);
+}
+
+// jitCompile stitches together the template of every instruction of fn.
+// Nothing is compiled when fn uses an instruction without a template, and
+// fn keeps running in the interpreter.
+bool jitCompile(ObjFn *fn) {
+    if (!isEnabled) {
+        return false;
+    }
+
+    initJit(fn);
+    emitPrologue();
+    Chunk *chunk = &fn->chunk;
+    bool isSupported = true;
+    for (int offset = 0; isSupported && offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        jit.labels[offset] = x64Offset();
+        isSupported = compileInstruction(offset);
+    }
+
+    if (isSupported) {
+        emitNumberErrors();
+        emitGlobalErrors();
+        emitErrorExit();
+        resolveFixups(&jit.jumps, jit.labels);
+        fn->jit = finishCode();
+    }
+    freeJit();
+    return fn->jit.entry != NULL;
+}
+
+bool jitRun(CallFrame *frame) {
+    JitEntry entry = (JitEntry)frame->closure->fn->jit.entry;
+    return entry(frame);
+}
+
+static void initJit(ObjFn *fn) {
+    Chunk *chunk = &fn->chunk;
+    ThreadedCode *threaded = &fn->threaded;
+    jit.fn = fn;
+    initAssembler(&jit.as);
+    x64Use(&jit.as);
+    jit.labels = ALLOCATE(int, chunk->count);
+    jit.cellIndex = ALLOCATE(int, chunk->count);
+    for (int cell = threaded->count - 1; cell >= 0; cell--) {
+        jit.cellIndex[threaded->offsets[cell]] = cell;
+    }
+    jit.jumps = (FixupArray){0, 0, NULL};
+    jit.exits = (FixupArray){0, 0, NULL};
+    jit.numbers = (FixupArray){0, 0, NULL};
+    jit.globals = (FixupArray){0, 0, NULL};
+}
+
+static void freeJit() {
+    freeAssembler(&jit.as);
+    FREE(int, jit.labels);
+    FREE(int, jit.cellIndex);
+    FREE(Fixup, jit.jumps.fixups);
+    FREE(Fixup, jit.exits.fixups);
+    FREE(Fixup, jit.numbers.fixups);
+    FREE(Fixup, jit.globals.fixups);
+}
+
+static JitCode finishCode() {
+    JitCode code;
+    initJitCode(&code);
+    code.entry = finishAssembler(&jit.as);
+    if (code.entry != NULL) {
+        code.size = jit.as.count;
+        code.calls = jit.fn->jit.calls;
+    }
+    return code;
+}
+
+static void resolveFixups(FixupArray *array, int *labels) {
+    for (int i = 0; i < array->count; i++) {
+        Fixup *fixup = &array->fixups[i];
+        x64PatchJump(fixup->at, labels[fixup->target]);
+    }
+}
+
+static bool compileInstruction(int offset) {
+    static const SseOp sseOps[] = {SSE_ADD, SSE_SUB, SSE_MUL, SSE_DIV};
+    uint8_t *bytes = &jit.fn->chunk.codes[offset];
+    switch (bytes[0]) {
+    case OP_CALL:
+        x64MovImm(RDI, bytes[1]);
+        emitCallVM(offset, callValue, true);
+        return true;
+    case OP_TAIL_CALL:
+        emitTailCall(offset, bytes[1]);
+        return true;
+    case OP_INVOKE:
+        x64MovImm(RDI, (uintptr_t)readString(offset, 1));
+        x64MovImm(RSI, bytes[2]);
+        x64MovImm(RDX, (uintptr_t)readCache(offset));
+        emitCallVM(offset, invokeMethod, true);
+        return true;
+    case OP_RETURN:
+        x64Load(RSI, STACK, -8);
+        emitReturn();
+        return true;
+    case OP_RETURN_CONSTANT:
+        x64MovImm(RSI, readConstant(offset, 1));
+        emitReturn();
+        return true;
+    case OP_DEFINE_GLOBAL:
+        emitGlobalValues();
+        emitLoadOperand(RCX, stackOperand(0));
+        x64Store(RAX, readGlobalSlot(offset) * (int)sizeof(Value), RCX);
+        x64AluImm(ALU_SUB, STACK, 8);
+        return true;
+    case OP_GET_GLOBAL:
+        emitGlobalValues();
+        x64Load(RAX, RAX, readGlobalSlot(offset) * (int)sizeof(Value));
+        emitDefinedCheck(offset, RAX);
+        emitPush(RAX);
+        return true;
+    case OP_SET_GLOBAL:
+        emitGlobalValues();
+        x64Load(RCX, RAX, readGlobalSlot(offset) * (int)sizeof(Value));
+        emitDefinedCheck(offset, RCX);
+        emitLoadOperand(RCX, stackOperand(0));
+        x64Store(RAX, readGlobalSlot(offset) * (int)sizeof(Value), RCX);
+        return true;
+    case OP_GET_LOCAL:
+        emitLoadOperand(RAX, slotOperand(bytes[1]));
+        emitPush(RAX);
+        return true;
+    case OP_SET_LOCAL:
+        emitLoadOperand(RAX, stackOperand(0));
+        emitStoreOperand(slotOperand(bytes[1]), RAX);
+        return true;
+    case OP_GET_UPVALUE:
+        emitUpvalueLocation(bytes[1]);
+        x64Load(RAX, RAX, 0);
+        emitPush(RAX);
+        return true;
+    case OP_SET_UPVALUE:
+        emitUpvalueLocation(bytes[1]);
+        emitLoadOperand(RCX, stackOperand(0));
+        x64Store(RAX, 0, RCX);
+        return true;
+    case OP_CLOSE_UPVALUE:
+        x64Lea(RDI, STACK, -8);
+        emitCallVM(offset, closeUpvalues, false);
+        x64AluImm(ALU_SUB, STACK, 8);
+        return true;
+    case OP_GET_PROPERTY:
+        x64MovImm(RDI, (uintptr_t)readString(offset, 1));
+        x64MovImm(RSI, (uintptr_t)readCache(offset));
+        emitCallVM(offset, getProperty, true);
+        return true;
+    case OP_SET_PROPERTY:
+        x64MovImm(RDI, (uintptr_t)readString(offset, 1));
+        x64MovImm(RSI, (uintptr_t)readCache(offset));
+        emitCallVM(offset, setProperty, true);
+        return true;
+    case OP_GET_LOCAL_PROPERTY:
+        emitLoadOperand(RAX, slotOperand(bytes[1]));
+        emitPush(RAX);
+        x64MovImm(RDI, (uintptr_t)readString(offset, 2));
+        x64MovImm(RSI, (uintptr_t)readCache(offset));
+        emitCallVM(offset, getProperty, true);
+        return true;
+    case OP_JUMP:
+    case OP_LOOP:
+        addFixup(&jit.jumps, x64Jump(), jumpTargetOf(offset));
+        return true;
+    case OP_JUMP_IF_TRUE: {
+        int zero, falsey;
+        emitFalseyJumps(&zero, &falsey);
+        addFixup(&jit.jumps, x64Jump(), jumpTargetOf(offset));
+        x64PatchJump(zero, x64Offset());
+        x64PatchJump(falsey, x64Offset());
+        return true;
+    }
+    case OP_JUMP_IF_FALSE: {
+        int zero, falsey;
+        emitFalseyJumps(&zero, &falsey);
+        addFixup(&jit.jumps, zero, jumpTargetOf(offset));
+        addFixup(&jit.jumps, falsey, jumpTargetOf(offset));
+        return true;
+    }
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+        emitLoadOperand(RAX, stackOperand(1));
+        emitLoadOperand(RCX, stackOperand(0));
+        emitIntToDouble(RAX);
+        emitIntToDouble(RCX);
+        x64Alu(ALU_CMP, RAX, RCX);
+        emitBool(bytes[0] == OP_EQUAL ? CC_E : CC_NE);
+        x64AluImm(ALU_SUB, STACK, 8);
+        emitStoreOperand(stackOperand(0), RAX);
+        return true;
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+        emitCompare(offset, bytes[0], stackOperand(1), stackOperand(0));
+        return true;
+    case OP_ADD:
+        emitStackArithmetic(offset, SSE_ADD);
+        return true;
+    case OP_SUBTRACT:
+        emitStackArithmetic(offset, SSE_SUB);
+        return true;
+    case OP_MULTIPLY:
+        emitStackArithmetic(offset, SSE_MUL);
+        return true;
+    case OP_DIVIDE:
+        emitStackArithmetic(offset, SSE_DIV);
+        return true;
+    case OP_NOT: {
+        int zero, falsey;
+        emitFalseyJumps(&zero, &falsey);
+        x64MovImm(RAX, FALSE_VAL);
+        int done = x64Jump();
+        x64PatchJump(zero, x64Offset());
+        x64PatchJump(falsey, x64Offset());
+        x64MovImm(RAX, TRUE_VAL);
+        x64PatchJump(done, x64Offset());
+        emitStoreOperand(stackOperand(0), RAX);
+        return true;
+    }
+    case OP_NEGATE:
+        emitLoadOperand(RAX, stackOperand(0));
+        emitIntToDouble(RAX);
+        x64MovImm(RCX, SIGN_BIT);
+        x64Alu(ALU_XOR, RAX, RCX);
+        emitStoreOperand(stackOperand(0), RAX);
+        return true;
+    case OP_CONSTANT:
+        x64MovImm(RAX, toDoubleVal(readConstant(offset, 1)));
+        emitPush(RAX);
+        return true;
+    case OP_TRUE:
+        x64MovImm(RAX, TRUE_VAL);
+        emitPush(RAX);
+        return true;
+    case OP_FALSE:
+        x64MovImm(RAX, FALSE_VAL);
+        emitPush(RAX);
+        return true;
+    case OP_NIL:
+        x64MovImm(RAX, NIL_VAL);
+        emitPush(RAX);
+        return true;
+    case OP_POP:
+        x64AluImm(ALU_SUB, STACK, 8);
+        return true;
+    case OP_POPN:
+        x64AluImm(ALU_SUB, STACK, bytes[1] * 8);
+        return true;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        emitCompareJump(offset, bytes[0], stackOperand(1), stackOperand(0),
+                        2);
+        return true;
+    case OP_JUMP_IF_NOT_EQUAL:
+        emitEqualityJump(offset, CC_NE);
+        return true;
+    case OP_JUMP_IF_EQUAL:
+        emitEqualityJump(offset, CC_E);
+        return true;
+    case OP_ADD_LOCALS:
+    case OP_SUBTRACT_LOCALS:
+    case OP_MULTIPLY_LOCALS:
+    case OP_DIVIDE_LOCALS: {
+        emitArithmetic(offset, sseOps[bytes[0] - OP_ADD_LOCALS],
+                       slotOperand(bytes[1]), slotOperand(bytes[2]));
+        emitPush(RAX);
+        return true;
+    }
+    case OP_MOVE:
+        emitLoadOperand(RAX, slotOperand(bytes[2]));
+        emitStoreOperand(slotOperand(bytes[1]), RAX);
+        return true;
+    case OP_LOAD_CONSTANT:
+        x64MovImm(RAX, toDoubleVal(readConstant(offset, 2)));
+        emitStoreOperand(slotOperand(bytes[1]), RAX);
+        return true;
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR: {
+        emitArithmetic(offset, sseOps[bytes[0] - OP_ADD_RR],
+                       slotOperand(bytes[2]), slotOperand(bytes[3]));
+        emitStoreOperand(slotOperand(bytes[1]), RAX);
+        return true;
+    }
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK: {
+        emitArithmetic(offset, sseOps[bytes[0] - OP_ADD_RK],
+                       slotOperand(bytes[2]),
+                       constantOperand(readConstant(offset, 3)));
+        emitStoreOperand(slotOperand(bytes[1]), RAX);
+        return true;
+    }
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RR:
+    case OP_JUMP_IF_NOT_GREATER_RR:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RR:
+        emitCompareJump(offset,
+                        OP_JUMP_IF_NOT_LESS +
+                            (bytes[0] - OP_JUMP_IF_NOT_LESS_RR),
+                        slotOperand(bytes[1]), slotOperand(bytes[2]), 0);
+        return true;
+    case OP_JUMP_IF_NOT_LESS_RK:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RK:
+    case OP_JUMP_IF_NOT_GREATER_RK:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RK:
+        emitCompareJump(offset,
+                        OP_JUMP_IF_NOT_LESS +
+                            (bytes[0] - OP_JUMP_IF_NOT_LESS_RK),
+                        slotOperand(bytes[1]),
+                        constantOperand(readConstant(offset, 2)), 0);
+        return true;
+    default:
+        // Classes, closures, super calls, templates and yields are left to
+        // the interpreter.
+        return false;
+    }
+}
+
+/* ------------------------------- TEMPLATES -------------------------------- */
+
+// emitPrologue saves the callee-saved registers the templates live in. With
+// the return address that is six words, so calls out stay 16-byte aligned.
+static void emitPrologue() {
+    x64Push(RBP);
+    x64Push(RBX);
+    x64Push(R12);
+    x64Push(R13);
+    x64Push(R14);
+    x64Mov(FRAME, RDI);
+    x64Load(SLOTS, FRAME, offsetof(CallFrame, slots));
+    x64MovImm(STACK_TOP, (uintptr_t)&vm.stackTop);
+    x64Load(STACK, STACK_TOP, 0);
+}
+
+static void emitEpilogue() {
+    emitRestore();
+    x64Ret();
+}
+
+// emitRestore pops the registers emitPrologue saved.
+static void emitRestore() {
+    x64Pop(R14);
+    x64Pop(R13);
+    x64Pop(R12);
+    x64Pop(RBX);
+    x64Pop(RBP);
+}
+
+// emitErrorExit returns false for every jump to the error exit. The error
+// has been reported by then.
+static void emitErrorExit() {
+    int exit = x64Offset();
+    for (int i = 0; i < jit.exits.count; i++) {
+        x64PatchJump(jit.exits.fixups[i].at, exit);
+    }
+    x64Byte(0x31); // xor eax, eax
+    x64Byte(0xc0);
+    emitEpilogue();
+}
+
+// emitNumberErrors emits the slow paths of the number checks out of line,
+// so the checks fall through when they pass.
+static void emitNumberErrors() {
+    for (int i = 0; i < jit.numbers.count; i++) {
+        Fixup *fixup = &jit.numbers.fixups[i];
+        x64PatchJump(fixup->at, x64Offset());
+        emitCallVM(fixup->target, jitOperandsError, false);
+        addFixup(&jit.exits, x64Jump(), 0);
+    }
+}
+
+// emitGlobalErrors emits the calls reporting undefined globals out of line.
+static void emitGlobalErrors() {
+    for (int i = 0; i < jit.globals.count; i++) {
+        Fixup *fixup = &jit.globals.fixups[i];
+        x64PatchJump(fixup->at, x64Offset());
+        x64MovImm(RDI, readGlobalSlot(fixup->target));
+        emitCallVM(fixup->target, undefinedGlobalError, false);
+        addFixup(&jit.exits, x64Jump(), 0);
+    }
+}
+
+static void emitPush(Register reg) {
+    x64Store(STACK, 0, reg);
+    x64AluImm(ALU_ADD, STACK, 8);
+}
+
+static void emitLoadOperand(Register reg, Operand operand) {
+    if (operand.isConstant) {
+        x64MovImm(reg, operand.value);
+    } else {
+        x64Load(reg, operand.base, operand.disp);
+    }
+}
+
+static void emitStoreOperand(Operand operand, Register reg) {
+    x64Store(operand.base, operand.disp, reg);
+}
+
+// emitIntToDouble turns an int in reg into the double it stands for, as
+// compiled code only computes with doubles. It clobbers rsi and xmm0.
+static void emitIntToDouble(Register reg) {
+    x64Mov(RSI, reg);
+    x64ShrImm(RSI, 48);
+    x64AluImm(ALU_CMP, RSI, INT_TAG);
+    int notInt = x64JumpIf(CC_NE);
+    x64Cvtsi2sd(XMM0, reg);
+    x64MovqFromXmm(reg, XMM0);
+    x64PatchJump(notInt, x64Offset());
+}
+
+// emitNumberOperands loads a into xmm0 and b into xmm1, branching to the
+// error path of the instruction at offset unless both are numbers.
+static void emitNumberOperands(int offset, Operand a, Operand b) {
+    emitLoadOperand(RAX, a);
+    emitLoadOperand(RCX, b);
+    x64MovImm(RDX, QNAN);
+    Register regs[] = {RAX, RCX};
+    Operand operands[] = {a, b};
+    for (int i = 0; i < 2; i++) {
+        if (operands[i].isConstant && IS_DOUBLE(operands[i].value)) {
+            continue;
+        }
+        emitIntToDouble(regs[i]);
+        x64Mov(RSI, regs[i]);
+        x64Alu(ALU_AND, RSI, RDX);
+        x64Alu(ALU_CMP, RSI, RDX);
+        addFixup(&jit.numbers, x64JumpIf(CC_E), offset);
+    }
+    x64MovqToXmm(XMM0, RAX);
+    x64MovqToXmm(XMM1, RCX);
+}
+
+// emitArithmetic leaves a op b in rax.
+static void emitArithmetic(int offset, SseOp op, Operand a, Operand b) {
+    emitNumberOperands(offset, a, b);
+    x64ScalarDouble(op, XMM0, XMM1);
+    x64MovqFromXmm(RAX, XMM0);
+}
+
+static void emitStackArithmetic(int offset, SseOp op) {
+    emitArithmetic(offset, op, stackOperand(1), stackOperand(0));
+    x64AluImm(ALU_SUB, STACK, 8);
+    emitStoreOperand(stackOperand(0), RAX);
+}
+
+// compareCondition returns the condition that holds after comisd when the
+// comparison op does, and whether comisd needs its operands swapped. An
+// unordered result fails every one of them, as NaN compares false in C.
+static Condition compareCondition(Opcode op, bool *isSwapped) {
+    switch (op) {
+    case OP_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+        *isSwapped = true;
+        return CC_A;
+    case OP_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+        *isSwapped = true;
+        return CC_AE;
+    case OP_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+        *isSwapped = false;
+        return CC_A;
+    default:
+        *isSwapped = false;
+        return CC_AE;
+    }
+}
+
+static void emitCompare(int offset, Opcode op, Operand a, Operand b) {
+    bool isSwapped;
+    Condition cc = compareCondition(op, &isSwapped);
+    emitNumberOperands(offset, a, b);
+    x64Comisd(isSwapped ? XMM1 : XMM0, isSwapped ? XMM0 : XMM1);
+    emitBool(cc);
+    x64AluImm(ALU_SUB, STACK, 8);
+    emitStoreOperand(stackOperand(0), RAX);
+}
+
+// emitCompareJump jumps when a op b does not hold, for one of the
+// OP_JUMP_IF_NOT_* comparisons. drop values are popped either way.
+static void emitCompareJump(int offset, Opcode op, Operand a, Operand b,
+                            int drop) {
+    bool isSwapped;
+    Condition cc = compareCondition(op, &isSwapped);
+    emitNumberOperands(offset, a, b);
+    if (drop > 0) {
+        x64AluImm(ALU_SUB, STACK, drop * 8);
+    }
+    x64Comisd(isSwapped ? XMM1 : XMM0, isSwapped ? XMM0 : XMM1);
+    addFixup(&jit.jumps, x64JumpIf(cc ^ 1), jumpTargetOf(offset));
+}
+
+static void emitEqualityJump(int offset, Condition cc) {
+    emitLoadOperand(RAX, stackOperand(1));
+    emitLoadOperand(RCX, stackOperand(0));
+    emitIntToDouble(RAX);
+    emitIntToDouble(RCX);
+    x64AluImm(ALU_SUB, STACK, 16);
+    x64Alu(ALU_CMP, RAX, RCX);
+    addFixup(&jit.jumps, x64JumpIf(cc), jumpTargetOf(offset));
+}
+
+// emitBool turns the flags into TRUE_VAL or FALSE_VAL in rax. TRUE_VAL is
+// one below FALSE_VAL.
+static void emitBool(Condition cc) {
+    x64Setcc(cc, RCX);
+    x64MovzxByte(RCX, RCX);
+    x64MovImm(RAX, FALSE_VAL);
+    x64Alu(ALU_SUB, RAX, RCX);
+}
+
+// emitFalseyJumps emits the two jumps taken when the value on top of the
+// stack is falsey: one for 0 and -0, and one for nil and false, which are
+// the only values equal to FALSE_VAL once TAG_TRUE is or'd in.
+static void emitFalseyJumps(int *zero, int *falsey) {
+    emitLoadOperand(RAX, stackOperand(0));
+    emitIntToDouble(RAX);
+    x64Mov(RCX, RAX);
+    x64Alu(ALU_ADD, RCX, RCX);
+    *zero = x64JumpIf(CC_E);
+    x64AluImm(ALU_OR, RAX, TAG_TRUE);
+    x64MovImm(RCX, FALSE_VAL);
+    x64Alu(ALU_CMP, RAX, RCX);
+    *falsey = x64JumpIf(CC_E);
+}
+
+// emitUpvalueLocation leaves the location of an upvalue of the running
+// closure in rax.
+static void emitUpvalueLocation(int slot) {
+    x64Load(RAX, FRAME, offsetof(CallFrame, closure));
+    x64Load(RAX, RAX, offsetof(ObjClosure, upvalues));
+    x64Load(RAX, RAX, slot * (int)sizeof(ObjUpvalue *));
+    x64Load(RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+// emitGlobalValues leaves vm.globalValues.values in rax. It is loaded every
+// time, since the array moves when code compiled later adds globals.
+static void emitGlobalValues() {
+    x64MovImm(RAX, (uintptr_t)&vm.globalValues.values);
+    x64Load(RAX, RAX, 0);
+}
+
+// emitDefinedCheck branches to the error path of the instruction at offset
+// when reg holds an undefined global. It clobbers rdx.
+static void emitDefinedCheck(int offset, Register reg) {
+    x64MovImm(RDX, UNDEFINED_VAL);
+    x64Alu(ALU_CMP, reg, RDX);
+    addFixup(&jit.globals, x64JumpIf(CC_E), offset);
+}
+
+// emitCallVM calls fn with its arguments already in rdi and rsi. The stack is
+// written back first and the ip of the instruction at offset saved, so the
+// VM sees the frame as if it were interpreted.
+static void emitCallVM(int offset, void *fn, bool canFail) {
+    emitCallVMAt(jit.fn->threaded.cells + jit.cellIndex[offset] + 1, fn,
+                 canFail);
+}
+
+// emitCallVMAt is emitCallVM saving ip as the frame's. Both stack pointers
+// are reloaded after, as a call may have moved the stack, which clobbers
+// rcx. When canFail, fn returns false on a runtime error and the code leaves
+// through the error exit.
+static void emitCallVMAt(Cell *ip, void *fn, bool canFail) {
+    x64Store(STACK_TOP, 0, STACK);
+    x64MovImm(RAX, (uintptr_t)ip);
+    x64Store(FRAME, offsetof(CallFrame, ip), RAX);
+    x64Call(fn);
+    x64Load(STACK, STACK_TOP, 0);
+    // Branching over the reload keeps the loads from the slots independent
+    // of it while the stack stays put.
+    x64Load(RCX, FRAME, offsetof(CallFrame, slots));
+    x64Alu(ALU_CMP, RCX, SLOTS);
+    int stayed = x64JumpIf(CC_E);
+    x64Mov(SLOTS, RCX);
+    x64PatchJump(stayed, x64Offset());
+    if (canFail) {
+        x64Byte(0x84); // test al, al
+        x64Byte(0xc0);
+        addFixup(&jit.exits, x64JumpIf(CC_E), 0);
+    }
+}
+
+// emitReturn returns the value in rsi from the frame.
+static void emitReturn() {
+    x64Mov(RDI, FRAME);
+    x64Call(jitReturn);
+    x64Byte(0xb8); // mov eax, 1
+    x64Int32(1);
+    emitEpilogue();
+}
+
+// emitTailCall leaves the frame to the FrameRunner tailCallValue returns. It
+// is jumped to with the return address of this code still on top of the
+// stack, so a chain of tail calls takes no native stack either. The ip saved
+// is that of the OP_RETURN after the call, where the interpreter resumes
+// the frame once a callee other than a closure has returned.
+static void emitTailCall(int offset, int argCount) {
+    Cell *ret = jit.fn->threaded.cells + jit.cellIndex[offset + 2];
+    x64MovImm(RDI, argCount);
+    emitCallVMAt(ret, tailCallValue, false);
+    x64Byte(0x48); // test rax, rax
+    x64Byte(0x85);
+    x64Byte(0xc0);
+    addFixup(&jit.exits, x64JumpIf(CC_E), 0);
+    x64Mov(RDI, FRAME);
+    emitRestore();
+    x64JumpReg(RAX);
+}
+
+static Operand slotOperand(int slot) {
+    return (Operand){false, SLOTS, slot * (int)sizeof(Value), 0};
+}
+
+// stackOperand is the value depth below the top of the stack.
+static Operand stackOperand(int depth) {
+    return (Operand){false, STACK, -(depth + 1) * (int)sizeof(Value), 0};
+}
+
+static Operand constantOperand(Value value) {
+    return (Operand){true, RAX, 0, toDoubleVal(value)};
+}
+
+static Value readConstant(int offset, int index) {
+    Chunk *chunk = &jit.fn->chunk;
+    return getConstantAtIndex(chunk, chunk->codes[offset + index]);
+}
+
+static ObjString *readString(int offset, int index) {
+    return AS_STRING(readConstant(offset, index));
+}
+
+static int readGlobalSlot(int offset) {
+    return (int)AS_NUMBER(readConstant(offset, 1));
+}
+
+// readCache returns the inline cache of the instruction at offset, which is
+// threaded into the cell after its operands.
+static InlineCache *readCache(int offset) {
+    int operands = instructionLength(&jit.fn->chunk, offset);
+    return jit.fn->threaded.cells[jit.cellIndex[offset] + operands].cache;
+}
+
+static int jumpTargetOf(int offset) {
+    return jumpTarget(&jit.fn->chunk, offset);
+}
+
+static void addFixup(FixupArray *array, int at, int target) {
+    if (IS_EXCEEDING_CAPACITY(array->count, array->capacity)) {
+        int oldCapacity = array->capacity;
+        array->capacity = GROW_CAPACITY(oldCapacity);
+        array->fixups =
+            reallocate(array->fixups, sizeof(Fixup) * oldCapacity,
+                       sizeof(Fixup) * array->capacity);
+    }
+    array->fixups[array->count++] = (Fixup){at, target};
+}
+
+/* -------------------------------- RUNTIME --------------------------------- */
+
+static void jitOperandsError() {
+    runtimeError("Operands must be numbers ");
+}
+
+static void jitReturn(CallFrame *frame, Value result) {
+    if (vm.openUpvalues) {
+        closeUpvalues(frame->slots);
+    }
+    vm.frameCount--;
+    frame->slots[0] = result;
+    vm.stackTop = frame->slots + 1;
+}
+
+#endif
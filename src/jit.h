@@ -0,0 +1,25 @@
+#ifndef dojo_jit_h
+#define dojo_jit_h
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// A function is compiled to native code on this many calls.
+#define JIT_THRESHOLD 1000
+
+// The JIT emits x86-64 code for the System V ABI. Everywhere else, or when
+// built with -DDOJO_NO_JIT, every function stays in the interpreter.
+#if defined(__x86_64__) && defined(__linux__) && !defined(DOJO_NO_JIT)
+#define DOJO_JIT
+#endif
+
+void setJitEnabled(bool enabled);
+bool isJitEnabled();
+void initJitCode(JitCode *code);
+void freeJitCode(JitCode *code);
+NOINLINE bool jitCompile(ObjFn *fn);
+bool jitRun(CallFrame *frame);
+
+#endif
@@ -1,41 +1,139 @@
+#include "compiler.h"
 #include "error.h"
 #include "hashmap.h"
+#include "isolate.h"
+#include "jit.h"
+#include "memory.h"
 #include "scanner.h"
 #include "vm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A Source is the text of a script, which the strings compiled from it point
+// into until the VM is reset. It is mapped from its file when that is a
+// regular one, and read into a buffer from anything else, such as a pipe.
+typedef struct {
+    char *text; // Always followed by a '\0' the scanner stops at.
+    size_t length;
+    size_t mappedSize; // 0 when text was read into a buffer.
+} Source;
+
+// A Job is one script of a batch, with what running it printed.
+typedef struct {
+    const char *path;
+    char *out;
+    size_t outSize;
+    char *err;
+    size_t errSize;
+    int status; // The exit status the script would have on its own.
+    bool isDone;
+} Job;
+
+// A Batch is shared by its workers, which take its jobs in order.
+typedef struct {
+    Job *jobs;
+    int count;
+    int next; // The job the next idle worker takes.
+    pthread_mutex_t lock;
+    pthread_cond_t jobDone;
+} Batch;
 
 static bool isExtendedByDojo(const char *path);
 static const char *getFileExt(const char *path);
+static int parseOptions(int argc, const char *argv[]);
+static void printUsage();
 
 static void repl();
 static void runFile(const char *path);
+static int runBatch(const char *paths[], int count);
+static void *runWorker(void *arg);
+static int runJob(const char *path, FILE *err);
+static InterpreterResult interpretFile(const char *path, const char *source);
+
+static bool loadSource(const char *path, Source *source, FILE *err);
+static bool mapSource(int fd, size_t size, Source *source);
+static bool readSource(int fd, Source *source);
+static void freeSource(Source *source);
 
-static char *readFile(const char *path);
-static FILE *openFile(const char *path);
-static size_t getFileSize(FILE *file);
-static char *readFileContent(FILE *file, size_t fileSize, const char *path);
+// Workers of a batch, or 0 to run a single script on the main thread.
+static int jobs = 0;
+static bool isCacheEnabled = true;
 
 int main(int argc, const char *argv[]) {
-    if (argc == 1) {
+    int arg = parseOptions(argc, argv);
+    if (arg == argc) {
         repl();
-    } else if (argc == 2) {
-        const char *path = argv[1];
-        if (!isExtendedByDojo(path)) {
+        return 0;
+    }
+    for (int i = arg; i < argc; i++) {
+        if (!isExtendedByDojo(argv[i])) {
             fprintf(stderr, "Error: You must input a .dojo file\n");
             exit(64);
         }
-        runFile(path);
-    } else {
-        fprintf(stderr, "Usage: dojo [path]\n");
-        exit(64);
     }
+    if (arg == argc - 1 && jobs == 0) {
+        runFile(argv[arg]);
+        return 0;
+    }
+    return runBatch(argv + arg, argc - arg);
+}
+
+// parseOptions applies the leading "--" options and returns the index of the
+// first argument that is not one.
+static int parseOptions(int argc, const char *argv[]) {
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--registers") == 0) {
+            setBackend(BACKEND_REGISTER);
+        } else if (strcmp(argv[arg], "--no-jit") == 0) {
+            setJitEnabled(false);
+        } else if (strcmp(argv[arg], "--no-cache") == 0) {
+            isCacheEnabled = false;
+        } else if (strncmp(argv[arg], "--max-frames=", 13) == 0) {
+            int max = atoi(argv[arg] + 13);
+            if (max <= 0) {
+                printUsage();
+            }
+            setFrameMax(max);
+        } else if (strncmp(argv[arg], "--compile-jobs=", 15) == 0) {
+            int count = atoi(argv[arg] + 15);
+            if (count <= 0) {
+                printUsage();
+            }
+            setCompileJobs(count);
+        } else if (strncmp(argv[arg], "--jobs=", 7) == 0 ||
+                   strcmp(argv[arg], "--jobs") == 0) {
+            // The count follows "=" or is the next argument.
+            const char *count = argv[arg][6] == '=' ? argv[arg] + 7
+                                : arg + 1 < argc    ? argv[++arg]
+                                                    : "";
+            jobs = atoi(count);
+            if (jobs <= 0) {
+                printUsage();
+            }
+        } else {
+            printUsage();
+        }
+    }
+    return arg;
+}
 
-    return 0;
+static void printUsage() {
+    fprintf(stderr, "Usage: dojo [--registers] [--no-jit] [--no-cache] "
+                    "[--max-frames=N] [--jobs N] [--compile-jobs=N] "
+                    "[path...]\n");
+    exit(64);
 }
 
+// isExtendedByDojo also accepts "-", which reads the script from stdin.
 static bool isExtendedByDojo(const char *path) {
-    return memcmp(getFileExt(path), "dojo", 4) == 0;
+    return strcmp(path, "-") == 0 || memcmp(getFileExt(path), "dojo", 4) == 0;
 }
 
 static const char *getFileExt(const char *path) {
@@ -47,7 +145,7 @@ static const char *getFileExt(const char *path) {
 
 static void repl() {
     char line[1024];
-    initVM(true);
+    newIsolate();
     for (;;) {
         printf("> ");
         if (!fgets(line, sizeof(line), stdin)) {
@@ -59,54 +157,219 @@ static void repl() {
 }
 
 static void runFile(const char *path) {
-    char *source = readFile(path);
-    initVM();
-    InterpreterResult res = interpret(source);
-    free(source);
+    Source source;
+    if (!loadSource(path, &source, stderr)) {
+        exit(74);
+    }
+    Isolate *isolate = newIsolate();
+    InterpreterResult res = interpretFile(path, source.text);
+    freeIsolate(isolate);
+    freeSource(&source);
     if (res != INTERPRET_OK) {
         exit(1);
     }
 }
 
-static char *readFile(const char *path) {
-    FILE *file = openFile(path);
-    size_t fileSize = getFileSize(file);
-    char *buffer = readFileContent(file, fileSize, path);
-    fclose(file);
-    return buffer;
+// runBatch runs the scripts at paths on a pool of workers, each with an
+// isolate of its own that it resets between scripts. What each script printed
+// is written out in the order of paths, and the status is that of the first
+// script that failed.
+static int runBatch(const char *paths[], int count) {
+    Batch batch;
+    batch.jobs = ALLOCATE(Job, count);
+    batch.count = count;
+    batch.next = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.jobDone, NULL);
+    for (int i = 0; i < count; i++) {
+        batch.jobs[i] = (Job){.path = paths[i]};
+    }
+
+    int workerCount = jobs == 0 ? 1 : jobs < count ? jobs : count;
+    pthread_t *workers = ALLOCATE(pthread_t, workerCount);
+    for (int i = 0; i < workerCount; i++) {
+        if (pthread_create(&workers[i], NULL, runWorker, &batch) != 0) {
+            fprintf(stderr, "Could not start a worker.\n");
+            exit(71);
+        }
+    }
+
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        Job *job = &batch.jobs[i];
+        pthread_mutex_lock(&batch.lock);
+        while (!job->isDone) {
+            pthread_cond_wait(&batch.jobDone, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+        fwrite(job->out, 1, job->outSize, stdout);
+        fflush(stdout);
+        fwrite(job->err, 1, job->errSize, stderr);
+        free(job->out);
+        free(job->err);
+        if (status == 0) {
+            status = job->status;
+        }
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    FREE(pthread_t, workers);
+    FREE(Job, batch.jobs);
+    pthread_cond_destroy(&batch.jobDone);
+    pthread_mutex_destroy(&batch.lock);
+    return status;
 }
 
-static FILE *openFile(const char *path) {
-    FILE *file = fopen(path, "rb");
+// runWorker runs jobs of the batch arg until none are left, printing to
+// buffers that runBatch writes out.
+static void *runWorker(void *arg) {
+    Batch *batch = arg;
+    Isolate *isolate = newIsolate();
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        int i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) {
+            break;
+        }
+
+        Job *job = &batch->jobs[i];
+        FILE *out = open_memstream(&job->out, &job->outSize);
+        FILE *err = open_memstream(&job->err, &job->errSize);
+        if (out == NULL || err == NULL) {
+            fprintf(stderr, "Not enough memory to run \"%s\".\n", job->path);
+            exit(74);
+        }
+        setOutput(out, err);
+        int status = runJob(job->path, err);
+        fclose(out);
+        fclose(err);
 
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        pthread_mutex_lock(&batch->lock);
+        job->status = status;
+        job->isDone = true;
+        pthread_cond_broadcast(&batch->jobDone);
+        pthread_mutex_unlock(&batch->lock);
     }
+    freeIsolate(isolate);
+    return NULL;
+}
 
-    return file;
+// runJob runs the script at path and returns the status runFile would exit
+// with.
+static int runJob(const char *path, FILE *err) {
+    Source source;
+    if (!loadSource(path, &source, err)) {
+        return 74;
+    }
+    InterpreterResult res = interpretFile(path, source.text);
+    freeSource(&source);
+    return res == INTERPRET_OK ? 0 : 1;
 }
 
-static size_t getFileSize(FILE *file) {
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+// interpretFile runs source, read from path, with its compiled form cached
+// next to it as path with a "c" appended, e.g. script.dojoc. A script read
+// from stdin is never cached.
+static InterpreterResult interpretFile(const char *path, const char *source) {
+    if (!isCacheEnabled || strcmp(path, "-") == 0) {
+        return interpret(source);
+    }
+    size_t length = strlen(path);
+    char *cachePath = ALLOCATE(char, length + 2);
+    memcpy(cachePath, path, length);
+    memcpy(cachePath + length, "c", 2);
+    InterpreterResult res = interpretCached(source, cachePath);
+    FREE(char, cachePath);
+    return res;
+}
 
-    return fileSize;
+// loadSource fills source with the script at path, or returns false after
+// reporting to err why it could not be read.
+static bool loadSource(const char *path, Source *source, FILE *err) {
+    bool isStdin = strcmp(path, "-") == 0;
+    int fd = isStdin ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(err, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+    // A regular file of size 0 may still have content, like those in /proc.
+    struct stat st;
+    bool isMappable =
+        fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+    bool isLoaded =
+        (isMappable && mapSource(fd, st.st_size, source)) ||
+        readSource(fd, source);
+    if (!isStdin) {
+        close(fd);
+    }
+    if (!isLoaded) {
+        fprintf(err, "Could not read file \"%s\".\n", path);
+    }
+    return isLoaded;
 }
 
-static char *readFileContent(FILE *file, size_t fileSize, const char *path) {
-    char *buffer = (char *)malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+// mapSource maps the size bytes of the file fd over the start of a zeroed
+// mapping that is at least a byte longer, so that the text ends in a '\0'
+// without being copied, even when size is a multiple of the page size.
+static bool mapSource(int fd, size_t size, Source *source) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mappedSize = (size / page + 1) * page;
+    char *text = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (text == MAP_FAILED) {
+        return false;
     }
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\". \n", path);
-        exit(74);
+    if (mmap(text, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+        MAP_FAILED) {
+        munmap(text, mappedSize);
+        return false;
     }
-    buffer[bytesRead] = '\0';
+    source->text = text;
+    source->length = size;
+    source->mappedSize = mappedSize;
+    return true;
+}
 
-    return buffer;
+// readSource reads fd to its end, for sources that cannot be mapped.
+static bool readSource(int fd, Source *source) {
+    size_t capacity = 4096;
+    size_t length = 0;
+    char *text = malloc(capacity);
+    for (;;) {
+        if (text == NULL) {
+            return false;
+        }
+        ssize_t count = read(fd, text + length, capacity - length - 1);
+        if (count == 0) {
+            break;
+        }
+        if (count < 0 && errno != EINTR) {
+            free(text);
+            return false;
+        }
+        if (count > 0) {
+            length += count;
+        }
+        if (length + 1 == capacity) {
+            capacity *= 2;
+            char *grown = realloc(text, capacity);
+            if (grown == NULL) {
+                free(text);
+            }
+            text = grown;
+        }
+    }
+    text[length] = '\0';
+    *source = (Source){text, length, 0};
+    return true;
+}
+
+static void freeSource(Source *source) {
+    if (source->mappedSize) {
+        munmap(source->text, source->mappedSize);
+    } else {
+        free(source->text);
+    }
 }
@@ -1,4 +1,5 @@
 #include "memory.h"
+#include "cache.h"
 #include "compiler.h"
 #include "hashmap.h"
 #include "object.h"
@@ -21,13 +22,16 @@ static void sweep();
 static void blackenObj();
 static void markStack();
 static void markFrameClosures();
+static void markUpvalues();
+static void markFiber(ObjFiber *fiber);
 static void markArray(ValueArray *array);
+static void markCaches(ThreadedCode *code);
 
-GC gc;
+ISOLATE_LOCAL GC gc;
 
 void *gcReallocate(void *ptr, size_t oldSize, size_t newSize) {
     gc.allocated += newSize - oldSize;
-    if (newSize > oldSize) {
+    if (newSize > oldSize && !gc.isPaused) {
 #ifdef DEBUG_STRESS_GC
         collectGarbage();
 #endif
@@ -64,6 +68,13 @@ void *reallocate(void *ptr, size_t oldSize, size_t newSize) {
 void initGC() {
     gc.grayStack = NULL;
     gc.capacity = 0;
+    gc.isPaused = false;
+    resetGC();
+}
+
+// resetGC starts the accounting over for the next script of a VM, which
+// keeps the gray stack the last one grew.
+void resetGC() {
     gc.count = 0;
     gc.allocated = 0;
     gc.nextGC = 1024 * 1 - 24;
@@ -73,6 +84,12 @@ void terminateGC() {
     free(gc.grayStack);
 }
 
+// pauseGC keeps the collector from ever running, on a thread whose objects
+// are handed to the heap of another.
+void pauseGC() {
+    gc.isPaused = true;
+}
+
 static void appendToGrayStack(Obj *obj) {
     if (IS_EXCEEDING_CAPACITY(gc.count, gc.capacity)) {
         int newCapacity = GROW_CAPACITY(gc.capacity);
@@ -104,8 +121,13 @@ static void collectGarbage() {
 static void markRoots() {
     markStack();
     markFrameClosures();
-    markMap(&vm.globals);
+    markUpvalues();
+    markObj((Obj *)vm.fiber);
+    markMap(&vm.globalSlots);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
     markCompilerRoots();
+    markCacheRoots();
     markObj((Obj *)vm.initString);
 }
 
@@ -153,13 +175,21 @@ static void blackenObj(Obj *obj) {
     case OBJ_INSTANCE: {
         ObjInstance *instance = ((ObjInstance *)obj);
         markObj((Obj *)instance->djClass);
-        markMap(&instance->fields);
+        if (instance->dictionary != NULL) {
+            markMap(instance->dictionary);
+            break;
+        }
+        markObj((Obj *)instance->shape);
+        for (int i = 0; i < instance->shape->count; i++) {
+            markValue(instance->fields[i]);
+        }
         break;
     }
     case OBJ_CLASS: {
         ObjClass *djClass = ((ObjClass *)obj);
         markObj((Obj *)djClass->name);
         markMap(&djClass->methods);
+        markObj((Obj *)djClass->shape);
         break;
     }
     case OBJ_CLOSURE: {
@@ -174,11 +204,28 @@ static void blackenObj(Obj *obj) {
         ObjFn *fn = ((ObjFn *)obj);
         markObj((Obj *)fn->name);
         markArray(&fn->chunk.constants);
+        markCaches(&fn->threaded);
         break;
     }
 
-    case OBJ_UPVALUE:
-        markValue(((ObjUpvalue *)obj)->closed);
+    case OBJ_UPVALUE: {
+        // An open upvalue points into the stack of its fiber.
+        ObjUpvalue *upvalue = (ObjUpvalue *)obj;
+        markValue(upvalue->closed);
+        if (upvalue->location != &upvalue->closed) {
+            markObj((Obj *)upvalue->fiber);
+        }
+        break;
+    }
+    case OBJ_SHAPE: {
+        ObjShape *shape = ((ObjShape *)obj);
+        markObj((Obj *)shape->parent);
+        markObj((Obj *)shape->name);
+        markMap(&shape->transitions);
+        break;
+    }
+    case OBJ_FIBER:
+        markFiber((ObjFiber *)obj);
         break;
     case OBJ_NATIVE_FN:
     case OBJ_STRING:
@@ -194,7 +241,7 @@ static void markStack() {
 
 static void markFrameClosures() {
     for (int i = 0; i < vm.frameCount; i++) {
-        markObj((Obj *)vm.frames[i].closure);
+        markObj((Obj *)frameAt(i)->closure);
     }
 }
 
@@ -204,12 +251,43 @@ static void markUpvalues() {
     }
 }
 
+// markFiber marks what markStack, markFrameClosures and markUpvalues mark
+// for the running fiber, from the stacks a fiber keeps while another runs.
+static void markFiber(ObjFiber *fiber) {
+    markObj((Obj *)fiber->closure);
+    markObj((Obj *)fiber->caller);
+    for (Value *slot = fiber->stack; slot < fiber->stackTop; slot++) {
+        markValue(*slot);
+    }
+    for (int i = 0; i < fiber->frameCount; i++) {
+        CallFrame *frame =
+            &fiber->frameSegments[i / FRAME_SEGMENT][i % FRAME_SEGMENT];
+        markObj((Obj *)frame->closure);
+    }
+    for (ObjUpvalue *upval = fiber->openUpvalues; upval; upval = upval->next) {
+        markObj((Obj *)upval);
+    }
+}
+
 static void markArray(ValueArray *array) {
     for (int i = 0; i < array->count; i++) {
         markValue(array->values[i]);
     }
 }
 
+// markCaches keeps the shapes in the inline caches of code alive, so that
+// a new shape can never be mistaken for one that was collected.
+static void markCaches(ThreadedCode *code) {
+    for (int i = 0; i < code->cacheCount; i++) {
+        InlineCache *cache = &code->caches[i];
+        for (int j = 0; j < cache->count && j < IC_ENTRIES; j++) {
+            markObj((Obj *)cache->entries[j].shape);
+            markObj((Obj *)cache->entries[j].next);
+            markValue(cache->entries[j].method);
+        }
+    }
+}
+
 void markValue(Value val) {
     if (IS_OBJ(val)) {
         markObj(AS_OBJ(val));
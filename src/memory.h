@@ -10,11 +10,13 @@ typedef struct {
     int capacity;
     size_t allocated;
     size_t nextGC;
+    bool isPaused; // Set on a thread that only compiles.
 } GC;
 
 #define GC_ALLOCATE(type, count)                                               \
-    (type *)gcReallocate(NULL, 0, sizeof(type) * count);
-#define ALLOCATE(type, count) (type *)reallocate(NULL, 0, sizeof(type) * count)
+    (type *)gcReallocate(NULL, 0, sizeof(type) * (count));
+#define ALLOCATE(type, count)                                                  \
+    (type *)reallocate(NULL, 0, sizeof(type) * (count))
 
 #define GC_FREE(type, pointer) gcReallocate(pointer, sizeof(type), 0)
 
@@ -30,11 +32,15 @@ typedef struct {
 #define FREE_ARRAY(type, arr, oldCount)                                        \
     (type *)gcReallocate(arr, sizeof(type) * oldCount, 0)
 
+extern ISOLATE_LOCAL GC gc;
+
 void *gcReallocate(void *ptr, size_t oldSize, size_t newSize);
 void *reallocate(void *ptr, size_t oldSize, size_t newSize);
 
 void initGC();
+void resetGC();
 void terminateGC();
+void pauseGC();
 
 void markValue(Value val);
 void markObj(Obj *obj);
@@ -1,15 +1,113 @@
 #include "node.h"
 #include "memory.h"
 
+// Nodes are bump allocated from blocks, and freed all at once by freeNodes
+// when the tree they make up is compiled. Each block is twice the size of the
+// one before, so that the small trees detachNodes hands out stay small.
+#define NODE_BLOCK_MIN (1024)
+#define NODE_BLOCK_MAX (64 * 1024)
+
+#define NODE_SIZE(slots) (offsetof(Node, operand) + (slots) * sizeof(Node *))
+
+typedef struct NodeBlock {
+    struct NodeBlock *next;
+    size_t used;
+    size_t size;
+    uint8_t bytes[];
+} NodeBlock;
+
 static void initNode(Node *node, NodeType type, Token *token);
+static void *allocateNode(size_t size);
+static void freeNodeBlock(NodeBlock *block);
+
+static ISOLATE_LOCAL NodeBlock *blocks = NULL;
+
+// The slots each type of node uses.
+static const uint8_t slotCounts[] = {
+    [ND_CLASS_DECL] = 2,    [ND_SUPER] = 0,         [ND_METHOD] = 2,
+    [ND_FN_DECL] = 2,       [ND_PARAM] = 0,         [ND_VAR_DECL] = 1,
+    [ND_FOR] = 4,           [ND_WHILE] = 2,         [ND_BREAK] = 0,
+    [ND_CONTINUE] = 0,      [ND_IF] = 3,            [ND_BLOCK] = 1,
+    [ND_EXPRESSION] = 1,    [ND_RETURN] = 1,        [ND_CALL] = 2,
+    [ND_ASSIGNMENT] = 2,    [ND_TERNARY] = 3,       [ND_BINARY] = 2,
+    [ND_AND] = 2,           [ND_OR] = 2,            [ND_UNARY] = 1,
+    [ND_YIELD] = 1,         [ND_PROPERTY] = 1,      [ND_THIS] = 0,
+    [ND_VAR] = 0,           [ND_TEMPLATE_HEAD] = 1, [ND_TEMPLATE_SPAN] = 1,
+    [ND_STRING] = 0,        [ND_NUMBER] = 0,        [ND_LITERAL] = 0,
+    [ND_EMPTY] = 4,
+};
 
 Node *newNode(NodeType type, Token *token) {
-    Node *node = ALLOCATE(Node, 1);
+    Node *node = allocateNode(NODE_SIZE(slotCounts[type]));
     initNode(node, type, token);
     return node;
 }
 
+// resetNodes frees every node allocated so far, but keeps a block for the
+// nodes to come.
+void resetNodes() {
+    if (blocks == NULL) {
+        return;
+    }
+    while (blocks->next) {
+        NodeBlock *next = blocks->next;
+        freeNodeBlock(blocks);
+        blocks = next;
+    }
+    blocks->used = 0;
+}
+
+// freeNodes frees every node allocated so far.
+void freeNodes() {
+    freeNodeBlocks(blocks);
+    blocks = NULL;
+}
+
+// detachNodes hands the nodes allocated so far to the caller, who frees them
+// with freeNodeBlocks, and starts the nodes to come in blocks of their own.
+NodeBlock *detachNodes() {
+    NodeBlock *detached = blocks;
+    blocks = NULL;
+    return detached;
+}
+
+// attachNodes frees the nodes allocated so far, and continues the detached
+// ones with the nodes to come.
+void attachNodes(NodeBlock *attached) {
+    freeNodes();
+    blocks = attached;
+}
+
+void freeNodeBlocks(NodeBlock *block) {
+    while (block) {
+        NodeBlock *next = block->next;
+        freeNodeBlock(block);
+        block = next;
+    }
+}
+
+static void freeNodeBlock(NodeBlock *block) {
+    reallocate(block, sizeof(NodeBlock) + block->size, 0);
+}
+
 static void initNode(Node *node, NodeType type, Token *token) {
     node->type = type;
-    node->token = token;
-}
\ No newline at end of file
+    node->token = *token;
+}
+
+static void *allocateNode(size_t size) {
+    if (blocks == NULL || blocks->size - blocks->used < size) {
+        size_t blockSize = blocks == NULL ? NODE_BLOCK_MIN : blocks->size * 2;
+        if (blockSize > NODE_BLOCK_MAX) {
+            blockSize = NODE_BLOCK_MAX;
+        }
+        NodeBlock *block = reallocate(NULL, 0, sizeof(NodeBlock) + blockSize);
+        block->next = blocks;
+        block->used = 0;
+        block->size = blockSize;
+        blocks = block;
+    }
+    void *node = blocks->bytes + blocks->used;
+    blocks->used += size;
+    return node;
+}
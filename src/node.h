@@ -28,6 +28,7 @@ typedef enum {
     ND_AND,
     ND_OR,
     ND_UNARY,
+    ND_YIELD,
     ND_PROPERTY,
     ND_THIS,
     ND_VAR,
@@ -40,22 +41,38 @@ typedef enum {
     ND_EMPTY
 } NodeType;
 
-// TODO: use union rather than a bunch of pointers
+// The children of a node are kept in slots after next, which each type
+// names in its own way, and a node is only allocated as large as the slots
+// its type uses. Nothing but the fields of its type may be read.
 typedef struct Node {
     NodeType type;
-    Token *token;
     int count;
+    Token token;
     struct Node *next;
-    struct Node *lhs;
-    struct Node *rhs;
-    struct Node *operand;
-    struct Node *thenBranch;
-    struct Node *elseBranch;
-    struct Node *increment;
+    union {
+        struct Node *operand;
+        struct Node *lhs;
+    };
+    union {
+        struct Node *thenBranch;
+        struct Node *rhs;
+        struct Node *args;
+    };
+    union {
+        struct Node *elseBranch;
+        struct Node *increment;
+    };
     struct Node *init;
 } Node;
 
+typedef struct NodeBlock NodeBlock;
+
 Node *newNode(NodeType type, Token *token);
+void resetNodes();
+void freeNodes();
+NodeBlock *detachNodes();
+void attachNodes(NodeBlock *attached);
+void freeNodeBlocks(NodeBlock *blocks);
 
 #define NEW_CLASS_DECL(name, methods, heritage)                                \
     newClassDeclarationNode(name, methods, heritage)
@@ -177,7 +194,7 @@ static inline Node *newExpressionNode(Token *token, Node *expression) {
 static inline Node *newCallNode(Token *token, Node *lhs, Node *args) {
     Node *node = newNode(ND_CALL, token);
     node->lhs = lhs;
-    node->operand = args;
+    node->args = args;
     return node;
 }
 
@@ -237,6 +254,14 @@ static inline Node *newUnaryNode(Token *token, Node *operand) {
     return node;
 }
 
+#define NEW_YIELD(token, operand) newYieldNode(token, operand)
+
+static inline Node *newYieldNode(Token *token, Node *operand) {
+    Node *node = newNode(ND_YIELD, token);
+    node->operand = operand;
+    return node;
+}
+
 #define NEW_TEMPLATE_HEAD(token) newTemplateHeadNode(token)
 
 static inline Node *newTemplateHeadNode(Token *token) {
@@ -1,6 +1,8 @@
 #include "object.h"
 #include "hashmap.h"
+#include "jit.h"
 #include "memory.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 #include <stdio.h>
@@ -13,6 +15,9 @@ static char *allocateNewCStr(const char *str, int len);
 static ObjString *getInternedString(const char *str, int len);
 static ObjString *internString(const char *str, int len);
 static void initObjString(ObjString *objstr, const char *str, int len);
+static ObjShape *addTransition(ObjShape *shape, ObjString *name);
+static void growFields(ObjInstance *instance);
+static void moveToDictionary(ObjInstance *instance);
 
 static Obj *allocateObj(size_t size, ObjType type) {
     Obj *object = gcReallocate(NULL, 0, size);
@@ -47,8 +52,16 @@ void freeObj(Obj *obj) {
     }
     case OBJ_INSTANCE: {
         ObjInstance *instance = (ObjInstance *)obj;
-        freeMap(&instance->fields);
-        GC_FREE(ObjInstance, obj);
+        if (instance->fields != instance->slots) {
+            FREE_ARRAY(Value, instance->fields, instance->capacity);
+        }
+        if (instance->dictionary != NULL) {
+            freeMap(instance->dictionary);
+            FREE(Hashmap, instance->dictionary);
+        }
+        gcReallocate(obj,
+                     sizeof(ObjInstance) + sizeof(Value) * instance->slotCount,
+                     0);
         break;
     }
     case OBJ_CLASS: {
@@ -66,6 +79,9 @@ void freeObj(Obj *obj) {
     case OBJ_FN: {
         ObjFn *fn = (ObjFn *)obj;
         freeChunk(&fn->chunk);
+        freeThreadedCode(&fn->threaded);
+        freeJitCode(&fn->jit);
+        freeTraces(fn->traces);
         GC_FREE(ObjFn, fn);
         break;
     }
@@ -85,6 +101,22 @@ void freeObj(Obj *obj) {
         GC_FREE(ObjUpvalue, obj);
         break;
     }
+    case OBJ_SHAPE: {
+        freeMap(&((ObjShape *)obj)->transitions);
+        GC_FREE(ObjShape, obj);
+        break;
+    }
+    case OBJ_FIBER: {
+        // The stacks of the running fiber are the VM's to free.
+        ObjFiber *fiber = (ObjFiber *)obj;
+        for (int i = 0; i < fiber->segmentCount; i++) {
+            FREE(CallFrame, fiber->frameSegments[i]);
+        }
+        FREE(CallFrame *, fiber->frameSegments);
+        FREE(Value, fiber->stack);
+        GC_FREE(ObjFiber, obj);
+        break;
+    }
     }
 }
 
@@ -138,6 +170,14 @@ void printObjToFile(FILE *f, Value obj) {
         fprintf(f, "upvalue");
         return;
     }
+    case OBJ_SHAPE: {
+        fprintf(f, "shape");
+        return;
+    }
+    case OBJ_FIBER: {
+        fprintf(f, "<fiber>");
+        return;
+    }
     }
 }
 
@@ -148,10 +188,18 @@ ObjBoundMethod *newObjBoundMethod(Value receiver, ObjClosure *method) {
     return bMethod;
 }
 
+// newObjInstance makes room in the instance itself for as many fields as
+// any instance of djClass has had so far.
 ObjInstance *newObjInstance(ObjClass *djClass) {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    int slotCount = djClass->fieldCount;
+    ObjInstance *instance = (ObjInstance *)allocateObj(
+        sizeof(ObjInstance) + sizeof(Value) * slotCount, OBJ_INSTANCE);
     instance->djClass = djClass;
-    initMap(&instance->fields);
+    instance->shape = djClass->shape;
+    instance->fields = instance->slots;
+    instance->capacity = slotCount;
+    instance->slotCount = slotCount;
+    instance->dictionary = NULL;
     return instance;
 }
 
@@ -159,6 +207,12 @@ ObjClass *newObjClass(ObjString *name) {
     ObjClass *djClass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     djClass->name = name;
     initMap(&djClass->methods);
+    djClass->version = 0;
+    djClass->shape = NULL;
+    djClass->fieldCount = 0;
+    push(OBJ_VAL(djClass));
+    djClass->shape = newObjShape(NULL, NULL);
+    pop();
     return djClass;
 }
 
@@ -180,6 +234,12 @@ ObjFn *newObjFn() {
     fn->upvalueCount = 0;
     fn->name = NULL;
     initChunk(&fn->chunk);
+    initThreadedCode(&fn->threaded);
+    initJitCode(&fn->jit);
+    fn->traces = NULL;
+    fn->lazySource = NULL;
+    fn->lazyLine = 0;
+    fn->job = NULL;
     return fn;
 }
 
@@ -195,9 +255,130 @@ ObjUpvalue *newObjUpvalue(Value *slot) {
     upvalue->location = slot;
     upvalue->next = NULL;
     upvalue->closed = NIL_VAL;
+    upvalue->fiber = vm.fiber;
     return upvalue;
 }
 
+ObjFiber *newObjFiber(ObjClosure *closure) {
+    ObjFiber *fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+    fiber->closure = closure;
+    fiber->caller = NULL;
+    fiber->isDone = false;
+    fiber->frameSegments = NULL;
+    fiber->segmentCount = 0;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = 0;
+    fiber->stack = NULL;
+    fiber->stackCapacity = 0;
+    fiber->stackLimit = NULL;
+    fiber->stackTop = NULL;
+    fiber->openUpvalues = NULL;
+    return fiber;
+}
+
+ObjShape *newObjShape(ObjShape *parent, ObjString *name) {
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->count = parent == NULL ? 0 : parent->count + 1;
+    initMap(&shape->transitions);
+    return shape;
+}
+
+// findField returns the slot of the field name in instances of shape, or -1.
+int findField(ObjShape *shape, ObjString *name) {
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name) {
+            return shape->count - 1;
+        }
+    }
+    return -1;
+}
+
+bool getField(ObjInstance *instance, ObjString *name, Value *value) {
+    if (instance->dictionary != NULL) {
+        return mapGet(instance->dictionary, name, value);
+    }
+    int slot = findField(instance->shape, name);
+    if (slot == -1) {
+        return false;
+    }
+    *value = instance->fields[slot];
+    return true;
+}
+
+// setField gives instance the next shape when it does not have the field
+// yet. The instance and value must be reachable by the collector.
+void setField(ObjInstance *instance, ObjString *name, Value value) {
+    if (instance->dictionary != NULL) {
+        mapPut(instance->dictionary, name, value);
+        return;
+    }
+    ObjShape *shape = instance->shape;
+    int slot = findField(shape, name);
+    if (slot != -1) {
+        instance->fields[slot] = value;
+        return;
+    }
+    if (shape->count == MAX_SHAPE_FIELDS) {
+        moveToDictionary(instance);
+        mapPut(instance->dictionary, name, value);
+        return;
+    }
+
+    ObjShape *next = addTransition(shape, name);
+    if (shape->count == instance->capacity) {
+        growFields(instance);
+    }
+    instance->fields[shape->count] = value;
+    instance->shape = next;
+    if (instance->djClass->fieldCount < next->count) {
+        instance->djClass->fieldCount = next->count;
+    }
+}
+
+static ObjShape *addTransition(ObjShape *shape, ObjString *name) {
+    Value next;
+    if (mapGet(&shape->transitions, name, &next)) {
+        return AS_SHAPE(next);
+    }
+    ObjShape *child = newObjShape(shape, name);
+    push(OBJ_VAL(child));
+    mapPut(&shape->transitions, name, OBJ_VAL(child));
+    pop();
+    return child;
+}
+
+// growFields moves the fields out of the slots, or into a larger array.
+static void growFields(ObjInstance *instance) {
+    int capacity = GROW_CAPACITY(instance->capacity);
+    Value *fields = GC_ALLOCATE(Value, capacity);
+    for (int i = 0; i < instance->shape->count; i++) {
+        fields[i] = instance->fields[i];
+    }
+    if (instance->fields != instance->slots) {
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+    }
+    instance->fields = fields;
+    instance->capacity = capacity;
+}
+
+static void moveToDictionary(ObjInstance *instance) {
+    Hashmap *dictionary = ALLOCATE(Hashmap, 1);
+    initMap(dictionary);
+    for (ObjShape *shape = instance->shape; shape->name != NULL;
+         shape = shape->parent) {
+        mapPut(dictionary, shape->name, instance->fields[shape->count - 1]);
+    }
+    instance->dictionary = dictionary;
+    instance->shape = NULL;
+    if (instance->fields != instance->slots) {
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+    }
+    instance->fields = instance->slots;
+    instance->capacity = instance->slotCount;
+}
+
 Value newObjStringInVal(const char *str, int len) {
     return OBJ_VAL(newObjString(str, len));
 }
@@ -15,8 +15,13 @@ typedef enum {
     OBJ_NATIVE_FN,
     OBJ_UPVALUE,
     OBJ_STRING,
+    OBJ_SHAPE,
+    OBJ_FIBER,
 } ObjType;
 
+// An instance that would get more fields than this keeps them in a hashmap.
+#define MAX_SHAPE_FIELDS 32
+
 typedef struct Obj {
     ObjType type;
     bool isMarked;
@@ -36,7 +41,15 @@ typedef struct {
     int arity;
     int upvalueCount;
     Chunk chunk;
+    ThreadedCode threaded; // Filled in on the first call.
+    JitCode jit;
+    struct Trace *traces; // Compiled loops, linked through Trace.next.
     ObjString *name;
+    // The name of a function whose body is compiled on its first call, and
+    // the line it is on. NULL once the body is compiled.
+    const char *lazySource;
+    int lazyLine;
+    struct CompileJob *job; // Compiling the body in the background, or NULL.
 } ObjFn;
 
 typedef struct ObjUpvalue {
@@ -44,6 +57,7 @@ typedef struct ObjUpvalue {
     Value *location;
     Value closed;
     struct ObjUpvalue *next;
+    struct ObjFiber *fiber; // Whose stack location is in while open.
 } ObjUpvalue;
 
 typedef struct {
@@ -53,6 +67,7 @@ typedef struct {
     int upvalueCount; // Needed for GC since fn can be freed first.
 } ObjClosure;
 
+// A native returns UNDEFINED_VAL after reporting a runtime error.
 typedef Value (*NativeFn)(int argCount, Value *args);
 
 typedef struct {
@@ -61,16 +76,36 @@ typedef struct {
     NativeFn fn;
 } ObjNativeFn;
 
-typedef struct {
+// A shape is the layout shared by instances that got the same fields in the
+// same order: the field it adds to its parent goes in slot count - 1. Every
+// class has an empty root shape, and adding a field moves an instance to
+// the child shape for that name.
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape *parent;
+    ObjString *name; // NULL for the root.
+    int count;
+    Hashmap transitions; // Field name to child shape.
+} ObjShape;
+
+typedef struct ObjClass {
     Obj obj;
     ObjString *name;
     Hashmap methods;
+    int version;    // Bumped whenever methods changes.
+    ObjShape *shape; // The root shape of its instances.
+    int fieldCount; // The most fields an instance has had, for new ones.
 } ObjClass;
 
 typedef struct {
     Obj obj;
     ObjClass *djClass;
-    Hashmap fields;
+    ObjShape *shape;       // NULL once the fields are in dictionary.
+    Value *fields;         // shape->count values, in slots until they fill.
+    int capacity;          // Of fields.
+    int slotCount;         // Of slots.
+    Hashmap *dictionary;   // Fields past MAX_SHAPE_FIELDS.
+    Value slots[];
 } ObjInstance;
 
 typedef struct {
@@ -79,6 +114,26 @@ typedef struct {
     ObjClosure *method;
 } ObjBoundMethod;
 
+// A fiber runs a function on stacks of its own, from when it is first
+// resumed until the function returns, and can yield to the fiber that
+// resumed it on the way. The VM holds the stacks of the running fiber, and
+// each of the others keeps its own here.
+typedef struct ObjFiber {
+    Obj obj;
+    ObjClosure *closure;     // Until the first resume starts it.
+    struct ObjFiber *caller; // The fiber that resumed it, while it runs.
+    bool isDone;
+    struct CallFrame **frameSegments;
+    int segmentCount;
+    int frameCount;
+    int frameCapacity;
+    Value *stack;
+    int stackCapacity;
+    Value *stackLimit;
+    Value *stackTop;
+    ObjUpvalue *openUpvalues;
+} ObjFiber;
+
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
@@ -89,6 +144,8 @@ typedef struct {
 #define AS_NATIVE_FN(value) ((ObjNativeFn *)AS_OBJ(value))
 #define AS_UPVALUE(value) ((ObjUpvalue *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->str)
 
 #define IS_BOUND_METHOD(obj) isObjType(obj, OBJ_BOUND_METHOD)
@@ -98,6 +155,7 @@ typedef struct {
 #define IS_CLOUSRE(obj) isObjType(obj, OBJ_CLOSURE)
 #define IS_UPVALUE(obj) isObjType(obj, OBJ_UPVALUE)
 #define IS_STRING(obj) isObjType(obj, OBJ_STRING)
+#define IS_FIBER(obj) isObjType(obj, OBJ_FIBER)
 
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
@@ -113,6 +171,12 @@ ObjClosure *newObjClosure(ObjFn *fn);
 ObjFn *newObjFn();
 ObjNativeFn *newObjNativeFn(NativeFn fn, int arity);
 ObjUpvalue *newObjUpvalue(Value *slot);
+ObjFiber *newObjFiber(ObjClosure *closure);
+ObjShape *newObjShape(ObjShape *parent, ObjString *name);
+
+int findField(ObjShape *shape, ObjString *name);
+bool getField(ObjInstance *instance, ObjString *name, Value *value);
+void setField(ObjInstance *instance, ObjString *name, Value value);
 
 ObjString *newObjString(const char *str, int len);
 Value newObjStringInVal(const char *str, int len);
@@ -8,9 +8,9 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
-Parser parser;
+ISOLATE_LOCAL Parser parser;
 
-Node SENTINEL;
+ISOLATE_LOCAL Node SENTINEL;
 
 typedef enum {
     PREC_NONE,
@@ -18,11 +18,14 @@ typedef enum {
     PREC_TERNARY,    // ?:
     PREC_OR,         // ||
     PREC_AND,        // &&
+    PREC_BIT_OR,     // |
+    PREC_BIT_XOR,    // ^
+    PREC_BIT_AND,    // &
     PREC_EQUALITY,   // == !=
     PREC_COMPARISON, // < > <= >=
     PREC_SHIFT,      // << >>
     PREC_TERM,       // + -
-    PREC_FACTOR,     // * /
+    PREC_FACTOR,     // * / %
     PREC_UNARY,      // ! -
     PREC_CALL,       // . ()
     PREC_PRIMARY
@@ -87,6 +90,7 @@ static Node *and_();
 static Node *or_();
 static Node *binary();
 static Node *unary();
+static Node *yield_();
 static Node *this_();
 static Node *variable();
 static Node *stringTemplate();
@@ -119,6 +123,8 @@ ParseRule rules[] = {
     [TOKEN_NEWLINE] = {NULL, NULL, PREC_NONE},
     [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
     [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_PERCENT] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_CARET] = {NULL, binary, PREC_BIT_XOR},
     [TOKEN_QUESTION] = {NULL, ternary, PREC_TERNARY},
     [TOKEN_BANG] = {unary, NULL, PREC_UNARY},
     [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
@@ -128,6 +134,10 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_LESS_LESS] = {NULL, binary, PREC_SHIFT},
+    [TOKEN_GREATER_GREATER] = {NULL, binary, PREC_SHIFT},
+    [TOKEN_AMPERSAND] = {NULL, binary, PREC_BIT_AND},
+    [TOKEN_PIPE] = {NULL, binary, PREC_BIT_OR},
     [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_PRE_TEMPLATE] = {stringTemplate, NULL, PREC_NONE},
@@ -148,32 +158,34 @@ ParseRule rules[] = {
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_YIELD] = {yield_, NULL, PREC_NONE},
     [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
     [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
 };
 
-void initParser(const char *source) {
-    initScanner(source);
+// initParser starts parsing source, which starts on line.
+void initParser(const char *source, int line) {
+    initScanner(source, line);
     resetSentinel();
     parser.hadError = false;
     parser.panicMode = false;
     parser.stmts = &SENTINEL;
     parser.tail = parser.stmts;
+    advance();
 }
 
+// terminateParser frees the nodes the parser made, once they are compiled.
 void terminateParser() {
-    terminateScanner();
+    freeNodes();
 }
 
 static void resetSentinel() {
     SENTINEL.type = ND_EMPTY;
-    SENTINEL.token = NULL;
     SENTINEL.next = NULL;
 }
 
+// parse parses the whole source into a list of declarations.
 Node *parse(bool *hadError) {
-    advance();
-
     while (!match(TOKEN_EOF)) {
         skipNewlines();
         Node *decl = declaration();
@@ -185,6 +197,33 @@ Node *parse(bool *hadError) {
     return parser.stmts->next;
 }
 
+// parseDeclaration parses the next declaration of the source, or returns
+// NULL once there is none left. The nodes of a declaration are freed by the
+// next call, so a caller that compiles the source a declaration at a time
+// never holds the tree of more than one.
+Node *parseDeclaration(bool *hadError) {
+    resetNodes();
+    Node *decl = NULL;
+    while (decl == NULL) {
+        skipNewlines();
+        if (match(TOKEN_EOF)) {
+            break;
+        }
+        decl = declaration();
+    }
+    *hadError = parser.hadError;
+    return decl;
+}
+
+// parseFnDeclaration parses a function declaration from the name after its
+// 'fn'.
+Node *parseFnDeclaration(bool *hadError) {
+    resetNodes();
+    Node *decl = fnDeclaration();
+    *hadError = parser.hadError;
+    return decl;
+}
+
 static void skipNewlines() {
     while (match(TOKEN_NEWLINE)) {
         ;
@@ -216,7 +255,7 @@ static Node *declaration() {
 
 static Node *classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect an identifier after 'class'.");
-    Token *name = parser.previous;
+    Token name = parser.previous;
     Node *super = heritage();
     consume(TOKEN_LEFT_BRACE, "Expect a '{' before class body");
     skipNewlines();
@@ -234,35 +273,35 @@ static Node *classDeclaration() {
     }
     consume(TOKEN_RIGHT_BRACE, "Expect a '}' after class body");
     expectStmtEnd("Expect a newline character after a class declaration");
-    return NEW_CLASS_DECL(name, head, super);
+    return NEW_CLASS_DECL(&name, head, super);
 }
 
 static Node *heritage() {
     if (match(TOKEN_EXTENDS)) {
         consume(TOKEN_IDENTIFIER, "Expect an identifer after 'extends'.");
-        return NEW_HERITAGE(parser.previous);
+        return NEW_HERITAGE(&parser.previous);
     }
     return NULL;
 }
 
 static Node *method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    Token *name = parser.previous;
+    Token name = parser.previous;
     Node *params = parameters();
     consume(TOKEN_LEFT_BRACE, "Expect a '{' after params list.");
     Node *body = parseBlock();
     expectStmtEnd("Expect a newline character after a method decalration");
-    return NEW_METHOD(name, params, body);
+    return NEW_METHOD(&name, params, body);
 }
 
 static Node *fnDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect an identifier after 'fn'.");
-    Token *fnName = parser.previous;
+    Token fnName = parser.previous;
     Node *params = parameters();
     consume(TOKEN_LEFT_BRACE, "Expect a '{' after params list");
     Node *body = parseBlock();
     expectStmtEnd("Expect a newline character after a function declaration");
-    return NEW_FN_DECL(fnName, params, body);
+    return NEW_FN_DECL(&fnName, params, body);
 }
 
 static Node *parameters() {
@@ -275,8 +314,8 @@ static Node *parameters() {
     do {
         consume(TOKEN_IDENTIFIER,
                 "Expect identfier inside function paramlist.");
-        Token *ident = parser.previous;
-        Node *param = NEW_PARAM(ident);
+        Token ident = parser.previous;
+        Node *param = NEW_PARAM(&ident);
         if (!tail) {
             head = tail = param;
             tail->next = NULL;
@@ -290,13 +329,13 @@ static Node *parameters() {
 
 static Node *varDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect an identifier after 'var'.");
-    Token *token = parser.previous;
+    Token token = parser.previous;
     Node *initializer = NULL;
     if (match(TOKEN_EQUAL)) {
         initializer = expression();
     }
     expectStmtEnd("Expect a newline character after a variable declaration");
-    return NEW_VAR_DECL(token, initializer);
+    return NEW_VAR_DECL(&token, initializer);
 }
 
 static Node *stmt() {
@@ -320,7 +359,7 @@ static Node *stmt() {
 }
 
 static Node *forStmt() {
-    Token *token = parser.previous;
+    Token token = parser.previous;
     consume(TOKEN_LEFT_PAREN, "Expect a '(' after 'for'.");
     Node *init = forInit();
     consume(TOKEN_SEMICOLON, "Expect a ';'.");
@@ -330,7 +369,7 @@ static Node *forStmt() {
     consume(TOKEN_RIGHT_PAREN, "Expect a ')' after for clauses.");
     skipNewlines();
     Node *body = stmt();
-    return NEW_FOR_STMT(token, init, condition, increment, body);
+    return NEW_FOR_STMT(&token, init, condition, increment, body);
 }
 
 static Node *forInit() {
@@ -338,16 +377,16 @@ static Node *forInit() {
         return NULL;
     } else if (match(TOKEN_VAR)) {
         consume(TOKEN_IDENTIFIER, "Expect an identifier after 'var'.");
-        Token *token = parser.previous;
+        Token token = parser.previous;
         Node *initializer = NULL;
         if (match(TOKEN_EQUAL)) {
             initializer = expression();
         }
-        return NEW_VAR_DECL(token, initializer);
+        return NEW_VAR_DECL(&token, initializer);
     } else {
-        Token *token = parser.previous;
+        Token token = parser.previous;
         Node *express = expression();
-        return NEW_EXPRESS_STMT(token, express);
+        return NEW_EXPRESS_STMT(&token, express);
     }
 }
 
@@ -368,29 +407,29 @@ static Node *forIncrement() {
 }
 
 static Node *whileStmt() {
-    Token *token = parser.previous;
+    Token token = parser.previous;
     consume(TOKEN_LEFT_PAREN, "Expect a '(' after 'while'.");
     Node *condition = expression();
     consume(TOKEN_RIGHT_PAREN, "Expect a ')' after the if condition.");
     skipNewlines();
     Node *body = stmt();
-    return NEW_WHILE_STMT(token, condition, body);
+    return NEW_WHILE_STMT(&token, condition, body);
 }
 
 static Node *breakStmt() {
-    Token *token = parser.previous;
+    Token token = parser.previous;
     expectStmtEnd("Expect a newline character after a break statement.");
-    return NEW_BREAK_STMT(token);
+    return NEW_BREAK_STMT(&token);
 }
 
 static Node *continueStmt() {
-    Token *token = parser.previous;
+    Token token = parser.previous;
     expectStmtEnd("Expect a newline character after a continue statement.");
-    return NEW_CONTINUE_STMT(token);
+    return NEW_CONTINUE_STMT(&token);
 }
 
 static Node *ifStmt() {
-    Token *token = parser.previous;
+    Token token = parser.previous;
     consume(TOKEN_LEFT_PAREN, "Expect a '(' after 'if'.");
     Node *condition = expression();
     consume(TOKEN_RIGHT_PAREN, "Expect a ')' after the if condition.");
@@ -404,7 +443,7 @@ static Node *ifStmt() {
         expectStmtEnd("Expect a newline character after an if-else statement");
     }
 
-    return NEW_IF_STMT(token, condition, thenBranch, elseBranch);
+    return NEW_IF_STMT(&token, condition, thenBranch, elseBranch);
 }
 
 static Node *branch() {
@@ -433,7 +472,7 @@ static Node *blockStmt() {
 }
 
 static Node *parseBlock() {
-    Token *token = parser.previous;
+    Token token = parser.previous;
     skipNewlines();
     Node *head = NULL;
     Node *tail = head;
@@ -450,25 +489,25 @@ static Node *parseBlock() {
     }
 
     consume(TOKEN_RIGHT_BRACE, "Expect '}' at the end of a block statement");
-    Node *block = NEW_BLOCK_STMT(token, head);
+    Node *block = NEW_BLOCK_STMT(&token, head);
     return block;
 }
 
 static Node *returnStmt() {
-    Token *token = parser.previous;
+    Token token = parser.previous;
     Node *returnVal = NULL;
     if (!check(TOKEN_NEWLINE)) {
         returnVal = expression();
     }
     expectStmtEnd("Expect a newline character after a return statement.");
-    return NEW_RETURN_STMT(token, returnVal);
+    return NEW_RETURN_STMT(&token, returnVal);
 }
 
 static Node *expressionStmt() {
-    Token *token = parser.current;
+    Token token = parser.current;
     Node *express = expression();
     expectStmtEnd("Expect a newline character after a expression statement");
-    return NEW_EXPRESS_STMT(token, express);
+    return NEW_EXPRESS_STMT(&token, express);
 }
 
 static void expectStmtEnd(const char *msg) {
@@ -482,15 +521,15 @@ static Node *expression() {
 }
 
 static Node *call(Node *lhs) {
-    Token *token = parser.previous;
+    Token token = parser.previous;
     Node *args = arguments();
-    return NEW_CALL(token, lhs, args);
+    return NEW_CALL(&token, lhs, args);
 }
 
 static Node *super_() {
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Execpt an identifer after '.'.");
-    return NEW_SUPER(parser.previous);
+    return NEW_SUPER(&parser.previous);
 }
 
 static Node *arguments() {
@@ -499,6 +538,9 @@ static Node *arguments() {
     if (!check(TOKEN_RIGHT_PAREN)) {
         do {
             Node *arg = expression();
+            if (arg == NULL) {
+                break;
+            }
             if (!tail) {
                 head = tail = arg;
                 tail->next = NULL;
@@ -518,63 +560,78 @@ static Node *grouping() {
 };
 
 static Node *assignment(Node *lhs) {
-    Token *token = parser.previous;
+    Token token = parser.previous;
     Node *rhs = expression();
-    return NEW_ASSIGNMENT(token, lhs, rhs);
+    return NEW_ASSIGNMENT(&token, lhs, rhs);
 }
 
 static Node *ternary(Node *condition) {
-    Token *token = parser.previous;
+    Token token = parser.previous;
     Node *thenBranch = expression();
     consume(TOKEN_COLON, "Expect ':' after expression");
     Node *elseBranch = parsePrecedence(getRule(TOKEN_QUESTION)->precedence - 1);
-    return NEW_TERNARY(token, condition, thenBranch, elseBranch);
+    return NEW_TERNARY(&token, condition, thenBranch, elseBranch);
 }
 
 static Node *and_(Node *lhs) {
-    Token *op = parser.previous;
+    Token op = parser.previous;
     Node *rhs = parsePrecedence(PREC_AND);
-    return NEW_AND(op, lhs, rhs);
+    return NEW_AND(&op, lhs, rhs);
 }
 
 static Node *or_(Node *lhs) {
-    Token *op = parser.previous;
+    Token op = parser.previous;
     Node *rhs = parsePrecedence(PREC_OR);
-    return NEW_OR(op, lhs, rhs);
+    return NEW_OR(&op, lhs, rhs);
 }
 
 static Node *binary(Node *lhs) {
-    Token *op = parser.previous;
-    Node *rhs = parsePrecedence(getRule(op->type)->precedence + 1);
-    return NEW_BINARY(op, lhs, rhs);
+    Token op = parser.previous;
+    Node *rhs = parsePrecedence(getRule(op.type)->precedence + 1);
+    return NEW_BINARY(&op, lhs, rhs);
 };
 
 static Node *unary() {
-    Token *op = parser.previous;
+    Token op = parser.previous;
     Node *operand = parsePrecedence(PREC_UNARY);
-    return NEW_UNARY(op, operand);
+    return NEW_UNARY(&op, operand);
+}
+
+// yield_ parses a yield, which yields nil when nothing that can start an
+// expression follows it.
+static Node *yield_() {
+    Token token = parser.previous;
+    Node *operand = NULL;
+    if (getRule(parser.current.type)->prefix != NULL) {
+        operand = parsePrecedence(PREC_ASSIGNMENT);
+    }
+    return NEW_YIELD(&token, operand);
 }
 
 static Node *this_() {
-    return NEW_THIS(parser.previous);
+    return NEW_THIS(&parser.previous);
 }
 
 static Node *variable() {
-    return NEW_VAR(parser.previous);
+    return NEW_VAR(&parser.previous);
 }
 
 static Node *property(Node *lhs) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'");
-    return NEW_PROPERTY(parser.previous, lhs);
+    return NEW_PROPERTY(&parser.previous, lhs);
 }
 
 static Node *stringTemplate() {
-    Node *head = NEW_TEMPLATE_HEAD(parser.previous);
+    Node *head = NEW_TEMPLATE_HEAD(&parser.previous);
     Node *tail = head->operand;
 
-    while (parser.previous->type != TOKEN_AFTER_TEMPLATE) {
+    while (parser.previous.type != TOKEN_AFTER_TEMPLATE) {
         Node *express = expression();
-        Node *span = NEW_TEMPLATE_SPAN(parser.current, express);
+        if (!check(TOKEN_TWEEN_TEMPLATE) && !check(TOKEN_AFTER_TEMPLATE)) {
+            errorAtCurrent("Expect '}' after a template expression");
+            break;
+        }
+        Node *span = NEW_TEMPLATE_SPAN(&parser.current, express);
         if (tail) {
             appendToNext(&tail, span);
         } else {
@@ -590,21 +647,21 @@ static Node *stringTemplate() {
 }
 
 static Node *string() {
-    return NEW_STRING(parser.previous);
+    return NEW_STRING(&parser.previous);
 }
 
 static Node *number() {
-    return NEW_NUMBER(parser.previous);
+    return NEW_NUMBER(&parser.previous);
 }
 
 static Node *literal() {
-    return NEW_LITERAL(parser.previous);
+    return NEW_LITERAL(&parser.previous);
 }
 
 static Node *parsePrecedence(Precedence precedence) {
     advance();
 
-    PrefixFn prefix = getRule(parser.previous->type)->prefix;
+    PrefixFn prefix = getRule(parser.previous.type)->prefix;
 
     if (prefix == NULL) {
         errorAtPrevious("Expected expression");
@@ -613,9 +670,9 @@ static Node *parsePrecedence(Precedence precedence) {
 
     Node *left = prefix();
 
-    while (precedence <= getRule(parser.current->type)->precedence) {
+    while (precedence <= getRule(parser.current.type)->precedence) {
         advance();
-        InfixFn infix = getRule(parser.previous->type)->infix;
+        InfixFn infix = getRule(parser.previous.type)->infix;
         left = infix(left);
     }
 
@@ -630,14 +687,14 @@ static void advance() {
     parser.previous = parser.current;
     for (;;) {
         parser.current = nextToken();
-        if (parser.current->type != TOKEN_ERROR)
+        if (parser.current.type != TOKEN_ERROR)
             break;
-        errorAtCurrent(parser.current->start);
+        errorAtCurrent(parser.current.start);
     }
 }
 
 static bool check(TokenType type) {
-    return parser.current->type == type;
+    return parser.current.type == type;
 }
 
 static bool match(TokenType type) {
@@ -648,7 +705,7 @@ static bool match(TokenType type) {
 }
 
 static bool consume(TokenType type, const char *message) {
-    if (parser.current->type == type) {
+    if (parser.current.type == type) {
         advance();
         return true;
     }
@@ -657,11 +714,11 @@ static bool consume(TokenType type, const char *message) {
 }
 
 static void errorAtCurrent(const char *msg) {
-    parserError(parser.current, msg);
+    parserError(&parser.current, msg);
 }
 
 static void errorAtPrevious(const char *msg) {
-    parserError(parser.previous, msg);
+    parserError(&parser.previous, msg);
 }
 
 static void parserError(Token *token, const char *msg) {
@@ -675,10 +732,10 @@ static void parserError(Token *token, const char *msg) {
 
 static void synchronize() {
     parser.panicMode = false;
-    while (parser.current->type != TOKEN_EOF) {
-        if (parser.previous->type == TOKEN_NEWLINE)
+    while (parser.current.type != TOKEN_EOF) {
+        if (parser.previous.type == TOKEN_NEWLINE)
             return;
-        switch (parser.current->type) {
+        switch (parser.current.type) {
         case TOKEN_CLASS:
         case TOKEN_FN:
         case TOKEN_VAR:
@@ -5,16 +5,18 @@
 #include "node.h"
 
 typedef struct {
-    Token *previous;
-    Token *current;
+    Token previous;
+    Token current;
     Node *stmts;
     Node *tail;
     bool hadError;
     bool panicMode;
 } Parser;
 
-void initParser(const char *source);
+void initParser(const char *source, int line);
 void terminateParser();
 Node *parse(bool *hadError);
+Node *parseDeclaration(bool *hadError);
+Node *parseFnDeclaration(bool *hadError);
 
 #endif
\ No newline at end of file
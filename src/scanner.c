@@ -2,7 +2,6 @@
 #include <string.h>
 
 #include "common.h"
-#include "memory.h"
 #include "scanner.h"
 
 #define MAX_TEMPLATE_LEVELS 2
@@ -10,48 +9,32 @@
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
 
-#define BEGIN_TEMPLATE_SCANNING (templateLevel++)
-#define END_TEMPLATE_SCANNING (templateLevel--)
-
 typedef struct {
     const char *start;
     const char *current;
-    Token *sentinel;
-    Token *tail;
-    Token *tokenp;
     int line;
+    TokenType lastType;
+    int templateDepth; // The number of "${" whose "}" is yet to come.
 } Scanner;
 
-Scanner scanner;
-
-static int templateLevel = 0;
-static bool hadTemplateScanningError = false;
-
-static Token EMPTY_TOKEN = {
-    .type = TOKEN_EMPTY, .length = 0, .line = 0, .start = NULL, .next = NULL};
+ISOLATE_LOCAL Scanner scanner;
 
-static void freeTokens();
+static Token scanToken();
+static Token skipWhiteSpace();
+static Token blockComment();
 
-static void tokenize();
-static void scanToken();
-static Token *skipWhiteSpace();
-static Token *blockComment();
-
-static void identifier();
+static Token identifier();
 static TokenType identifierType();
 static TokenType checkKeyword();
-static void number();
+static Token number();
 
-static void stringTemplate();
-static bool isScanningTemplateString(bool isTemplateSeen);
-static void scanBeforeTemplate(bool isTempalteSeen);
-static void scanTemplate();
+static Token templateString(TokenType beforeSpan, TokenType end);
+static Token endTemplateSpan();
 
-static void string();
-static Token *emptyToken();
-static Token *errorToken();
-static Token *makeToken(TokenType type);
-static void appendNewToken(Token *token);
+static Token string();
+static Token emptyToken();
+static Token errorToken();
+static Token makeToken(TokenType type);
 
 static inline void setScannerHeadToCurrent();
 static char advance();
@@ -65,167 +48,120 @@ static int currentTokenLen();
 static bool isAlpha(char c);
 static bool isDigit(char c);
 
-void initScanner(const char *source) {
+void initScanner(const char *source, int line) {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
-    scanner.sentinel = emptyToken();
-    scanner.tail = emptyToken();
-    tokenize();
-    scanner.tokenp = scanner.sentinel->next;
-}
-
-void terminateScanner() {
-    freeTokens();
+    scanner.line = line;
+    scanner.lastType = TOKEN_EMPTY;
+    scanner.templateDepth = 0;
 }
 
-Token *nextToken() {
-    if (scanner.tokenp->next == NULL)
-        return scanner.tokenp;
-    Token *current = scanner.tokenp;
-    scanner.tokenp = scanner.tokenp->next;
-    return current;
-}
-
-static void freeTokens() {
-    Token *current = scanner.sentinel->next;
-    while (current) {
-        Token *next = current->next;
-        FREE(Token, current);
-        current = next;
-    }
-}
-
-static void freeNonErrorTokens(Token *oneBeforehead) {
-    Token *prev = oneBeforehead;
-    Token *current = oneBeforehead->next;
-    while (current != NULL) {
-        Token *next = current->next;
-        if (current->type != TOKEN_ERROR) {
-            prev->next = next;
-            FREE(Token, current);
-        } else {
-            prev = current;
+// nextToken scans the token after the last one it returned, and keeps
+// returning TOKEN_EOF once the source is exhausted. Nothing but the scanner
+// position is kept between calls, so a source is never scanned ahead of the
+// parser. A newline right after another is skipped.
+Token nextToken() {
+    for (;;) {
+        Token token = scanToken();
+        if (token.type == TOKEN_NEWLINE && scanner.lastType == TOKEN_NEWLINE) {
+            continue;
         }
-        current = next;
-    }
-    scanner.tail = prev;
-}
-
-static void tokenize() {
-    while (scanner.tail->type != TOKEN_EOF) {
-        scanToken();
+        scanner.lastType = token.type;
+        return token;
     }
 }
 
-void scanToken() {
-    Token *error = skipWhiteSpace();
+static Token scanToken() {
+    Token error = skipWhiteSpace();
     scanner.start = scanner.current;
 
-    if (error->type != TOKEN_EMPTY) {
-        appendNewToken(error);
-        return;
+    if (error.type != TOKEN_EMPTY) {
+        return error;
     }
 
     if (isAtEnd()) {
-        appendNewToken(makeToken(TOKEN_EOF));
-        return;
+        if (scanner.templateDepth > 0) {
+            scanner.templateDepth = 0;
+            return errorToken("Unterminated template string");
+        }
+        return makeToken(TOKEN_EOF);
     }
 
     char c = advance();
     if (isAlpha(c)) {
-        identifier();
-        return;
+        return identifier();
     }
     if (isDigit(c)) {
-        number();
-        return;
+        return number();
     }
 
     switch (c) {
     case '(':
-        appendNewToken(makeToken(TOKEN_LEFT_PAREN));
-        return;
+        return makeToken(TOKEN_LEFT_PAREN);
     case ')':
-        appendNewToken(makeToken(TOKEN_RIGHT_PAREN));
-        return;
+        return makeToken(TOKEN_RIGHT_PAREN);
     case '{':
-        appendNewToken(makeToken(TOKEN_LEFT_BRACE));
-        return;
+        return makeToken(TOKEN_LEFT_BRACE);
     case '}':
-        appendNewToken(makeToken(TOKEN_RIGHT_BRACE));
-        return;
-    case '\n':
-        if (scanner.tail->type != TOKEN_NEWLINE) {
-            appendNewToken(makeToken(TOKEN_NEWLINE));
+        if (scanner.templateDepth > 0) {
+            return endTemplateSpan();
         }
+        return makeToken(TOKEN_RIGHT_BRACE);
+    case '\n': {
+        Token token = makeToken(TOKEN_NEWLINE);
         scanner.line++;
-        return;
+        return token;
+    }
     case ',':
-        appendNewToken(makeToken(TOKEN_COMMA));
-        return;
+        return makeToken(TOKEN_COMMA);
     case '.':
-        appendNewToken(makeToken(TOKEN_DOT));
-        return;
+        return makeToken(TOKEN_DOT);
     case '-':
-        appendNewToken(makeToken(TOKEN_MINUS));
-        return;
+        return makeToken(TOKEN_MINUS);
     case '+':
-        appendNewToken(makeToken(TOKEN_PLUS));
-        return;
+        return makeToken(TOKEN_PLUS);
     case '*':
-        appendNewToken(makeToken(TOKEN_STAR));
-        return;
+        return makeToken(TOKEN_STAR);
     case '/':
-        appendNewToken(makeToken(TOKEN_SLASH));
-        return;
+        return makeToken(TOKEN_SLASH);
+    case '%':
+        return makeToken(TOKEN_PERCENT);
+    case '^':
+        return makeToken(TOKEN_CARET);
     case '?':
-        appendNewToken(makeToken(TOKEN_QUESTION));
-        return;
+        return makeToken(TOKEN_QUESTION);
     case ':':
-        appendNewToken(makeToken(TOKEN_COLON));
-        return;
+        return makeToken(TOKEN_COLON);
     case ';':
-        appendNewToken(makeToken(TOKEN_SEMICOLON));
-        return;
+        return makeToken(TOKEN_SEMICOLON);
     case '!':
-        appendNewToken(makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG));
-        return;
+        return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-        appendNewToken(makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL));
-        return;
+        return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-        appendNewToken(makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS));
-        return;
+        if (match('<')) {
+            return makeToken(TOKEN_LESS_LESS);
+        }
+        return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
-        appendNewToken(
-            makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER));
-        return;
-    case '&':
-        if (match('&')) {
-            appendNewToken(makeToken(TOKEN_AND));
-            return;
+        if (match('>')) {
+            return makeToken(TOKEN_GREATER_GREATER);
         }
-        break;
+        return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+    case '&':
+        return makeToken(match('&') ? TOKEN_AND : TOKEN_AMPERSAND);
     case '|':
-        if (match('|')) {
-            appendNewToken(makeToken(TOKEN_OR));
-            return;
-        }
-        break;
+        return makeToken(match('|') ? TOKEN_OR : TOKEN_PIPE);
     case '"':
-        string();
-        return;
+        return string();
     case '`':
-        stringTemplate();
-        return;
+        return templateString(TOKEN_PRE_TEMPLATE, TOKEN_STRING);
     }
-    appendNewToken(errorToken("Unexpected character"));
-    return;
+    return errorToken("Unexpected character");
 }
 
-static Token *skipWhiteSpace() {
-    Token *res = emptyToken();
+static Token skipWhiteSpace() {
+    Token res = emptyToken();
     for (;;) {
         char c = peek();
         switch (c) {
@@ -255,7 +191,7 @@ static Token *skipWhiteSpace() {
     }
 }
 
-static Token *blockComment() {
+static Token blockComment() {
     int block = 1;
     while (!isAtEnd()) {
         char c = advance();
@@ -276,10 +212,10 @@ static Token *blockComment() {
     return emptyToken();
 }
 
-static void identifier() {
+static Token identifier() {
     while (isAlpha(peek()) || isDigit(peek()))
         advance();
-    appendNewToken(makeToken(identifierType()));
+    return makeToken(identifierType());
 }
 
 static TokenType identifierType() {
@@ -343,6 +279,8 @@ static TokenType identifierType() {
         return checkKeyword(1, 2, "ar", TOKEN_VAR);
     case 'w':
         return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+    case 'y':
+        return checkKeyword(1, 4, "ield", TOKEN_YIELD);
     }
     return TOKEN_IDENTIFIER;
 }
@@ -356,85 +294,49 @@ static TokenType checkKeyword(int start, int length, const char *rest,
     return TOKEN_IDENTIFIER;
 }
 
-// stringTemplate appends a series of Tokens with the given input
-// `xxxxxxxxx` A string with no template will append only one token
-// TOKEN_STRING A template string, `head ${false} mid ${true} end` is
-// scanned as follows
-// "`head" TOKEN_PRE_TEMPLATE
-// false   TOKEN_FALSE
-// " mid " TOKNE_MID_TEMPLATE
-// true    TOKEN_TRUE
-// " end`" TOKEN_AFTER_TEMPLATE
-
-static void stringTemplate() {
-    Token *beforeScan = scanner.tail;
-    bool isTemplateSeen = false;
+// templateString scans the string part of a template string that starts at
+// a '`' or at the '}' that ends a span, up to the next "${" or the closing
+// '`'. `head ${false} mid ${true} end` is scanned as follows
+// "`head " TOKEN_PRE_TEMPLATE
+// false    TOKEN_FALSE
+// " mid "  TOKEN_TWEEN_TEMPLATE
+// true     TOKEN_TRUE
+// " end`"  TOKEN_AFTER_TEMPLATE
+// and a template string with no span as a single TOKEN_STRING.
+static Token templateString(TokenType beforeSpan, TokenType end) {
     while (peek() != '`' && !isAtEnd()) {
-        if (peek() == '\n') {
-            scanner.line++;
-        }
-
         if (peek() == '$' && peekNext() == '{') {
-            BEGIN_TEMPLATE_SCANNING;
-            if (templateLevel > MAX_TEMPLATE_LEVELS) {
-                appendNewToken(errorToken("Template string may only go " STR(
-                    MAX_TEMPLATE_LEVELS) " levels deep"));
-                hadTemplateScanningError = true;
+            Token token = makeToken(beforeSpan);
+            advanceN(2);
+            if (++scanner.templateDepth > MAX_TEMPLATE_LEVELS) {
+                return errorToken("Template string may only go " STR(
+                    MAX_TEMPLATE_LEVELS) " levels deep");
             }
-            scanBeforeTemplate(isTemplateSeen);
-            scanTemplate();
-            isTemplateSeen = true;
-            END_TEMPLATE_SCANNING;
-            continue;
+            return token;
+        }
+        if (peek() == '\n') {
+            scanner.line++;
         }
         advance();
     }
 
     if (isAtEnd()) {
-        if (isScanningTemplateString(isTemplateSeen)) {
-            hadTemplateScanningError = true;
-        }
-        appendNewToken(errorToken("Unterminated template string"));
+        scanner.templateDepth = 0;
+        return errorToken("Unterminated template string");
     }
-
-    if (templateLevel == 0 && hadTemplateScanningError) {
-        freeNonErrorTokens(beforeScan);
-        hadTemplateScanningError = false;
-        match('`');
-        return;
-    }
-
-    match('`');
-
-    TokenType endTemplateType =
-        isTemplateSeen ? TOKEN_AFTER_TEMPLATE : TOKEN_STRING;
-    appendNewToken(makeToken(endTemplateType));
-}
-
-static void scanBeforeTemplate(bool isTemplateSeen) {
-    TokenType nonTemplateType =
-        isTemplateSeen ? TOKEN_TWEEN_TEMPLATE : TOKEN_PRE_TEMPLATE;
-    appendNewToken(makeToken(nonTemplateType));
-    advanceN(2);
-    setScannerHeadToCurrent();
+    advance();
+    return makeToken(end);
 }
 
-static void scanTemplate(bool *hadError) {
-    while (peek() != '}' && !isAtEnd()) {
-        scanToken();
-        if (scanner.tail->type == TOKEN_ERROR) {
-            hadTemplateScanningError = true;
-        }
-    }
-    match('}');
+// endTemplateSpan resumes the string part of a template string after the
+// '}' of a span.
+static Token endTemplateSpan() {
+    scanner.templateDepth--;
     setScannerHeadToCurrent();
+    return templateString(TOKEN_TWEEN_TEMPLATE, TOKEN_AFTER_TEMPLATE);
 }
 
-static bool isScanningTemplateString(bool isTemplateSeen) {
-    return templateLevel > 0 || isTemplateSeen;
-}
-
-static void string() {
+static Token string() {
     bool containNewLine = false;
     while (peek() != '"' && !isAtEnd()) {
         if (peek() == '\n') {
@@ -445,19 +347,17 @@ static void string() {
     }
 
     if (isAtEnd()) {
-        appendNewToken(errorToken("Unterminated string literal"));
-        return;
+        return errorToken("Unterminated string literal");
     }
     if (containNewLine) {
-        appendNewToken(errorToken("Newline character '\\n' in string"));
-        return;
+        return errorToken("Newline character '\\n' in string");
     }
 
     advance();
-    appendNewToken(makeToken(TOKEN_STRING));
+    return makeToken(TOKEN_STRING);
 }
 
-static void number() {
+static Token number() {
     while (isDigit(peek())) {
         advance();
     }
@@ -470,35 +370,27 @@ static void number() {
         }
     }
 
-    appendNewToken(makeToken(TOKEN_NUMBER));
+    return makeToken(TOKEN_NUMBER);
 }
 
-static Token *errorToken(const char *msg) {
-    Token *token = ALLOCATE(Token, 1);
-    token->type = TOKEN_ERROR;
-    token->start = msg;
-    token->length = strlen(msg);
-    token->line = scanner.line;
-    token->next = NULL;
+static Token errorToken(const char *msg) {
+    Token token = {.type = TOKEN_ERROR,
+                   .start = msg,
+                   .length = (int)strlen(msg),
+                   .line = scanner.line};
     return token;
 }
 
-static Token *emptyToken() {
-    return &EMPTY_TOKEN;
-}
-
-static void appendNewToken(Token *token) {
-    scanner.tail->next = token;
-    scanner.tail = token;
+static Token emptyToken() {
+    Token token = {.type = TOKEN_EMPTY, .start = NULL, .length = 0, .line = 0};
+    return token;
 }
 
-static Token *makeToken(TokenType type) {
-    Token *token = ALLOCATE(Token, 1);
-    token->type = type;
-    token->start = scanner.start;
-    token->length = (int)(scanner.current - scanner.start);
-    token->line = scanner.line;
-    token->next = NULL;
+static Token makeToken(TokenType type) {
+    Token token = {.type = type,
+                   .start = scanner.start,
+                   .length = (int)(scanner.current - scanner.start),
+                   .line = scanner.line};
     return token;
 }
 
@@ -506,7 +398,6 @@ Token syntheticToken(const char *str, int length) {
     Token token = {.type = TOKEN_EMPTY,
                    .length = length,
                    .start = str,
-                   .next = NULL,
                    .line = -1};
     return token;
 }
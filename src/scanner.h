@@ -14,6 +14,8 @@ typedef enum {
     TOKEN_PLUS,
     TOKEN_SLASH,
     TOKEN_STAR,
+    TOKEN_PERCENT,
+    TOKEN_CARET,
     TOKEN_QUESTION,
     TOKEN_COLON,
     TOKEN_SEMICOLON,
@@ -26,6 +28,10 @@ typedef enum {
     TOKEN_GREATER_EQUAL,
     TOKEN_LESS,
     TOKEN_LESS_EQUAL,
+    TOKEN_LESS_LESS,
+    TOKEN_GREATER_GREATER,
+    TOKEN_AMPERSAND,
+    TOKEN_PIPE,
     TOKEN_AND,
     TOKEN_OR,
     // Literals
@@ -52,23 +58,22 @@ typedef enum {
     TOKEN_SUPER,
     TOKEN_FN,
     TOKEN_RETURN,
+    TOKEN_YIELD,
     // Special Tokens
     TOKEN_EMPTY,
     TOKEN_ERROR,
     TOKEN_EOF,
 } TokenType;
 
-typedef struct Token {
+typedef struct {
     TokenType type;
     const char *start;
     int length;
     int line;
-    struct Token *next;
 } Token;
 
-void initScanner(const char *source);
-void terminateScanner();
-Token *nextToken();
+void initScanner(const char *source, int line);
+Token nextToken();
 Token syntheticToken(const char *str, int length);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,809 @@
+#include "trace.h"
+#include "chunk.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include "x64.h"
+#include <stdint.h>
+
+#ifndef DOJO_JIT
+
+bool recordTrace(CallFrame *frame, Cell *loop, Cell **resume) {
+    *resume = loop[1].target;
+    return false;
+}
+
+Cell *runTrace(Trace *trace, CallFrame *frame) {
+    return NULL;
+}
+
+void freeTraces(Trace *trace) {
+}
+
+#else
+
+// A trace is entered with the frame's slots and returns the cell the
+// interpreter resumes at, with vm.stackTop already moved to match.
+typedef Cell *(*TraceEntry)(Value *slots);
+
+// Slot i of the frame, whether a local or a value on the operand stack,
+// lives in xmm i for the whole trace. Two more registers are scratch.
+#define MAX_TRACE_SLOTS 14
+#define SCRATCH 14
+#define SCRATCH_CONSTANT 15
+// A path this long most likely unrolls an inner loop, which is better off
+// with its own trace.
+#define MAX_TRACE_STEPS 512
+
+#define SLOTS RDI
+
+typedef enum {
+    TYPE_NONE,
+    TYPE_NUMBER,
+    TYPE_BOOL,
+} Type;
+
+// A Step is one instruction on the recorded path. isTaken is the direction
+// a conditional jump went, and type is what a falsey test looked at.
+typedef struct {
+    int offset;
+    bool isTaken;
+    Type type;
+} Step;
+
+// An Exit is a guard's jump to the code that hands the frame back.
+typedef struct {
+    int at;
+    int height;
+    Cell *resume;
+} Exit;
+
+typedef struct {
+    ObjFn *fn;
+    Value *slots;
+    Value *stackTop;
+    int base; // Stack height at the loop header.
+    int header;
+    int end; // Offset of the back-edge being traced.
+    int count;
+    int capacity;
+    Step *steps;
+    // The type every local read before it is written had on entry. These
+    // are what the trace guards.
+    Type entryTypes[MAX_TRACE_SLOTS];
+    bool isUsed[MAX_TRACE_SLOTS];
+    bool isWritten[MAX_TRACE_SLOTS];
+} Recorder;
+
+typedef struct {
+    Assembler as;
+    int exitCount;
+    int exitCapacity;
+    Exit *exits;
+} TraceCompiler;
+
+static ISOLATE_LOCAL Recorder recorder;
+static ISOLATE_LOCAL TraceCompiler compiler;
+
+/* -------------------------------- RECORDER -------------------------------- */
+
+static bool recordStep(int *offset);
+static bool recordJump(Step *step, bool isTaken, int *offset);
+static bool recordCompareJump(Opcode op, Value a, Value b, int count,
+                              int *offset);
+static bool recordArithmetic(Opcode op, Value *dst, Value a, Value b);
+static bool compareNumbers(Opcode op, double a, double b);
+static bool readSlot(int slot, Value *value);
+static bool canWriteSlot(int slot);
+static bool canPush(int count);
+static bool isTypeStable();
+static Type typeOf(Value value);
+static bool isFalsey(Value value);
+static Step *addStep(int offset);
+
+/* -------------------------------- COMPILER -------------------------------- */
+
+static Trace *compileTrace(Cell *header);
+static void compileStep(Step *step, int *height);
+static int emitEntryGuards(int *guards);
+static void emitExits();
+static void emitConstant(int xmm, Value value);
+static void emitArithmetic(Opcode op, int dst, int a, int b);
+static SseOp sseOpOf(Opcode op);
+static Condition emitCompare(Opcode op, int a, int b);
+static Condition emitEquality(int a, int b);
+static Condition emitFalseyTest(int xmm, Type type);
+static void emitBool(Condition cc, int xmm);
+static void emitGuard(Step *step, Condition isTaken, int height);
+static Cell *cellAt(int offset);
+
+bool recordTrace(CallFrame *frame, Cell *loop, Cell **resume) {
+    ObjFn *fn = frame->closure->fn;
+    ThreadedCode *threaded = &fn->threaded;
+    Cell *header = loop[1].target;
+    *resume = header;
+    if (!isJitEnabled()) {
+        return false;
+    }
+
+    recorder.fn = fn;
+    recorder.slots = frame->slots;
+    recorder.stackTop = vm.stackTop;
+    recorder.base = (int)(vm.stackTop - frame->slots);
+    recorder.header = threaded->offsets[header - threaded->cells];
+    recorder.end = threaded->offsets[loop - threaded->cells];
+    recorder.count = 0;
+    recorder.capacity = 0;
+    recorder.steps = NULL;
+    for (int i = 0; i < MAX_TRACE_SLOTS; i++) {
+        recorder.entryTypes[i] = TYPE_NONE;
+        recorder.isUsed[i] = false;
+        recorder.isWritten[i] = false;
+    }
+
+    // The recorder runs one iteration itself, so whatever it stops at is
+    // where the interpreter picks up.
+    int offset = recorder.header;
+    bool isComplete = false;
+    while (!isComplete && offset <= recorder.end &&
+           recorder.base <= MAX_TRACE_SLOTS &&
+           recorder.count < MAX_TRACE_STEPS && recordStep(&offset)) {
+        isComplete = offset == recorder.header;
+    }
+    vm.stackTop = recorder.stackTop;
+    *resume = cellAtOffset(threaded, offset);
+
+    Trace *trace = NULL;
+    if (isComplete && isTypeStable()) {
+        trace = compileTrace(header);
+    } else if (offset > recorder.end && --loop[2].counter.attempts > 0) {
+        loop[2].counter.countdown = 1;
+    }
+    FREE(Step, recorder.steps);
+    if (trace == NULL) {
+        return false;
+    }
+    trace->next = fn->traces;
+    fn->traces = trace;
+    loop[2].trace = trace;
+    return true;
+}
+
+// runTrace makes the ints of the frame doubles first, as traces keep every
+// number in an xmm register and guard on doubles.
+Cell *runTrace(Trace *trace, CallFrame *frame) {
+    for (Value *slot = frame->slots; slot < vm.stackTop; slot++) {
+        *slot = toDoubleVal(*slot);
+    }
+    TraceEntry entry = (TraceEntry)trace->entry;
+    return entry(frame->slots);
+}
+
+void freeTraces(Trace *trace) {
+    while (trace != NULL) {
+        Trace *next = trace->next;
+        freeMachineCode(trace->entry, trace->size);
+        FREE(Trace, trace);
+        trace = next;
+    }
+}
+
+// recordStep executes the instruction at offset and moves offset past it.
+// An instruction the trace cannot express is left for the interpreter.
+static bool recordStep(int *offset) {
+    Chunk *chunk = &recorder.fn->chunk;
+    uint8_t *bytes = &chunk->codes[*offset];
+    Value *top = recorder.stackTop;
+    int next = *offset + instructionLength(chunk, *offset);
+    Value a, b;
+
+    switch (bytes[0]) {
+    case OP_CONSTANT:
+        a = getConstantAtIndex(chunk, bytes[1]);
+        if (!IS_NUMBER(a) || !canPush(1)) {
+            return false;
+        }
+        *recorder.stackTop++ = a;
+        break;
+    case OP_TRUE:
+    case OP_FALSE:
+        if (!canPush(1)) {
+            return false;
+        }
+        *recorder.stackTop++ = BOOL_VAL(bytes[0] == OP_TRUE);
+        break;
+    case OP_GET_LOCAL:
+        if (!readSlot(bytes[1], &a) || !canPush(1)) {
+            return false;
+        }
+        *recorder.stackTop++ = a;
+        break;
+    case OP_SET_LOCAL:
+        if (!canWriteSlot(bytes[1])) {
+            return false;
+        }
+        recorder.slots[bytes[1]] = top[-1];
+        break;
+    case OP_POP:
+        recorder.stackTop--;
+        break;
+    case OP_POPN:
+        recorder.stackTop -= bytes[1];
+        break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+        if (!recordArithmetic(bytes[0], &top[-2], top[-2], top[-1])) {
+            return false;
+        }
+        recorder.stackTop--;
+        break;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+        top[-2] = BOOL_VAL(valuesEqual(top[-2], top[-1]) ==
+                           (bytes[0] == OP_EQUAL));
+        recorder.stackTop--;
+        break;
+    case OP_NOT:
+        addStep(*offset)->type = typeOf(top[-1]);
+        top[-1] = BOOL_VAL(isFalsey(top[-1]));
+        *offset = next;
+        return true;
+    case OP_NEGATE:
+        if (!IS_NUMBER(top[-1])) {
+            return false;
+        }
+        top[-1] = NUMBER_VAL(-AS_NUMBER(top[-1]));
+        break;
+    case OP_JUMP:
+    case OP_LOOP:
+        next = jumpTarget(chunk, *offset);
+        break;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE: {
+        Step *step = addStep(*offset);
+        step->type = typeOf(top[-1]);
+        bool isTaken = isFalsey(top[-1]) == (bytes[0] == OP_JUMP_IF_FALSE);
+        return recordJump(step, isTaken, offset);
+    }
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL: {
+        Opcode op = bytes[0] - OP_JUMP_IF_NOT_LESS + OP_LESS;
+        return recordCompareJump(op, top[-2], top[-1], 2, offset);
+    }
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL: {
+        bool isEqual = valuesEqual(top[-2], top[-1]);
+        recorder.stackTop -= 2;
+        return recordJump(addStep(*offset),
+                          isEqual == (bytes[0] == OP_JUMP_IF_EQUAL), offset);
+    }
+    case OP_ADD_LOCALS:
+    case OP_SUBTRACT_LOCALS:
+    case OP_MULTIPLY_LOCALS:
+    case OP_DIVIDE_LOCALS:
+        if (!readSlot(bytes[1], &a) || !readSlot(bytes[2], &b) ||
+            !canPush(1) ||
+            !recordArithmetic(bytes[0] - OP_ADD_LOCALS + OP_ADD, top, a, b)) {
+            return false;
+        }
+        recorder.stackTop++;
+        break;
+    case OP_MOVE:
+        if (!readSlot(bytes[2], &a) || !canWriteSlot(bytes[1])) {
+            return false;
+        }
+        recorder.slots[bytes[1]] = a;
+        break;
+    case OP_LOAD_CONSTANT:
+        a = getConstantAtIndex(chunk, bytes[2]);
+        if (!IS_NUMBER(a) || !canWriteSlot(bytes[1])) {
+            return false;
+        }
+        recorder.slots[bytes[1]] = a;
+        break;
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+        if (!readSlot(bytes[2], &a) || !readSlot(bytes[3], &b) ||
+            !canWriteSlot(bytes[1]) ||
+            !recordArithmetic(bytes[0] - OP_ADD_RR + OP_ADD,
+                              &recorder.slots[bytes[1]], a, b)) {
+            return false;
+        }
+        break;
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+        b = getConstantAtIndex(chunk, bytes[3]);
+        if (!readSlot(bytes[2], &a) || !canWriteSlot(bytes[1]) ||
+            !recordArithmetic(bytes[0] - OP_ADD_RK + OP_ADD,
+                              &recorder.slots[bytes[1]], a, b)) {
+            return false;
+        }
+        break;
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RR:
+    case OP_JUMP_IF_NOT_GREATER_RR:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RR: {
+        Opcode op = bytes[0] - OP_JUMP_IF_NOT_LESS_RR + OP_LESS;
+        if (!readSlot(bytes[1], &a) || !readSlot(bytes[2], &b)) {
+            return false;
+        }
+        return recordCompareJump(op, a, b, 0, offset);
+    }
+    case OP_JUMP_IF_NOT_LESS_RK:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RK:
+    case OP_JUMP_IF_NOT_GREATER_RK:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RK: {
+        Opcode op = bytes[0] - OP_JUMP_IF_NOT_LESS_RK + OP_LESS;
+        if (!readSlot(bytes[1], &a)) {
+            return false;
+        }
+        b = getConstantAtIndex(chunk, bytes[2]);
+        return recordCompareJump(op, a, b, 0, offset);
+    }
+    default:
+        return false;
+    }
+    addStep(*offset);
+    *offset = next;
+    return true;
+}
+
+static bool recordJump(Step *step, bool isTaken, int *offset) {
+    Chunk *chunk = &recorder.fn->chunk;
+    step->isTaken = isTaken;
+    *offset = isTaken ? jumpTarget(chunk, *offset)
+                      : *offset + instructionLength(chunk, *offset);
+    return true;
+}
+
+// recordCompareJump records a jump taken unless a op b, which pops count
+// values off the stack.
+static bool recordCompareJump(Opcode op, Value a, Value b, int count,
+                              int *offset) {
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        return false;
+    }
+    recorder.stackTop -= count;
+    bool isTaken = !compareNumbers(op, AS_NUMBER(a), AS_NUMBER(b));
+    return recordJump(addStep(*offset), isTaken, offset);
+}
+
+// recordArithmetic stores a op b in dst, for the arithmetic and comparison
+// opcodes.
+static bool recordArithmetic(Opcode op, Value *dst, Value a, Value b) {
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        return false;
+    }
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+    case OP_ADD:
+        *dst = NUMBER_VAL(x + y);
+        return true;
+    case OP_SUBTRACT:
+        *dst = NUMBER_VAL(x - y);
+        return true;
+    case OP_MULTIPLY:
+        *dst = NUMBER_VAL(x * y);
+        return true;
+    case OP_DIVIDE:
+        *dst = NUMBER_VAL(x / y);
+        return true;
+    default:
+        *dst = BOOL_VAL(compareNumbers(op, x, y));
+        return true;
+    }
+}
+
+static bool compareNumbers(Opcode op, double a, double b) {
+    switch (op) {
+    case OP_LESS:
+        return a < b;
+    case OP_LESS_EQUAL:
+        return a <= b;
+    case OP_GREATER:
+        return a > b;
+    default:
+        return a >= b;
+    }
+}
+
+// readSlot reads a slot the trace keeps in a register. A local read before
+// the trace writes it decides a type the trace then guards on entry.
+static bool readSlot(int slot, Value *value) {
+    if (slot >= MAX_TRACE_SLOTS) {
+        return false;
+    }
+    *value = recorder.slots[slot];
+    Type type = typeOf(*value);
+    if (type == TYPE_NONE) {
+        return false;
+    }
+    if (slot < recorder.base) {
+        recorder.isUsed[slot] = true;
+        if (!recorder.isWritten[slot]) {
+            recorder.entryTypes[slot] = type;
+        }
+    }
+    return true;
+}
+
+static bool canWriteSlot(int slot) {
+    if (slot >= MAX_TRACE_SLOTS) {
+        return false;
+    }
+    if (slot < recorder.base) {
+        recorder.isUsed[slot] = true;
+        recorder.isWritten[slot] = true;
+    }
+    return true;
+}
+
+static bool canPush(int count) {
+    return recorder.stackTop - recorder.slots + count <= MAX_TRACE_SLOTS;
+}
+
+// isTypeStable checks that the next iteration starts with the types this
+// one was recorded with.
+static bool isTypeStable() {
+    for (int slot = 0; slot < recorder.base; slot++) {
+        Type type = recorder.entryTypes[slot];
+        if (type != TYPE_NONE && typeOf(recorder.slots[slot]) != type) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static Type typeOf(Value value) {
+    if (IS_NUMBER(value)) {
+        return TYPE_NUMBER;
+    }
+    return IS_BOOL(value) ? TYPE_BOOL : TYPE_NONE;
+}
+
+static bool isFalsey(Value value) {
+    return IS_NUMBER(value) ? !AS_NUMBER(value) : value == FALSE_VAL;
+}
+
+static Step *addStep(int offset) {
+    if (IS_EXCEEDING_CAPACITY(recorder.count, recorder.capacity)) {
+        int oldCapacity = recorder.capacity;
+        recorder.capacity = GROW_CAPACITY(oldCapacity);
+        recorder.steps =
+            reallocate(recorder.steps, sizeof(Step) * oldCapacity,
+                       sizeof(Step) * recorder.capacity);
+    }
+    Step *step = &recorder.steps[recorder.count++];
+    *step = (Step){offset, false, TYPE_NONE};
+    return step;
+}
+
+// compileTrace turns the recorded path into a loop over registers. Entry
+// guards check the types the path was recorded with, and every branch the
+// path depends on becomes a guard that leaves the loop.
+static Trace *compileTrace(Cell *header) {
+    initAssembler(&compiler.as);
+    x64Use(&compiler.as);
+    compiler.exitCount = 0;
+    compiler.exitCapacity = 0;
+    compiler.exits = NULL;
+
+    int guards[MAX_TRACE_SLOTS];
+    int guardCount = emitEntryGuards(guards);
+    for (int slot = 0; slot < recorder.base; slot++) {
+        if (recorder.isUsed[slot]) {
+            x64LoadXmm(slot, SLOTS, slot * (int)sizeof(Value));
+        }
+    }
+
+    int loopStart = x64Offset();
+    int height = recorder.base;
+    for (int i = 0; i < recorder.count; i++) {
+        compileStep(&recorder.steps[i], &height);
+    }
+    x64PatchJump(x64Jump(), loopStart);
+    emitExits();
+
+    // The entry guards give the loop back untouched.
+    for (int i = 0; i < guardCount; i++) {
+        x64PatchJump(guards[i], x64Offset());
+    }
+    x64MovImm(RAX, (uintptr_t)header);
+    x64Ret();
+
+    Trace *trace = NULL;
+    void *entry = finishAssembler(&compiler.as);
+    if (entry != NULL) {
+        trace = ALLOCATE(Trace, 1);
+        trace->next = NULL;
+        trace->size = compiler.as.count;
+        trace->entry = entry;
+    }
+    freeAssembler(&compiler.as);
+    FREE(Exit, compiler.exits);
+    return trace;
+}
+
+static void compileStep(Step *step, int *height) {
+    Chunk *chunk = &recorder.fn->chunk;
+    uint8_t *bytes = &chunk->codes[step->offset];
+    int h = *height;
+
+    switch (bytes[0]) {
+    case OP_CONSTANT:
+        emitConstant(h, getConstantAtIndex(chunk, bytes[1]));
+        *height = h + 1;
+        break;
+    case OP_TRUE:
+    case OP_FALSE:
+        emitConstant(h, BOOL_VAL(bytes[0] == OP_TRUE));
+        *height = h + 1;
+        break;
+    case OP_GET_LOCAL:
+        x64Movaps(h, bytes[1]);
+        *height = h + 1;
+        break;
+    case OP_SET_LOCAL:
+        x64Movaps(bytes[1], h - 1);
+        break;
+    case OP_POP:
+        *height = h - 1;
+        break;
+    case OP_POPN:
+        *height = h - bytes[1];
+        break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        x64ScalarDouble(sseOpOf(bytes[0]), h - 2, h - 1);
+        *height = h - 1;
+        break;
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+        emitBool(emitCompare(bytes[0], h - 2, h - 1), h - 2);
+        *height = h - 1;
+        break;
+    case OP_EQUAL:
+        emitBool(emitEquality(h - 2, h - 1), h - 2);
+        *height = h - 1;
+        break;
+    case OP_NOT_EQUAL:
+        emitBool(emitEquality(h - 2, h - 1) ^ 1, h - 2);
+        *height = h - 1;
+        break;
+    case OP_NOT:
+        emitBool(emitFalseyTest(h - 1, step->type), h - 1);
+        break;
+    case OP_NEGATE:
+        x64MovqFromXmm(RAX, h - 1);
+        x64MovImm(RCX, SIGN_BIT);
+        x64Alu(ALU_XOR, RAX, RCX);
+        x64MovqToXmm(h - 1, RAX);
+        break;
+    case OP_JUMP:
+    case OP_LOOP:
+        // The path is straight, and its end jumps back to the header.
+        break;
+    case OP_JUMP_IF_FALSE:
+        emitGuard(step, emitFalseyTest(h - 1, step->type), h);
+        break;
+    case OP_JUMP_IF_TRUE:
+        emitGuard(step, emitFalseyTest(h - 1, step->type) ^ 1, h);
+        break;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL: {
+        Opcode op = bytes[0] - OP_JUMP_IF_NOT_LESS + OP_LESS;
+        emitGuard(step, emitCompare(op, h - 2, h - 1) ^ 1, h - 2);
+        *height = h - 2;
+        break;
+    }
+    case OP_JUMP_IF_NOT_EQUAL:
+        emitGuard(step, emitEquality(h - 2, h - 1) ^ 1, h - 2);
+        *height = h - 2;
+        break;
+    case OP_JUMP_IF_EQUAL:
+        emitGuard(step, emitEquality(h - 2, h - 1), h - 2);
+        *height = h - 2;
+        break;
+    case OP_ADD_LOCALS:
+    case OP_SUBTRACT_LOCALS:
+    case OP_MULTIPLY_LOCALS:
+    case OP_DIVIDE_LOCALS:
+        emitArithmetic(bytes[0] - OP_ADD_LOCALS + OP_ADD, h, bytes[1],
+                       bytes[2]);
+        *height = h + 1;
+        break;
+    case OP_MOVE:
+        x64Movaps(bytes[1], bytes[2]);
+        break;
+    case OP_LOAD_CONSTANT:
+        emitConstant(bytes[1], getConstantAtIndex(chunk, bytes[2]));
+        break;
+    case OP_ADD_RR:
+    case OP_SUBTRACT_RR:
+    case OP_MULTIPLY_RR:
+    case OP_DIVIDE_RR:
+        emitArithmetic(bytes[0] - OP_ADD_RR + OP_ADD, bytes[1], bytes[2],
+                       bytes[3]);
+        break;
+    case OP_ADD_RK:
+    case OP_SUBTRACT_RK:
+    case OP_MULTIPLY_RK:
+    case OP_DIVIDE_RK:
+        emitConstant(SCRATCH_CONSTANT, getConstantAtIndex(chunk, bytes[3]));
+        emitArithmetic(bytes[0] - OP_ADD_RK + OP_ADD, bytes[1], bytes[2],
+                       SCRATCH_CONSTANT);
+        break;
+    case OP_JUMP_IF_NOT_LESS_RR:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RR:
+    case OP_JUMP_IF_NOT_GREATER_RR:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RR: {
+        Opcode op = bytes[0] - OP_JUMP_IF_NOT_LESS_RR + OP_LESS;
+        emitGuard(step, emitCompare(op, bytes[1], bytes[2]) ^ 1, h);
+        break;
+    }
+    case OP_JUMP_IF_NOT_LESS_RK:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_RK:
+    case OP_JUMP_IF_NOT_GREATER_RK:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_RK: {
+        Opcode op = bytes[0] - OP_JUMP_IF_NOT_LESS_RK + OP_LESS;
+        emitConstant(SCRATCH_CONSTANT, getConstantAtIndex(chunk, bytes[2]));
+        emitGuard(step, emitCompare(op, bytes[1], SCRATCH_CONSTANT) ^ 1, h);
+        break;
+    }
+    }
+}
+
+// emitEntryGuards checks the type of every local the trace reads before
+// writing it. It returns how many guards it left in guards to be patched.
+static int emitEntryGuards(int *guards) {
+    int count = 0;
+    for (int slot = 0; slot < recorder.base; slot++) {
+        Type type = recorder.entryTypes[slot];
+        if (type == TYPE_NONE) {
+            continue;
+        }
+        x64Load(RAX, SLOTS, slot * (int)sizeof(Value));
+        if (type == TYPE_NUMBER) {
+            x64MovImm(RCX, QNAN);
+            x64Alu(ALU_AND, RAX, RCX);
+            x64Alu(ALU_CMP, RAX, RCX);
+            guards[count++] = x64JumpIf(CC_E);
+        } else {
+            x64AluImm(ALU_OR, RAX, 1);
+            x64MovImm(RCX, FALSE_VAL);
+            x64Alu(ALU_CMP, RAX, RCX);
+            guards[count++] = x64JumpIf(CC_NE);
+        }
+    }
+    return count;
+}
+
+// emitExits writes the registers of every exit back to the frame, for the
+// interpreter to carry on with.
+static void emitExits() {
+    for (int i = 0; i < compiler.exitCount; i++) {
+        Exit *exit = &compiler.exits[i];
+        x64PatchJump(exit->at, x64Offset());
+        for (int slot = 0; slot < exit->height; slot++) {
+            if (slot >= recorder.base || recorder.isUsed[slot]) {
+                x64StoreXmm(SLOTS, slot * (int)sizeof(Value), slot);
+            }
+        }
+        x64Lea(RAX, SLOTS, exit->height * (int)sizeof(Value));
+        x64MovImm(RCX, (uintptr_t)&vm.stackTop);
+        x64Store(RCX, 0, RAX);
+        x64MovImm(RAX, (uintptr_t)exit->resume);
+        x64Ret();
+    }
+}
+
+static void emitConstant(int xmm, Value value) {
+    x64MovImm(RAX, toDoubleVal(value));
+    x64MovqToXmm(xmm, RAX);
+}
+
+// emitArithmetic goes through a scratch register, as dst may be b.
+static void emitArithmetic(Opcode op, int dst, int a, int b) {
+    x64Movaps(SCRATCH, a);
+    x64ScalarDouble(sseOpOf(op), SCRATCH, b);
+    x64Movaps(dst, SCRATCH);
+}
+
+static SseOp sseOpOf(Opcode op) {
+    static const SseOp sseOps[] = {SSE_ADD, SSE_SUB, SSE_MUL, SSE_DIV};
+    return sseOps[op - OP_ADD];
+}
+
+// emitCompare returns the condition that holds when a op b. comisd fails
+// CC_A and CC_AE on NaN, like the comparisons in C.
+static Condition emitCompare(Opcode op, int a, int b) {
+    switch (op) {
+    case OP_LESS:
+        x64Comisd(b, a);
+        return CC_A;
+    case OP_LESS_EQUAL:
+        x64Comisd(b, a);
+        return CC_AE;
+    case OP_GREATER:
+        x64Comisd(a, b);
+        return CC_A;
+    default:
+        x64Comisd(a, b);
+        return CC_AE;
+    }
+}
+
+// emitEquality compares the bits, as values are equal only when identical.
+static Condition emitEquality(int a, int b) {
+    x64MovqFromXmm(RAX, a);
+    x64MovqFromXmm(RCX, b);
+    x64Alu(ALU_CMP, RAX, RCX);
+    return CC_E;
+}
+
+// emitFalseyTest returns the condition that holds when the value is falsey,
+// which the recorded type narrows down to a single compare.
+static Condition emitFalseyTest(int xmm, Type type) {
+    x64MovqFromXmm(RAX, xmm);
+    if (type == TYPE_NUMBER) {
+        x64Alu(ALU_ADD, RAX, RAX); // Drops the sign of -0.
+    } else {
+        x64MovImm(RCX, FALSE_VAL);
+        x64Alu(ALU_CMP, RAX, RCX);
+    }
+    return CC_E;
+}
+
+static void emitBool(Condition cc, int xmm) {
+    x64Setcc(cc, RCX);
+    x64MovzxByte(RCX, RCX);
+    x64MovImm(RAX, FALSE_VAL);
+    x64Alu(ALU_SUB, RAX, RCX);
+    x64MovqToXmm(xmm, RAX);
+}
+
+// emitGuard leaves the trace when the jump at step goes the other way than
+// it was recorded. isTaken is the condition under which the jump is taken.
+static void emitGuard(Step *step, Condition isTaken, int height) {
+    Chunk *chunk = &recorder.fn->chunk;
+    int resume = step->isTaken
+                     ? step->offset + instructionLength(chunk, step->offset)
+                     : jumpTarget(chunk, step->offset);
+    if (IS_EXCEEDING_CAPACITY(compiler.exitCount, compiler.exitCapacity)) {
+        int oldCapacity = compiler.exitCapacity;
+        compiler.exitCapacity = GROW_CAPACITY(oldCapacity);
+        compiler.exits =
+            reallocate(compiler.exits, sizeof(Exit) * oldCapacity,
+                       sizeof(Exit) * compiler.exitCapacity);
+    }
+    int at = x64JumpIf(step->isTaken ? isTaken ^ 1 : isTaken);
+    compiler.exits[compiler.exitCount++] =
+        (Exit){at, height, cellAt(resume)};
+}
+
+static Cell *cellAt(int offset) {
+    return cellAtOffset(&recorder.fn->threaded, offset);
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef dojo_trace_h
+#define dojo_trace_h
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// A loop is traced once its back-edge has been taken this many times. An
+// iteration that leaves the loop is no use as a trace, and the loop is
+// recorded again on its next back-edge, up to TRACE_ATTEMPTS times.
+#define TRACE_THRESHOLD 100
+#define TRACE_ATTEMPTS 8
+
+// A Trace is the native code of one recorded iteration of a loop. It runs
+// the loop until a guard fails and then hands the frame back to the
+// interpreter.
+typedef struct Trace {
+    struct Trace *next; // The other traces of the same function.
+    size_t size;
+    void *entry;
+} Trace;
+
+NOINLINE bool recordTrace(CallFrame *frame, Cell *loop, Cell **resume);
+Cell *runTrace(Trace *trace, CallFrame *frame);
+void freeTraces(Trace *trace);
+
+#endif
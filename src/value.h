@@ -15,12 +15,20 @@ typedef uint64_t Value;
 #define TAG_NIL 1
 #define TAG_TRUE 2
 #define TAG_FALSE 3
+#define TAG_UNDEFINED 4 // Never seen by programs: marks an unset global.
+
+// Small integers take the quiet NaNs whose top 16 bits are INT_TAG, with the
+// int32 in the low 32 bits. They print and compare like the doubles they
+// stand for, so programs can not tell the two apart.
+#define INT_TAG ((uint64_t)0x7ffd)
 
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
+#define INT_VAL(i) ((Value)(QNAN | (INT_TAG << 48) | (uint32_t)(int32_t)(i)))
 #define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
 static inline Value numToValue(double num) {
@@ -30,14 +38,19 @@ static inline Value numToValue(double num) {
 }
 
 #define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_BOOL(value) (((value) | 1) == FALSE_VAL)
-#define IS_NUMBER(value) (((value)&QNAN) != QNAN)
+#define IS_DOUBLE(value) (((value)&QNAN) != QNAN)
+#define IS_INT(value) ((value) >> 48 == INT_TAG)
+#define IS_NUMBER(value) isNumber(value)
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value) ((value) == TRUE_VAL)
 #define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
-#define AS_NUMBER(value) valueToNum(value)
+#define AS_INT(value) ((int32_t)(uint32_t)(value))
+#define AS_DOUBLE(value) valueToNum(value)
+#define AS_NUMBER(value) numberOf(value)
 
 static inline double valueToNum(Value value) {
     double num;
@@ -45,6 +58,72 @@ static inline double valueToNum(Value value) {
     return num;
 }
 
+static inline bool isNumber(Value value) {
+    return IS_DOUBLE(value) || IS_INT(value);
+}
+
+// numberOf is the double value of either kind of number.
+static inline double numberOf(Value value) {
+    return IS_INT(value) ? (double)AS_INT(value) : valueToNum(value);
+}
+
+// isInt32 tells whether num is an integer an INT_VAL can hold.
+static inline bool isInt32(double num) {
+    return num >= INT32_MIN && num <= INT32_MAX && num == (int32_t)num;
+}
+
+// toDoubleVal turns an int into the double it stands for, leaving any other
+// value alone.
+static inline Value toDoubleVal(Value value) {
+    return IS_INT(value) ? NUMBER_VAL((double)AS_INT(value)) : value;
+}
+
+// valuesEqual compares values bit for bit, with ints first turned into the
+// doubles they stand for.
+static inline bool valuesEqual(Value a, Value b) {
+    return a == b ||
+           ((IS_INT(a) || IS_INT(b)) && toDoubleVal(a) == toDoubleVal(b));
+}
+
+// The int arithmetic below gives the same number as the double arithmetic
+// would, moving to a double when the result leaves int32.
+static inline Value addInts(int32_t a, int32_t b) {
+    int32_t result;
+    if (ADD_OVERFLOW_INT32(a, b, &result)) {
+        return NUMBER_VAL((double)a + b);
+    }
+    return INT_VAL(result);
+}
+
+static inline Value subtractInts(int32_t a, int32_t b) {
+    int32_t result;
+    if (SUB_OVERFLOW_INT32(a, b, &result)) {
+        return NUMBER_VAL((double)a - b);
+    }
+    return INT_VAL(result);
+}
+
+static inline Value multiplyInts(int32_t a, int32_t b) {
+    int32_t result;
+    if (MUL_OVERFLOW_INT32(a, b, &result)) {
+        return NUMBER_VAL((double)a * b);
+    }
+    // Zero times a negative number is -0.
+    if (result == 0 && (a ^ b) < 0) {
+        return NUMBER_VAL(-0.0);
+    }
+    return INT_VAL(result);
+}
+
+// negateNumber negates a number of either kind. Neither -0 nor -INT32_MIN is
+// an int.
+static inline Value negateNumber(Value value) {
+    if (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT32_MIN) {
+        return INT_VAL(-AS_INT(value));
+    }
+    return NUMBER_VAL(-AS_NUMBER(value));
+}
+
 typedef struct {
     int capacity;
     int count;
@@ -1,421 +1,1289 @@
 #include "vm.h"
+#include "cache.h"
 #include "chunk.h"
 #include "compiler.h"
 #include "debug.h"
 #include "error.h"
 #include "hashmap.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
-#include "scanner.h"
+#include "trace.h"
 #include "value.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
-static void terminateVM();
+static InterpreterResult runScript(ObjFn *fn);
+static void resetVM();
+static void initHeap();
+static void freeHeap();
 
-static InterpreterResult run();
+static InterpreterResult run(int baseFrame);
 
 static Value makeStrTemplate(int numSpans);
-static bool invoke(ObjString *method, int argCount);
+NOINLINE static bool invoke(ObjString *method, int argCount,
+                            InlineCache *cache);
 static bool invokeFromClass(ObjClass *djClass, ObjString *name, int argCount);
 static bool call(Value callee, int argCount);
 static bool callClosure(ObjClosure *closure, int argCount);
+static bool replaceFrame(CallFrame *frame, ObjClosure *closure, int argCount);
+NOINLINE static bool tailCall(CallFrame *frame, int argCount);
+static inline void countCall(ObjFn *fn);
+NOINLINE static bool compileOnFirstCall(ObjFn *fn);
 static bool callNativeFn(ObjNativeFn *fn, int argCount);
+static bool resumeFiber(ObjFiber *fiber, int argCount);
+static bool startFiber(ObjClosure *closure, Value value);
+static void saveStacks(ObjFiber *fiber);
+static void loadStacks(ObjFiber *fiber);
+static inline bool isClosureOfArity(Value callee, int argCount);
+static bool runCompiled(CallFrame *caller);
+static bool finishCall(int depth);
+static bool interpretFrame(CallFrame *frame);
 static void defineNativeFn(const char *name, NativeFn fn, int arity);
 static void defineMethod(ObjString *name);
 static bool bindMethod(ObjClass *djClass, ObjString *name);
+NOINLINE static bool findProperty(ObjInstance *instance, ObjString *name,
+                                  InlineCache *cache, Value *value,
+                                  bool *isMethod);
+
+static inline CacheEntry *findCacheEntry(InlineCache *cache,
+                                         ObjShape *shape);
+static inline Value *cachedField(InlineCache *cache, ObjInstance *instance);
+static inline Value *cachedMethod(InlineCache *cache, ObjInstance *instance);
+static void fillCache(InlineCache *cache, CacheEntry entry);
 
-static void closeUpvalues(Value *last);
 static ObjUpvalue *captureUpvalue(Value *local);
 static ObjUpvalue *findOpenUpvalueParent(Value *local);
 
+static Cell *threadedCode(ObjFn *fn);
+static inline Value loadSlot(Value *slot, Value *sp, Value tos);
 static bool isFalsey();
+static inline bool isInteger(Value value);
+static inline int32_t toInteger(Value value);
 static CallFrame *lastCallFrame();
-static void resetStack();
+static void initStacks();
+static void freeStacks();
+static inline void reserveStack(int count);
+NOINLINE static void growStack(int count);
+NOINLINE static bool addFrameSegment();
 static Value peek(int depth);
 
 static void defineNativeFns();
 static Value clockNative(int argCount, Value *args);
 static Value printNative(int argCount, Value *args);
+static Value fiberNative(int argCount, Value *args);
+static Value isDoneNative(int argCount, Value *args);
+
+ISOLATE_LOCAL VM vm;
 
-VM vm;
+// Handler addresses published by run() for threading code.
+static ISOLATE_LOCAL const void *const *handlers = NULL;
 
+static int frameMax = FRAME_MAX;
+
+// interpret runs source and leaves the VM ready for the next script, with
+// none of the objects and globals of this one.
 InterpreterResult interpret(const char *source) {
     ObjFn *fn = compile(source);
+    InterpreterResult res = fn ? runScript(fn) : INTERPRET_COMPILE_ERROR;
+    resetVM();
+    return res;
+}
+
+// interpretCached is interpret for a script compiled once into the cache
+// file at cachePath, which it is loaded from for as long as source is the
+// same. The cache is written after the script has run, with the bodies of
+// the global functions it called, and written again by a later run that
+// calls one more.
+InterpreterResult interpretCached(const char *source, const char *cachePath) {
+    uint64_t key = cacheKey(source);
+    CacheFile file;
+    ObjFn *fn = loadCache(cachePath, key, source, &file);
+    bool isStale = fn == NULL;
     if (!fn) {
-        terminateVM();
-        return INTERPRET_COMPILE_ERROR;
+        fn = compile(source);
+    }
+    InterpreterResult res = INTERPRET_COMPILE_ERROR;
+    if (fn) {
+        res = runScript(fn);
+        if (isStale || vm.firstCallCompiles > 0) {
+            saveCache(cachePath, key, source, fn);
+        }
     }
+    resetVM();
+    closeCache(&file);
+    return res;
+}
+
+static InterpreterResult runScript(ObjFn *fn) {
     push(OBJ_VAL(fn));
     ObjClosure *closure = newObjClosure(fn);
     pop();
     push(OBJ_VAL(closure));
     callClosure(closure, 0);
-    InterpreterResult res = run();
-    terminateVM();
-    return res;
+    return run(0);
 }
 
 void initVM() {
-    resetStack();
+    initStacks();
+    initGC();
+    vm.out = stdout;
+    vm.err = stderr;
+    initHeap();
+    run(0);
+}
+
+void terminateVM() {
+    freeHeap();
+    freeStacks();
+    terminateGC();
+}
+
+// initCompileContext readies a thread that only compiles bodies for the
+// isolates of other threads. The compiler allocates into its string table and
+// object list, and pushes values to keep them from a collector that never
+// runs, so it needs none of the rest of the VM.
+void initCompileContext() {
+    vm.stackCapacity = STACK_HEADROOM;
+    vm.stack = ALLOCATE(Value, vm.stackCapacity);
+    vm.stackLimit = vm.stack;
+    vm.stackTop = vm.stack;
+    initMap(&vm.stringLiterals);
+    vm.objs = NULL;
+    vm.out = stdout;
+    vm.err = stderr;
     initGC();
+    pauseGC();
+}
+
+// resetVM frees what a script left behind. The stacks stay as large as it
+// grew them, and a runtime error leaves no frames on them to unwind.
+static void resetVM() {
+    freeHeap();
+    vm.stackTop = vm.stack;
+    vm.frameCount = 0;
+    vm.openUpvalues = NULL;
+    resetGC();
+    initHeap();
+}
+
+// initHeap creates the objects and globals every script starts with.
+static void initHeap() {
     initMap(&vm.stringLiterals);
-    initMap(&vm.globals);
+    initMap(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
     vm.objs = NULL;
+    vm.firstCallCompiles = 0;
+    vm.fiber = NULL;
+    vm.initString = NULL;
     vm.initString = newObjString("init", 4);
+    vm.fiber = newObjFiber(NULL);
     defineNativeFns();
 }
 
+static void freeHeap() {
+    discardCompileJobs();
+    freeObjs(vm.objs);
+    freeMap(&vm.stringLiterals);
+    freeMap(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
+}
+
 static void defineNativeFns() {
     defineNativeFn("clock", clockNative, 0);
     defineNativeFn("print", printNative, 1);
+    defineNativeFn("fiber", fiberNative, 1);
+    defineNativeFn("isDone", isDoneNative, 1);
 }
 
-static void terminateVM() {
-    freeObjs(vm.objs);
-    freeMap(&vm.stringLiterals);
-    freeMap(&vm.globals);
-    terminateScanner();
-    terminateGC();
+// setFrameMax limits how deep calls nest in the VMs initialized after it.
+void setFrameMax(int max) {
+    frameMax = max;
 }
 
-static InterpreterResult run() {
-    CallFrame *frame = &vm.frames[vm.frameCount - 1];
-    register uint8_t *ip = frame->ip;
+// setOutput sends what the scripts of this isolate print to out, and their
+// errors to err, in place of stdout and stderr.
+void setOutput(FILE *out, FILE *err) {
+    vm.out = out;
+    vm.err = err;
+}
+
+// run interprets the frames above baseFrame. The frame at baseFrame is left
+// with its result pushed when it returns.
+static InterpreterResult run(int baseFrame) {
 #define LOAD_IP_REGISTER ip = frame->ip
 #define SAVE_IP_REGISTER frame->ip = ip
-#define READ_BYTE() (*ip++)
-#define READ_CONSTANT()                                                        \
-    (getConstantAtIndex(&frame->closure->fn->chunk, READ_BYTE()))
-#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
-#define READ_STRING() (AS_STRING(READ_CONSTANT()))
-#define ARITHEMETIC_BINARY_OP(valueType, op)                                   \
+#define READ_CELL() (ip++)
+#define READ_OPERAND() (READ_CELL()->operand)
+#define READ_CONSTANT() (READ_CELL()->value)
+#define READ_STRING() (READ_CELL()->string)
+#define READ_TARGET() (READ_CELL()->target)
+#define READ_CACHE() (READ_CELL()->cache)
+// The value on top of the stack is cached in tos, and sp points to the slot
+// it would occupy in memory. Everything below sp is always in memory, while
+// the slot at sp is only written back by SYNC_STACK, which helpers that use
+// the stack or allocate (and so may collect garbage) need first. A helper
+// that changes the stack is followed by RELOAD_STACK.
+#define SYNC_STACK() (*sp = tos, vm.stackTop = sp + 1)
+#define RELOAD_STACK() (sp = vm.stackTop - 1, tos = *sp)
+#define PUSH(value)                                                            \
+    do {                                                                       \
+        Value pushed = (value);                                                \
+        *sp++ = tos;                                                           \
+        tos = pushed;                                                          \
+    } while (false)
+#define DROP() (tos = *--sp)
+// A local may be the value on top of the stack.
+#define READ_SLOT_ADDRESS() (frame->slots + READ_OPERAND())
+#define READ_SLOT() loadSlot(READ_SLOT_ADDRESS(), sp, tos)
+// Register ops write tos back once and then use the frame slots directly.
+#define FLUSH_TOS() (*sp = tos)
+#define REFRESH_TOS() (tos = *sp)
+// DOUBLE_OPERANDS turns the numbers a and b into doubles, reporting an error
+// unless both are numbers.
+#define DOUBLE_OPERANDS(a, b)                                                  \
     do {                                                                       \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                      \
+        if (IS_DOUBLE(a) && IS_DOUBLE(b)) {                                    \
+            break;                                                             \
+        }                                                                      \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                  \
+            SAVE_IP_REGISTER;                                                  \
             runtimeError("Operands must be numbers ");                         \
             return INTERPRET_RUNTIME_ERROR;                                    \
         }                                                                      \
-        double b = AS_NUMBER(pop());                                           \
-        double a = AS_NUMBER(pop());                                           \
-        push(valueType(a op b));                                               \
+        a = toDoubleVal(a);                                                    \
+        b = toDoubleVal(b);                                                    \
+    } while (false)
+// The arithmetic macros take an int fast path when both operands are ints,
+// where intResult computes the result from the ints x and y.
+#define ARITHEMETIC_BINARY_OP(valueType, op, intResult)                        \
+    do {                                                                       \
+        Value a = sp[-1];                                                      \
+        Value b = tos;                                                         \
+        sp--;                                                                  \
+        if (LIKELY(IS_INT(a) && IS_INT(b))) {                                  \
+            int32_t x = AS_INT(a);                                             \
+            int32_t y = AS_INT(b);                                             \
+            tos = intResult;                                                   \
+            break;                                                             \
+        }                                                                      \
+        DOUBLE_OPERANDS(a, b);                                                 \
+        tos = valueType(AS_DOUBLE(a) op AS_DOUBLE(b));                         \
+    } while (false)
+#define ARITHEMETIC_LOCALS_OP(op, intResult)                                   \
+    do {                                                                       \
+        Value a = READ_SLOT();                                                 \
+        Value b = READ_SLOT();                                                 \
+        if (LIKELY(IS_INT(a) && IS_INT(b))) {                                  \
+            int32_t x = AS_INT(a);                                             \
+            int32_t y = AS_INT(b);                                             \
+            PUSH(intResult);                                                   \
+            break;                                                             \
+        }                                                                      \
+        DOUBLE_OPERANDS(a, b);                                                 \
+        PUSH(NUMBER_VAL(AS_DOUBLE(a) op AS_DOUBLE(b)));                        \
+    } while (false)
+#define COMPARE_JUMP_OP(op)                                                    \
+    do {                                                                       \
+        Cell *target = READ_TARGET();                                          \
+        Value a = sp[-1];                                                      \
+        Value b = tos;                                                         \
+        sp -= 2;                                                               \
+        REFRESH_TOS();                                                         \
+        if (LIKELY(IS_INT(a) && IS_INT(b))) {                                  \
+            if (!(AS_INT(a) op AS_INT(b))) {                                   \
+                ip = target;                                                   \
+            }                                                                  \
+            break;                                                             \
+        }                                                                      \
+        DOUBLE_OPERANDS(a, b);                                                 \
+        if (!(AS_DOUBLE(a) op AS_DOUBLE(b))) {                                 \
+            ip = target;                                                       \
+        }                                                                      \
+    } while (false)
+#define REGISTER_ARITHMETIC_OP(op, intResult, readRhs)                         \
+    do {                                                                       \
+        FLUSH_TOS();                                                           \
+        Value *dst = READ_SLOT_ADDRESS();                                      \
+        Value a = *READ_SLOT_ADDRESS();                                        \
+        Value b = readRhs;                                                     \
+        if (LIKELY(IS_INT(a) && IS_INT(b))) {                                  \
+            int32_t x = AS_INT(a);                                             \
+            int32_t y = AS_INT(b);                                             \
+            *dst = intResult;                                                  \
+        } else {                                                               \
+            DOUBLE_OPERANDS(a, b);                                             \
+            *dst = NUMBER_VAL(AS_DOUBLE(a) op AS_DOUBLE(b));                   \
+        }                                                                      \
+        REFRESH_TOS();                                                         \
+    } while (false)
+#define REGISTER_COMPARE_JUMP_OP(op, readRhs)                                  \
+    do {                                                                       \
+        FLUSH_TOS();                                                           \
+        Value a = *READ_SLOT_ADDRESS();                                        \
+        Value b = readRhs;                                                     \
+        Cell *target = READ_TARGET();                                          \
+        if (LIKELY(IS_INT(a) && IS_INT(b))) {                                  \
+            if (!(AS_INT(a) op AS_INT(b))) {                                   \
+                ip = target;                                                   \
+            }                                                                  \
+            break;                                                             \
+        }                                                                      \
+        DOUBLE_OPERANDS(a, b);                                                 \
+        if (!(AS_DOUBLE(a) op AS_DOUBLE(b))) {                                 \
+            ip = target;                                                       \
+        }                                                                      \
+    } while (false)
+// The integer-only ops also take doubles that hold an int.
+#define INTEGER_BINARY_OP(intResult)                                           \
+    do {                                                                       \
+        if (!isInteger(tos) || !isInteger(sp[-1])) {                           \
+            SAVE_IP_REGISTER;                                                  \
+            runtimeError("Operands must be integers ");                        \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        int32_t y = toInteger(tos);                                            \
+        int32_t x = toInteger(*--sp);                                          \
+        tos = intResult;                                                       \
+    } while (false)
+// QUICKEN_BINARY_OP rewrites the instruction just read to intOp when both
+// operands on top of the stack are ints, or to numOp when both are doubles.
+#define QUICKEN_BINARY_OP(intOp, numOp)                                        \
+    do {                                                                       \
+        if (IS_INT(sp[-1]) && IS_INT(tos)) {                                   \
+            REWRITE_INSTRUCTION(ip - 1, intOp);                                \
+        } else if (IS_DOUBLE(sp[-1]) && IS_DOUBLE(tos)) {                      \
+            REWRITE_INSTRUCTION(ip - 1, numOp);                                \
+        }                                                                      \
+    } while (false)
+// DEQUICKEN turns the instruction just read back into op and runs it again.
+#define DEQUICKEN(op)                                                          \
+    do {                                                                       \
+        ip--;                                                                  \
+        REWRITE_INSTRUCTION(ip, op);                                           \
+        DISPATCH();                                                            \
+    } while (false)
+// A quickened op on ints falls back to op when an operand is not an int or
+// when overflows, one of the *_OVERFLOW_INT32, reports that the result is not.
+#define QUICK_INT_ARITHMETIC_OP(op, overflows)                                 \
+    do {                                                                       \
+        int32_t result;                                                        \
+        if (!IS_INT(sp[-1]) || !IS_INT(tos) ||                                 \
+            overflows(AS_INT(sp[-1]), AS_INT(tos), &result)) {                 \
+            DEQUICKEN(op);                                                     \
+        }                                                                      \
+        sp--;                                                                  \
+        tos = INT_VAL(result);                                                 \
+    } while (false)
+// The other quickened ops take the operands as isType says, and fall back to
+// op on any others.
+#define QUICK_BINARY_OP(op, isType, asType, valueType, binaryOp)               \
+    do {                                                                       \
+        if (!isType(sp[-1]) || !isType(tos)) {                                 \
+            DEQUICKEN(op);                                                     \
+        }                                                                      \
+        sp--;                                                                  \
+        tos = valueType(asType(*sp) binaryOp asType(tos));                     \
+    } while (false)
+#define QUICK_COMPARE_JUMP_OP(op, isType, asType, compareOp)                   \
+    do {                                                                       \
+        if (!isType(sp[-1]) || !isType(tos)) {                                 \
+            DEQUICKEN(op);                                                     \
+        }                                                                      \
+        Cell *target = READ_TARGET();                                          \
+        bool isTrue = asType(sp[-1]) compareOp asType(tos);                    \
+        sp -= 2;                                                               \
+        REFRESH_TOS();                                                         \
+        if (!isTrue) {                                                         \
+            ip = target;                                                       \
+        }                                                                      \
+    } while (false)
+#define RETURN_VALUE(value)                                                    \
+    do {                                                                       \
+        Value result = value;                                                  \
+        if (vm.openUpvalues) {                                                 \
+            FLUSH_TOS();                                                       \
+            closeUpvalues(frame->slots);                                       \
+        }                                                                      \
+        vm.frameCount--;                                                       \
+        if (vm.frameCount == baseFrame) {                                      \
+            vm.stackTop = frame->slots;                                        \
+            push(result);                                                      \
+            return INTERPRET_OK;                                               \
+        }                                                                      \
+                                                                               \
+        sp = frame->slots;                                                     \
+        tos = result;                                                          \
+        frame = lastCallFrame();                                               \
+        LOAD_IP_REGISTER;                                                      \
+        DISPATCH();                                                            \
     } while (false)
 
-    for (;;) {
 #ifdef DEBUG_LOG_BYTECODE
-        disassembleInstruction(&frame->closure->fn->chunk,
-                               (int)(ip - frame->closure->fn->chunk.codes));
+#define TRACE_INSTRUCTION()                                                    \
+    disassembleInstruction(&frame->closure->fn->chunk,                         \
+                           frame->closure->fn->threaded                        \
+                               .offsets[ip - frame->closure->fn->threaded.cells])
+#else
+#define TRACE_INSTRUCTION()
 #endif
-        uint8_t instruction = READ_BYTE();
-        switch (instruction) {
-        case OP_INHERIT: {
-            Value super = peek(1);
-            if (!IS_CLASS(super)) {
-                SAVE_IP_REGISTER;
-                runtimeError("Superclass must be a class");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            ObjClass *sub = AS_CLASS(peek(0));
-            mapPutAll(&AS_CLASS(super)->methods, &sub->methods);
-            pop();
-            break;
-        }
-        case OP_CLASS: {
-            push(OBJ_VAL(newObjClass(READ_STRING())));
-            break;
-        }
-        case OP_METHOD: {
-            defineMethod(READ_STRING());
-            break;
-        }
-        case OP_CLOSURE: {
-            ObjFn *fn = AS_FN(READ_CONSTANT());
-            ObjClosure *closure = newObjClosure(fn);
-            push(OBJ_VAL(closure));
-            for (int i = 0; i < closure->upvalueCount; i++) {
-                uint8_t isLocal = READ_BYTE();
-                uint8_t index = READ_BYTE();
-                if (isLocal) {
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                } else {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
-                }
-            }
-            break;
-        }
-        case OP_SUPER_INVOKE: {
-            ObjString *method = READ_STRING();
-            int argCount = READ_BYTE();
-            ObjClass *superclass = AS_CLASS(pop());
-            SAVE_IP_REGISTER;
-            if (!invokeFromClass(superclass, method, argCount)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &vm.frames[vm.frameCount - 1];
-            LOAD_IP_REGISTER;
-            break;
-        }
-        case OP_INVOKE: {
-            ObjString *method = READ_STRING();
-            int argCount = READ_BYTE();
-            SAVE_IP_REGISTER;
-            if (!invoke(method, argCount)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &vm.frames[vm.frameCount - 1];
-            LOAD_IP_REGISTER;
-            break;
-        }
-        case OP_CALL: {
-            int argCount = READ_BYTE();
-            SAVE_IP_REGISTER;
-            if (!call(peek(argCount), argCount)) {
-                runtimeError("Can only call functions and methods");
-                return INTERPRET_RUNTIME_ERROR;
-            }
 
-            frame = &vm.frames[vm.frameCount - 1];
-            LOAD_IP_REGISTER;
-            break;
-        }
-        case OP_RETURN: {
-            Value result = pop();
-            closeUpvalues(frame->slots);
-            vm.frameCount--;
-            if (vm.frameCount == 0) {
-                pop();
-                return INTERPRET_OK;
-            }
+// With computed gotos every handler ends in its own indirect jump to the
+// next handler, which gives the branch predictor one jump per opcode instead
+// of a single shared one at the top of the switch.
+#ifdef DOJO_COMPUTED_GOTO
+    static const void *const dispatchTable[] = {
+        [OP_INHERIT] = &&DO_OP_INHERIT,
+        [OP_CLASS] = &&DO_OP_CLASS,
+        [OP_METHOD] = &&DO_OP_METHOD,
+        [OP_CLOSURE] = &&DO_OP_CLOSURE,
+        [OP_SUPER_INVOKE] = &&DO_OP_SUPER_INVOKE,
+        [OP_INVOKE] = &&DO_OP_INVOKE,
+        [OP_CALL] = &&DO_OP_CALL,
+        [OP_TAIL_CALL] = &&DO_OP_TAIL_CALL,
+        [OP_RETURN] = &&DO_OP_RETURN,
+        [OP_YIELD] = &&DO_OP_YIELD,
+        [OP_DEFINE_GLOBAL] = &&DO_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&DO_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&DO_OP_SET_GLOBAL,
+        [OP_GET_LOCAL] = &&DO_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&DO_OP_SET_LOCAL,
+        [OP_GET_UPVALUE] = &&DO_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&DO_OP_SET_UPVALUE,
+        [OP_CLOSE_UPVALUE] = &&DO_OP_CLOSE_UPVALUE,
+        [OP_GET_PROPERTY] = &&DO_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&DO_OP_SET_PROPERTY,
+        [OP_GET_SUPER] = &&DO_OP_GET_SUPER,
+        [OP_JUMP_IF_TRUE] = &&DO_OP_JUMP_IF_TRUE,
+        [OP_JUMP_IF_FALSE] = &&DO_OP_JUMP_IF_FALSE,
+        [OP_JUMP] = &&DO_OP_JUMP,
+        [OP_LOOP] = &&DO_OP_LOOP,
+        [OP_ASSIGN] = &&DO_UNKNOWN_OP,
+        [OP_EQUAL] = &&DO_OP_EQUAL,
+        [OP_NOT_EQUAL] = &&DO_OP_NOT_EQUAL,
+        [OP_AND] = &&DO_UNKNOWN_OP,
+        [OP_OR] = &&DO_UNKNOWN_OP,
+        [OP_LESS] = &&DO_OP_LESS,
+        [OP_LESS_EQUAL] = &&DO_OP_LESS_EQUAL,
+        [OP_GREATER] = &&DO_OP_GREATER,
+        [OP_GREATER_EQUAL] = &&DO_OP_GREATER_EQUAL,
+        [OP_ADD] = &&DO_OP_ADD,
+        [OP_SUBTRACT] = &&DO_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&DO_OP_MULTIPLY,
+        [OP_MODULO] = &&DO_OP_MODULO,
+        [OP_BITWISE_AND] = &&DO_OP_BITWISE_AND,
+        [OP_BITWISE_OR] = &&DO_OP_BITWISE_OR,
+        [OP_BITWISE_XOR] = &&DO_OP_BITWISE_XOR,
+        [OP_SHIFT_LEFT] = &&DO_OP_SHIFT_LEFT,
+        [OP_SHIFT_RIGHT] = &&DO_OP_SHIFT_RIGHT,
+        [OP_DIVIDE] = &&DO_OP_DIVIDE,
+        [OP_NOT] = &&DO_OP_NOT,
+        [OP_NEGATE] = &&DO_OP_NEGATE,
+        [OP_CONSTANT] = &&DO_OP_CONSTANT,
+        [OP_TEMPLATE] = &&DO_OP_TEMPLATE,
+        [OP_TRUE] = &&DO_OP_TRUE,
+        [OP_FALSE] = &&DO_OP_FALSE,
+        [OP_NIL] = &&DO_OP_NIL,
+        [OP_POP] = &&DO_OP_POP,
+        [OP_POPN] = &&DO_OP_POPN,
+        [OP_PUSH] = &&DO_UNKNOWN_OP,
+        [OP_JUMP_IF_NOT_LESS] = &&DO_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_LESS_EQUAL] = &&DO_OP_JUMP_IF_NOT_LESS_EQUAL,
+        [OP_JUMP_IF_NOT_GREATER] = &&DO_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&DO_OP_JUMP_IF_NOT_GREATER_EQUAL,
+        [OP_JUMP_IF_NOT_EQUAL] = &&DO_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_EQUAL] = &&DO_OP_JUMP_IF_EQUAL,
+        [OP_ADD_LOCALS] = &&DO_OP_ADD_LOCALS,
+        [OP_SUBTRACT_LOCALS] = &&DO_OP_SUBTRACT_LOCALS,
+        [OP_MULTIPLY_LOCALS] = &&DO_OP_MULTIPLY_LOCALS,
+        [OP_DIVIDE_LOCALS] = &&DO_OP_DIVIDE_LOCALS,
+        [OP_GET_LOCAL_PROPERTY] = &&DO_OP_GET_LOCAL_PROPERTY,
+        [OP_RETURN_CONSTANT] = &&DO_OP_RETURN_CONSTANT,
+        [OP_MOVE] = &&DO_OP_MOVE,
+        [OP_LOAD_CONSTANT] = &&DO_OP_LOAD_CONSTANT,
+        [OP_ADD_RR] = &&DO_OP_ADD_RR,
+        [OP_SUBTRACT_RR] = &&DO_OP_SUBTRACT_RR,
+        [OP_MULTIPLY_RR] = &&DO_OP_MULTIPLY_RR,
+        [OP_DIVIDE_RR] = &&DO_OP_DIVIDE_RR,
+        [OP_ADD_RK] = &&DO_OP_ADD_RK,
+        [OP_SUBTRACT_RK] = &&DO_OP_SUBTRACT_RK,
+        [OP_MULTIPLY_RK] = &&DO_OP_MULTIPLY_RK,
+        [OP_DIVIDE_RK] = &&DO_OP_DIVIDE_RK,
+        [OP_JUMP_IF_NOT_LESS_RR] = &&DO_OP_JUMP_IF_NOT_LESS_RR,
+        [OP_JUMP_IF_NOT_LESS_EQUAL_RR] = &&DO_OP_JUMP_IF_NOT_LESS_EQUAL_RR,
+        [OP_JUMP_IF_NOT_GREATER_RR] = &&DO_OP_JUMP_IF_NOT_GREATER_RR,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL_RR] = &&DO_OP_JUMP_IF_NOT_GREATER_EQUAL_RR,
+        [OP_JUMP_IF_NOT_LESS_RK] = &&DO_OP_JUMP_IF_NOT_LESS_RK,
+        [OP_JUMP_IF_NOT_LESS_EQUAL_RK] = &&DO_OP_JUMP_IF_NOT_LESS_EQUAL_RK,
+        [OP_JUMP_IF_NOT_GREATER_RK] = &&DO_OP_JUMP_IF_NOT_GREATER_RK,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL_RK] = &&DO_OP_JUMP_IF_NOT_GREATER_EQUAL_RK,
+        [OP_LOOP_TRACE] = &&DO_OP_LOOP_TRACE,
+        [OP_CALL_CLOSURE] = &&DO_OP_CALL_CLOSURE,
+        [OP_GET_GLOBAL_DEFINED] = &&DO_OP_GET_GLOBAL_DEFINED,
+        [OP_SET_GLOBAL_DEFINED] = &&DO_OP_SET_GLOBAL_DEFINED,
+        [OP_ADD_INT] = &&DO_OP_ADD_INT,
+        [OP_ADD_NUM] = &&DO_OP_ADD_NUM,
+        [OP_SUBTRACT_INT] = &&DO_OP_SUBTRACT_INT,
+        [OP_SUBTRACT_NUM] = &&DO_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_INT] = &&DO_OP_MULTIPLY_INT,
+        [OP_MULTIPLY_NUM] = &&DO_OP_MULTIPLY_NUM,
+        [OP_LESS_INT] = &&DO_OP_LESS_INT,
+        [OP_LESS_NUM] = &&DO_OP_LESS_NUM,
+        [OP_LESS_EQUAL_INT] = &&DO_OP_LESS_EQUAL_INT,
+        [OP_LESS_EQUAL_NUM] = &&DO_OP_LESS_EQUAL_NUM,
+        [OP_GREATER_INT] = &&DO_OP_GREATER_INT,
+        [OP_GREATER_NUM] = &&DO_OP_GREATER_NUM,
+        [OP_GREATER_EQUAL_INT] = &&DO_OP_GREATER_EQUAL_INT,
+        [OP_GREATER_EQUAL_NUM] = &&DO_OP_GREATER_EQUAL_NUM,
+        [OP_JUMP_IF_NOT_LESS_INT] = &&DO_OP_JUMP_IF_NOT_LESS_INT,
+        [OP_JUMP_IF_NOT_LESS_NUM] = &&DO_OP_JUMP_IF_NOT_LESS_NUM,
+        [OP_JUMP_IF_NOT_LESS_EQUAL_INT] = &&DO_OP_JUMP_IF_NOT_LESS_EQUAL_INT,
+        [OP_JUMP_IF_NOT_LESS_EQUAL_NUM] = &&DO_OP_JUMP_IF_NOT_LESS_EQUAL_NUM,
+        [OP_JUMP_IF_NOT_GREATER_INT] = &&DO_OP_JUMP_IF_NOT_GREATER_INT,
+        [OP_JUMP_IF_NOT_GREATER_NUM] = &&DO_OP_JUMP_IF_NOT_GREATER_NUM,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL_INT] =
+            &&DO_OP_JUMP_IF_NOT_GREATER_EQUAL_INT,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL_NUM] =
+            &&DO_OP_JUMP_IF_NOT_GREATER_EQUAL_NUM,
+    };
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(code) DO_##code
+#define DISPATCH()                                                             \
+    {                                                                          \
+        TRACE_INSTRUCTION();                                                   \
+        goto *READ_CELL()->handler;                                            \
+    }
+#define REWRITE_INSTRUCTION(cell, op) ((cell)->handler = dispatchTable[op])
+#else
+#define INTERPRET_LOOP                                                         \
+    loop:                                                                      \
+    TRACE_INSTRUCTION();                                                       \
+    switch (READ_CELL()->opcode)
+#define CASE(code) case code
+#define DISPATCH() goto loop
+#define REWRITE_INSTRUCTION(cell, op) ((cell)->opcode = (op))
+#endif
 
-            vm.stackTop = frame->slots;
-            push(result);
-            frame = &vm.frames[vm.frameCount - 1];
-            LOAD_IP_REGISTER;
-            break;
-        }
-        case OP_DEFINE_GLOBAL: {
-            ObjString *name = READ_STRING();
-            mapPut(&vm.globals, name, peek(0));
-            pop();
-            break;
-        }
-        case OP_GET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            Value val;
-            if (!mapGet(&vm.globals, name, &val)) {
-                SAVE_IP_REGISTER;
-                runtimeError("Undefined Variable '%.*s'", name->length,
-                             name->str);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(val);
-            break;
+#ifdef DOJO_COMPUTED_GOTO
+    handlers = dispatchTable;
+#endif
+    // initVM enters the loop once without a frame to publish the handlers.
+    if (vm.frameCount == 0) {
+        return INTERPRET_OK;
+    }
+
+    CallFrame *frame = lastCallFrame();
+    register Cell *ip = frame->ip;
+    register Value *sp;
+    register Value tos;
+    RELOAD_STACK();
+
+    INTERPRET_LOOP {
+    CASE(OP_INHERIT): {
+        Value super = sp[-1];
+        if (!IS_CLASS(super)) {
+            SAVE_IP_REGISTER;
+            runtimeError("Superclass must be a class");
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_SET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            if (mapPut(&vm.globals, name, peek(0))) {
-                mapDelete(&vm.globals, name);
-                SAVE_IP_REGISTER;
-                runtimeError("Undefined Variable '%.*s'", name->length,
-                             name->str);
-                return INTERPRET_RUNTIME_ERROR;
+        ObjClass *sub = AS_CLASS(tos);
+        sub->version++;
+        SYNC_STACK();
+        mapPutAll(&AS_CLASS(super)->methods, &sub->methods);
+        DROP();
+        DISPATCH();
+    }
+    CASE(OP_CLASS): {
+        SYNC_STACK();
+        push(OBJ_VAL(newObjClass(READ_STRING())));
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_METHOD): {
+        SYNC_STACK();
+        defineMethod(READ_STRING());
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_CLOSURE): {
+        SYNC_STACK();
+        ObjFn *fn = AS_FN(READ_CONSTANT());
+        ObjClosure *closure = newObjClosure(fn);
+        push(OBJ_VAL(closure));
+        for (int i = 0; i < closure->upvalueCount; i++) {
+            uint8_t isLocal = READ_OPERAND();
+            uint8_t index = READ_OPERAND();
+            if (isLocal) {
+                closure->upvalues[i] = captureUpvalue(frame->slots + index);
+            } else {
+                closure->upvalues[i] = frame->closure->upvalues[index];
             }
-            break;
-        }
-        case OP_GET_LOCAL: {
-            int slot = READ_BYTE();
-            push(frame->slots[slot]);
-            break;
-        }
-        case OP_SET_LOCAL: {
-            int slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
-            break;
         }
-        case OP_GET_UPVALUE: {
-            uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
-            break;
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_SUPER_INVOKE): {
+        ObjString *method = READ_STRING();
+        int argCount = READ_OPERAND();
+        ObjClass *superclass = AS_CLASS(tos);
+        DROP();
+        SAVE_IP_REGISTER;
+        SYNC_STACK();
+        if (!invokeFromClass(superclass, method, argCount) ||
+            !runCompiled(frame)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_SET_UPVALUE: {
-            uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+        frame = lastCallFrame();
+        LOAD_IP_REGISTER;
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_INVOKE): {
+        ObjString *method = READ_STRING();
+        int argCount = READ_OPERAND();
+        InlineCache *cache = READ_CACHE();
+        SAVE_IP_REGISTER;
+        SYNC_STACK();
+        if (!invoke(method, argCount, cache) || !runCompiled(frame)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_CLOSE_UPVALUE: {
-            closeUpvalues(vm.stackTop - 1);
-            pop();
-            break;
+        frame = lastCallFrame();
+        LOAD_IP_REGISTER;
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_CALL): {
+        int argCount = READ_OPERAND();
+        SAVE_IP_REGISTER;
+        SYNC_STACK();
+        if (isClosureOfArity(peek(argCount), argCount)) {
+            REWRITE_INSTRUCTION(ip - 2, OP_CALL_CLOSURE);
         }
-        case OP_GET_PROPERTY: {
-            if (!IS_INSTANCE(peek(0))) {
-                SAVE_IP_REGISTER;
-                runtimeError("Only instances have properties.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            ObjInstance *instance = AS_INSTANCE(peek(0));
-            ObjString *name = READ_STRING();
-
-            Value value;
-            if (mapGet(&instance->fields, name, &value)) {
-                pop(); // Instance.
-                push(value);
-                break;
-            }
-
-            if (!bindMethod(instance->djClass, name)) {
-                SAVE_IP_REGISTER;
-                runtimeError("Undefined property '%.*s'", name->length,
-                             name->str);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
+        if (!call(peek(argCount), argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_SET_PROPERTY: {
-            if (!IS_INSTANCE(peek(0))) {
-                SAVE_IP_REGISTER;
-                runtimeError("Only instances have properties.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            ObjInstance *instance = AS_INSTANCE(peek(0));
-            mapPut(&instance->fields, READ_STRING(), peek(1));
-            pop();
-            break;
+        if (!runCompiled(frame)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_GET_SUPER: {
-            ObjString *name = READ_STRING();
-            ObjClass *superclass = AS_CLASS(pop());
 
-            if (!bindMethod(superclass, name)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_LOOP: {
-            uint16_t jump = READ_SHORT();
-            ip -= jump;
-            break;
-        }
-        case OP_JUMP: {
-            uint16_t jump = READ_SHORT();
-            ip += jump;
-            break;
+        frame = lastCallFrame();
+        LOAD_IP_REGISTER;
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_CALL_CLOSURE): {
+        int argCount = READ_OPERAND();
+        SYNC_STACK();
+        Value callee = peek(argCount);
+        if (!isClosureOfArity(callee, argCount)) {
+            ip -= 2;
+            REWRITE_INSTRUCTION(ip, OP_CALL);
+            DISPATCH();
         }
-        case OP_JUMP_IF_TRUE: {
-            uint16_t jump = READ_SHORT();
-            if (!isFalsey(peek(0))) {
-                ip += jump;
-            }
-            break;
+        SAVE_IP_REGISTER;
+        if (!callClosure(AS_CLOSURE(callee), argCount) || !runCompiled(frame)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_JUMP_IF_FALSE: {
-            uint16_t jump = READ_SHORT();
-            if (isFalsey(peek(0))) {
-                ip += jump;
-            }
-            break;
+        frame = lastCallFrame();
+        LOAD_IP_REGISTER;
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_TAIL_CALL): {
+        int argCount = READ_OPERAND();
+        SAVE_IP_REGISTER;
+        SYNC_STACK();
+        if (!tailCall(frame, argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_EQUAL: {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(a == b));
-            break;
+        frame = lastCallFrame();
+        LOAD_IP_REGISTER;
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_RETURN): {
+        RETURN_VALUE(tos);
+    }
+    CASE(OP_YIELD): {
+        SAVE_IP_REGISTER;
+        SYNC_STACK();
+        if (vm.fiber->caller == NULL) {
+            runtimeError("Can only yield inside a fiber");
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_NOT_EQUAL: {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(a != b));
-            break;
+        // Fibers are only interpreted, so this is the run resumeFiber
+        // started, which takes the value from the top of the stack.
+        return INTERPRET_OK;
+    }
+    CASE(OP_DEFINE_GLOBAL): {
+        vm.globalValues.values[READ_OPERAND()] = tos;
+        DROP();
+        DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL): {
+        int slot = READ_OPERAND();
+        Value val = vm.globalValues.values[slot];
+        if (IS_UNDEFINED(val)) {
+            SAVE_IP_REGISTER;
+            undefinedGlobalError(slot);
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_LESS: {
-            ARITHEMETIC_BINARY_OP(BOOL_VAL, <);
-            break;
+        REWRITE_INSTRUCTION(ip - 2, OP_GET_GLOBAL_DEFINED);
+        PUSH(val);
+        DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL_DEFINED): {
+        Value val = vm.globalValues.values[READ_OPERAND()];
+        PUSH(val);
+        DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL): {
+        Value *global = &vm.globalValues.values[READ_OPERAND()];
+        if (IS_UNDEFINED(*global)) {
+            SAVE_IP_REGISTER;
+            undefinedGlobalError((int)(global - vm.globalValues.values));
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_LESS_EQUAL: {
-            ARITHEMETIC_BINARY_OP(BOOL_VAL, <=);
-            break;
+        REWRITE_INSTRUCTION(ip - 2, OP_SET_GLOBAL_DEFINED);
+        *global = tos;
+        DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL_DEFINED): {
+        vm.globalValues.values[READ_OPERAND()] = tos;
+        DISPATCH();
+    }
+    CASE(OP_GET_LOCAL): {
+        Value value = READ_SLOT();
+        PUSH(value);
+        DISPATCH();
+    }
+    CASE(OP_SET_LOCAL): {
+        // The slot is never the top of the stack here, as that holds the
+        // value being assigned.
+        *READ_SLOT_ADDRESS() = tos;
+        DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE): {
+        uint8_t slot = READ_OPERAND();
+        PUSH(*frame->closure->upvalues[slot]->location);
+        DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE): {
+        uint8_t slot = READ_OPERAND();
+        *frame->closure->upvalues[slot]->location = tos;
+        DISPATCH();
+    }
+    CASE(OP_CLOSE_UPVALUE): {
+        FLUSH_TOS();
+        closeUpvalues(sp);
+        DROP();
+        DISPATCH();
+    }
+    CASE(OP_GET_PROPERTY): {
+        ObjString *name = READ_STRING();
+        InlineCache *cache = READ_CACHE();
+        Value *field = IS_INSTANCE(tos)
+                           ? cachedField(cache, AS_INSTANCE(tos))
+                           : NULL;
+        if (field != NULL) {
+            tos = *field;
+            DISPATCH();
         }
-        case OP_GREATER: {
-            ARITHEMETIC_BINARY_OP(BOOL_VAL, >);
-            break;
+        SAVE_IP_REGISTER;
+        SYNC_STACK();
+        if (!getProperty(name, cache)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_GREATER_EQUAL: {
-            ARITHEMETIC_BINARY_OP(BOOL_VAL, >=);
-            break;
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_SET_PROPERTY): {
+        ObjString *name = READ_STRING();
+        InlineCache *cache = READ_CACHE();
+        SAVE_IP_REGISTER;
+        SYNC_STACK();
+        if (!setProperty(name, cache)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_ADD: {
-            ARITHEMETIC_BINARY_OP(NUMBER_VAL, +);
-            break;
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_GET_SUPER): {
+        ObjString *name = READ_STRING();
+        ObjClass *superclass = AS_CLASS(tos);
+        DROP();
+        SYNC_STACK();
+        if (!bindMethod(superclass, name)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_SUBTRACT: {
-            ARITHEMETIC_BINARY_OP(NUMBER_VAL, -);
-            break;
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_LOOP): {
+        // The cell after the target counts down to recording a trace, and
+        // stays at zero once the loop cannot be traced.
+        Cell *loop = ip - 1;
+        ip = ip->target;
+        LoopCounter *counter = &loop[2].counter;
+        if (counter->countdown > 0 && --counter->countdown == 0) {
+            Cell *resume;
+            SYNC_STACK();
+            if (recordTrace(frame, loop, &resume)) {
+                REWRITE_INSTRUCTION(loop, OP_LOOP_TRACE);
+            }
+            ip = resume;
+            RELOAD_STACK();
         }
-        case OP_DIVIDE: {
-            ARITHEMETIC_BINARY_OP(NUMBER_VAL, /);
-            break;
+        DISPATCH();
+    }
+    CASE(OP_LOOP_TRACE): {
+        Trace *trace = ip[1].trace;
+        SYNC_STACK();
+        ip = runTrace(trace, frame);
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_JUMP): {
+        ip = ip->target;
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_TRUE): {
+        Cell *target = READ_TARGET();
+        if (!isFalsey(tos)) {
+            ip = target;
         }
-        case OP_MULTIPLY: {
-            ARITHEMETIC_BINARY_OP(NUMBER_VAL, *);
-            break;
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE): {
+        Cell *target = READ_TARGET();
+        if (isFalsey(tos)) {
+            ip = target;
         }
-        case OP_TEMPLATE: {
-            int numSpans = READ_BYTE();
-            // one span contains an expression and a string litreal
-            // we also need to pop the template head
-            push(makeStrTemplate(numSpans * 2 + 1));
-            break;
+        DISPATCH();
+    }
+    CASE(OP_EQUAL): {
+        Value b = tos;
+        Value a = *--sp;
+        tos = BOOL_VAL(valuesEqual(a, b));
+        DISPATCH();
+    }
+    CASE(OP_NOT_EQUAL): {
+        Value b = tos;
+        Value a = *--sp;
+        tos = BOOL_VAL(!valuesEqual(a, b));
+        DISPATCH();
+    }
+    CASE(OP_LESS): {
+        QUICKEN_BINARY_OP(OP_LESS_INT, OP_LESS_NUM);
+        ARITHEMETIC_BINARY_OP(BOOL_VAL, <, BOOL_VAL(x < y));
+        DISPATCH();
+    }
+    CASE(OP_LESS_INT): {
+        QUICK_BINARY_OP(OP_LESS, IS_INT, AS_INT, BOOL_VAL, <);
+        DISPATCH();
+    }
+    CASE(OP_LESS_NUM): {
+        QUICK_BINARY_OP(OP_LESS, IS_DOUBLE, AS_DOUBLE, BOOL_VAL, <);
+        DISPATCH();
+    }
+    CASE(OP_LESS_EQUAL): {
+        QUICKEN_BINARY_OP(OP_LESS_EQUAL_INT, OP_LESS_EQUAL_NUM);
+        ARITHEMETIC_BINARY_OP(BOOL_VAL, <=, BOOL_VAL(x <= y));
+        DISPATCH();
+    }
+    CASE(OP_LESS_EQUAL_INT): {
+        QUICK_BINARY_OP(OP_LESS_EQUAL, IS_INT, AS_INT, BOOL_VAL, <=);
+        DISPATCH();
+    }
+    CASE(OP_LESS_EQUAL_NUM): {
+        QUICK_BINARY_OP(OP_LESS_EQUAL, IS_DOUBLE, AS_DOUBLE, BOOL_VAL, <=);
+        DISPATCH();
+    }
+    CASE(OP_GREATER): {
+        QUICKEN_BINARY_OP(OP_GREATER_INT, OP_GREATER_NUM);
+        ARITHEMETIC_BINARY_OP(BOOL_VAL, >, BOOL_VAL(x > y));
+        DISPATCH();
+    }
+    CASE(OP_GREATER_INT): {
+        QUICK_BINARY_OP(OP_GREATER, IS_INT, AS_INT, BOOL_VAL, >);
+        DISPATCH();
+    }
+    CASE(OP_GREATER_NUM): {
+        QUICK_BINARY_OP(OP_GREATER, IS_DOUBLE, AS_DOUBLE, BOOL_VAL, >);
+        DISPATCH();
+    }
+    CASE(OP_GREATER_EQUAL): {
+        QUICKEN_BINARY_OP(OP_GREATER_EQUAL_INT, OP_GREATER_EQUAL_NUM);
+        ARITHEMETIC_BINARY_OP(BOOL_VAL, >=, BOOL_VAL(x >= y));
+        DISPATCH();
+    }
+    CASE(OP_GREATER_EQUAL_INT): {
+        QUICK_BINARY_OP(OP_GREATER_EQUAL, IS_INT, AS_INT, BOOL_VAL, >=);
+        DISPATCH();
+    }
+    CASE(OP_GREATER_EQUAL_NUM): {
+        QUICK_BINARY_OP(OP_GREATER_EQUAL, IS_DOUBLE, AS_DOUBLE, BOOL_VAL, >=);
+        DISPATCH();
+    }
+    CASE(OP_ADD): {
+        QUICKEN_BINARY_OP(OP_ADD_INT, OP_ADD_NUM);
+        ARITHEMETIC_BINARY_OP(NUMBER_VAL, +, addInts(x, y));
+        DISPATCH();
+    }
+    CASE(OP_ADD_INT): {
+        QUICK_INT_ARITHMETIC_OP(OP_ADD, ADD_OVERFLOW_INT32);
+        DISPATCH();
+    }
+    CASE(OP_ADD_NUM): {
+        QUICK_BINARY_OP(OP_ADD, IS_DOUBLE, AS_DOUBLE, NUMBER_VAL, +);
+        DISPATCH();
+    }
+    CASE(OP_SUBTRACT): {
+        QUICKEN_BINARY_OP(OP_SUBTRACT_INT, OP_SUBTRACT_NUM);
+        ARITHEMETIC_BINARY_OP(NUMBER_VAL, -, subtractInts(x, y));
+        DISPATCH();
+    }
+    CASE(OP_SUBTRACT_INT): {
+        QUICK_INT_ARITHMETIC_OP(OP_SUBTRACT, SUB_OVERFLOW_INT32);
+        DISPATCH();
+    }
+    CASE(OP_SUBTRACT_NUM): {
+        QUICK_BINARY_OP(OP_SUBTRACT, IS_DOUBLE, AS_DOUBLE, NUMBER_VAL, -);
+        DISPATCH();
+    }
+    CASE(OP_DIVIDE): {
+        ARITHEMETIC_BINARY_OP(NUMBER_VAL, /, NUMBER_VAL((double)x / y));
+        DISPATCH();
+    }
+    CASE(OP_MULTIPLY): {
+        QUICKEN_BINARY_OP(OP_MULTIPLY_INT, OP_MULTIPLY_NUM);
+        ARITHEMETIC_BINARY_OP(NUMBER_VAL, *, multiplyInts(x, y));
+        DISPATCH();
+    }
+    CASE(OP_MULTIPLY_INT): {
+        QUICK_INT_ARITHMETIC_OP(OP_MULTIPLY, MUL_OVERFLOW_INT32);
+        DISPATCH();
+    }
+    CASE(OP_MULTIPLY_NUM): {
+        QUICK_BINARY_OP(OP_MULTIPLY, IS_DOUBLE, AS_DOUBLE, NUMBER_VAL, *);
+        DISPATCH();
+    }
+    CASE(OP_MODULO): {
+        if (IS_NUMBER(tos) && AS_NUMBER(tos) == 0) {
+            SAVE_IP_REGISTER;
+            runtimeError("Modulo by zero ");
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_NEGATE: {
-            Value val = pop();
-            if (!IS_NUMBER(val)) {
-                // TODO: ADD RUNTIME ERROR
-            }
-            push(NUMBER_VAL(-AS_NUMBER(val)));
-            break;
+        // INT32_MIN % -1 overflows in C.
+        INTEGER_BINARY_OP(INT_VAL(y == -1 ? 0 : x % y));
+        DISPATCH();
+    }
+    CASE(OP_BITWISE_AND): {
+        INTEGER_BINARY_OP(INT_VAL(x & y));
+        DISPATCH();
+    }
+    CASE(OP_BITWISE_OR): {
+        INTEGER_BINARY_OP(INT_VAL(x | y));
+        DISPATCH();
+    }
+    CASE(OP_BITWISE_XOR): {
+        INTEGER_BINARY_OP(INT_VAL(x ^ y));
+        DISPATCH();
+    }
+    CASE(OP_SHIFT_LEFT): {
+        INTEGER_BINARY_OP(INT_VAL((uint32_t)x << (y & 31)));
+        DISPATCH();
+    }
+    CASE(OP_SHIFT_RIGHT): {
+        INTEGER_BINARY_OP(INT_VAL(x >> (y & 31)));
+        DISPATCH();
+    }
+    CASE(OP_TEMPLATE): {
+        int numSpans = READ_OPERAND();
+        // one span contains an expression and a string litreal
+        // we also need to pop the template head
+        SYNC_STACK();
+        push(makeStrTemplate(numSpans * 2 + 1));
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_NEGATE): {
+        if (!IS_NUMBER(tos)) {
+            // TODO: ADD RUNTIME ERROR
         }
-        case OP_NOT: {
-            push(BOOL_VAL(isFalsey(pop())));
-            break;
+        tos = negateNumber(tos);
+        DISPATCH();
+    }
+    CASE(OP_NOT): {
+        tos = BOOL_VAL(isFalsey(tos));
+        DISPATCH();
+    }
+    CASE(OP_CONSTANT): {
+        Value val = READ_CONSTANT();
+        PUSH(val);
+        DISPATCH();
+    }
+    CASE(OP_NIL):
+        PUSH(NIL_VAL);
+        DISPATCH();
+    CASE(OP_TRUE):
+        PUSH(TRUE_VAL);
+        DISPATCH();
+    CASE(OP_FALSE):
+        PUSH(FALSE_VAL);
+        DISPATCH();
+
+    CASE(OP_POP):
+        DROP();
+        DISPATCH();
+    CASE(OP_POPN): {
+        uint8_t n = READ_OPERAND();
+        sp -= n;
+        tos = *sp;
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS): {
+        QUICKEN_BINARY_OP(OP_JUMP_IF_NOT_LESS_INT, OP_JUMP_IF_NOT_LESS_NUM);
+        COMPARE_JUMP_OP(<);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_INT): {
+        QUICK_COMPARE_JUMP_OP(OP_JUMP_IF_NOT_LESS, IS_INT, AS_INT, <);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_NUM): {
+        QUICK_COMPARE_JUMP_OP(OP_JUMP_IF_NOT_LESS, IS_DOUBLE, AS_DOUBLE, <);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL): {
+        QUICKEN_BINARY_OP(OP_JUMP_IF_NOT_LESS_EQUAL_INT, OP_JUMP_IF_NOT_LESS_EQUAL_NUM);
+        COMPARE_JUMP_OP(<=);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL_INT): {
+        QUICK_COMPARE_JUMP_OP(OP_JUMP_IF_NOT_LESS_EQUAL, IS_INT, AS_INT, <=);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL_NUM): {
+        QUICK_COMPARE_JUMP_OP(OP_JUMP_IF_NOT_LESS_EQUAL, IS_DOUBLE, AS_DOUBLE, <=);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER): {
+        QUICKEN_BINARY_OP(OP_JUMP_IF_NOT_GREATER_INT, OP_JUMP_IF_NOT_GREATER_NUM);
+        COMPARE_JUMP_OP(>);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_INT): {
+        QUICK_COMPARE_JUMP_OP(OP_JUMP_IF_NOT_GREATER, IS_INT, AS_INT, >);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_NUM): {
+        QUICK_COMPARE_JUMP_OP(OP_JUMP_IF_NOT_GREATER, IS_DOUBLE, AS_DOUBLE, >);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL): {
+        QUICKEN_BINARY_OP(OP_JUMP_IF_NOT_GREATER_EQUAL_INT, OP_JUMP_IF_NOT_GREATER_EQUAL_NUM);
+        COMPARE_JUMP_OP(>=);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL_INT): {
+        QUICK_COMPARE_JUMP_OP(OP_JUMP_IF_NOT_GREATER_EQUAL, IS_INT, AS_INT, >=);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL_NUM): {
+        QUICK_COMPARE_JUMP_OP(OP_JUMP_IF_NOT_GREATER_EQUAL, IS_DOUBLE, AS_DOUBLE, >=);
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_EQUAL): {
+        Cell *target = READ_TARGET();
+        Value b = tos;
+        Value a = sp[-1];
+        sp -= 2;
+        tos = *sp;
+        if (!valuesEqual(a, b)) {
+            ip = target;
         }
-        case OP_CONSTANT: {
-            Value val = READ_CONSTANT();
-            push(val);
-            break;
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_EQUAL): {
+        Cell *target = READ_TARGET();
+        Value b = tos;
+        Value a = sp[-1];
+        sp -= 2;
+        tos = *sp;
+        if (valuesEqual(a, b)) {
+            ip = target;
         }
-        case OP_NIL:
-            push(NIL_VAL);
-            break;
-        case OP_TRUE:
-            push(TRUE_VAL);
-            break;
-        case OP_FALSE:
-            push(FALSE_VAL);
-            break;
-
-        case OP_POP:
-            pop();
-            break;
-        case OP_POPN: {
-            uint8_t n = READ_BYTE();
-            while (n--) {
-                pop();
-            }
-            break;
+        DISPATCH();
+    }
+    CASE(OP_ADD_LOCALS): {
+        ARITHEMETIC_LOCALS_OP(+, addInts(x, y));
+        DISPATCH();
+    }
+    CASE(OP_SUBTRACT_LOCALS): {
+        ARITHEMETIC_LOCALS_OP(-, subtractInts(x, y));
+        DISPATCH();
+    }
+    CASE(OP_MULTIPLY_LOCALS): {
+        ARITHEMETIC_LOCALS_OP(*, multiplyInts(x, y));
+        DISPATCH();
+    }
+    CASE(OP_DIVIDE_LOCALS): {
+        ARITHEMETIC_LOCALS_OP(/, NUMBER_VAL((double)x / y));
+        DISPATCH();
+    }
+    CASE(OP_GET_LOCAL_PROPERTY): {
+        Value value = READ_SLOT();
+        ObjString *name = READ_STRING();
+        InlineCache *cache = READ_CACHE();
+        Value *field = IS_INSTANCE(value)
+                           ? cachedField(cache, AS_INSTANCE(value))
+                           : NULL;
+        if (field != NULL) {
+            PUSH(*field);
+            DISPATCH();
         }
+        PUSH(value);
+        SAVE_IP_REGISTER;
+        SYNC_STACK();
+        if (!getProperty(name, cache)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
+        RELOAD_STACK();
+        DISPATCH();
+    }
+    CASE(OP_RETURN_CONSTANT): {
+        RETURN_VALUE(READ_CONSTANT());
+    }
+    CASE(OP_MOVE): {
+        FLUSH_TOS();
+        Value *dst = READ_SLOT_ADDRESS();
+        *dst = *READ_SLOT_ADDRESS();
+        REFRESH_TOS();
+        DISPATCH();
+    }
+    CASE(OP_LOAD_CONSTANT): {
+        FLUSH_TOS();
+        Value *dst = READ_SLOT_ADDRESS();
+        *dst = READ_CONSTANT();
+        REFRESH_TOS();
+        DISPATCH();
+    }
+    CASE(OP_ADD_RR): {
+        REGISTER_ARITHMETIC_OP(+, addInts(x, y), *READ_SLOT_ADDRESS());
+        DISPATCH();
+    }
+    CASE(OP_SUBTRACT_RR): {
+        REGISTER_ARITHMETIC_OP(-, subtractInts(x, y), *READ_SLOT_ADDRESS());
+        DISPATCH();
+    }
+    CASE(OP_MULTIPLY_RR): {
+        REGISTER_ARITHMETIC_OP(*, multiplyInts(x, y), *READ_SLOT_ADDRESS());
+        DISPATCH();
+    }
+    CASE(OP_DIVIDE_RR): {
+        REGISTER_ARITHMETIC_OP(/, NUMBER_VAL((double)x / y),
+                               *READ_SLOT_ADDRESS());
+        DISPATCH();
+    }
+    CASE(OP_ADD_RK): {
+        REGISTER_ARITHMETIC_OP(+, addInts(x, y), READ_CONSTANT());
+        DISPATCH();
+    }
+    CASE(OP_SUBTRACT_RK): {
+        REGISTER_ARITHMETIC_OP(-, subtractInts(x, y), READ_CONSTANT());
+        DISPATCH();
+    }
+    CASE(OP_MULTIPLY_RK): {
+        REGISTER_ARITHMETIC_OP(*, multiplyInts(x, y), READ_CONSTANT());
+        DISPATCH();
+    }
+    CASE(OP_DIVIDE_RK): {
+        REGISTER_ARITHMETIC_OP(/, NUMBER_VAL((double)x / y), READ_CONSTANT());
+        DISPATCH();
     }
+    CASE(OP_JUMP_IF_NOT_LESS_RR): {
+        REGISTER_COMPARE_JUMP_OP(<, *READ_SLOT_ADDRESS());
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL_RR): {
+        REGISTER_COMPARE_JUMP_OP(<=, *READ_SLOT_ADDRESS());
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_RR): {
+        REGISTER_COMPARE_JUMP_OP(>, *READ_SLOT_ADDRESS());
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL_RR): {
+        REGISTER_COMPARE_JUMP_OP(>=, *READ_SLOT_ADDRESS());
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_RK): {
+        REGISTER_COMPARE_JUMP_OP(<, READ_CONSTANT());
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL_RK): {
+        REGISTER_COMPARE_JUMP_OP(<=, READ_CONSTANT());
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_RK): {
+        REGISTER_COMPARE_JUMP_OP(>, READ_CONSTANT());
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL_RK): {
+        REGISTER_COMPARE_JUMP_OP(>=, READ_CONSTANT());
+        DISPATCH();
+    }
+    }
+
+#ifdef DOJO_COMPUTED_GOTO
+DO_UNKNOWN_OP:
+#endif
+    SAVE_IP_REGISTER;
+    runtimeError("Unknown opcode");
+    return INTERPRET_RUNTIME_ERROR;
+#undef DISPATCH
+#undef REWRITE_INSTRUCTION
+#undef CASE
+#undef INTERPRET_LOOP
+#undef TRACE_INSTRUCTION
+#undef RETURN_VALUE
+#undef QUICK_COMPARE_JUMP_OP
+#undef QUICK_BINARY_OP
+#undef QUICK_INT_ARITHMETIC_OP
+#undef DEQUICKEN
+#undef QUICKEN_BINARY_OP
+#undef INTEGER_BINARY_OP
+#undef REGISTER_COMPARE_JUMP_OP
+#undef REGISTER_ARITHMETIC_OP
+#undef COMPARE_JUMP_OP
+#undef ARITHEMETIC_LOCALS_OP
 #undef ARITHEMETIC_BINARY_OP
+#undef DOUBLE_OPERANDS
+#undef REFRESH_TOS
+#undef FLUSH_TOS
+#undef READ_SLOT
+#undef READ_SLOT_ADDRESS
+#undef DROP
+#undef PUSH
+#undef RELOAD_STACK
+#undef SYNC_STACK
+#undef READ_TARGET
+#undef READ_CACHE
 #undef READ_STRING
-#undef READ_SHORT
 #undef READ_CONSTANT
-#undef READ_BYTE
+#undef READ_OPERAND
+#undef READ_CELL
 #undef SAVE_IP_REGISTER
 #undef LOAD_IP_REGISTER
 }
 
-static bool invoke(ObjString *name, int argCount) {
+static bool invoke(ObjString *name, int argCount, InlineCache *cache) {
     Value receiver = peek(argCount);
 
     if (!IS_INSTANCE(receiver)) {
@@ -424,13 +1292,22 @@ static bool invoke(ObjString *name, int argCount) {
     }
     ObjInstance *instance = AS_INSTANCE(receiver);
 
-    Value value;
-    if (mapGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return call(value, argCount);
+    Value *method = cachedMethod(cache, instance);
+    if (method != NULL) {
+        return callClosure(AS_CLOSURE(*method), argCount);
     }
 
-    return invokeFromClass(instance->djClass, name, argCount);
+    Value value;
+    bool isMethod;
+    if (!findProperty(instance, name, cache, &value, &isMethod)) {
+        runtimeError("Undefined property '%.*s'.", name->length, name->str);
+        return false;
+    }
+    if (isMethod) {
+        return callClosure(AS_CLOSURE(value), argCount);
+    }
+    vm.stackTop[-argCount - 1] = value;
+    return call(value, argCount);
 }
 
 static bool invokeFromClass(ObjClass *djClass, ObjString *name, int argCount) {
@@ -468,10 +1345,13 @@ static bool call(Value callee, int argCount) {
         case OBJ_NATIVE_FN: {
             return callNativeFn(AS_NATIVE_FN(callee), argCount);
         }
+        case OBJ_FIBER:
+            return resumeFiber(AS_FIBER(callee), argCount);
         default:
             break;
         }
     }
+    runtimeError("Can only call functions and methods");
     return false;
 }
 
@@ -481,43 +1361,298 @@ static bool callClosure(ObjClosure *closure, int argCount) {
         runtimeError("Expected %d arguments but got %d", fn->arity, argCount);
         return false;
     }
+    if (fn->lazySource && !compileOnFirstCall(fn)) {
+        return false;
+    }
 
-    if (vm.frameCount == FRAME_MAX) {
+    if (vm.frameCount == vm.frameCapacity && !addFrameSegment()) {
         runtimeError("Stack overflow");
         return false;
     }
 
-    CallFrame *frame = &vm.frames[vm.frameCount++];
+    Cell *code = threadedCode(fn);
+    reserveStack(fn->threaded.stackSize - argCount - 1);
+    CallFrame *frame = frameAt(vm.frameCount++);
     frame->closure = closure;
-    frame->ip = fn->chunk.codes;
+    frame->ip = code;
     frame->slots = vm.stackTop - argCount - 1;
+    countCall(fn);
+    return true;
+}
+
+// replaceFrame makes frame run closure instead, with the callee and the
+// argCount arguments on top of the stack moved down over its window. The
+// frame keeps its place, so tail calls run in constant space.
+static bool replaceFrame(CallFrame *frame, ObjClosure *closure, int argCount) {
+    ObjFn *fn = closure->fn;
+    if (argCount != fn->arity) {
+        runtimeError("Expected %d arguments but got %d", fn->arity, argCount);
+        return false;
+    }
+    if (fn->lazySource && !compileOnFirstCall(fn)) {
+        return false;
+    }
+
+    if (vm.openUpvalues) {
+        closeUpvalues(frame->slots);
+    }
+    Value *callee = vm.stackTop - argCount - 1;
+    memmove(frame->slots, callee, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    frame->closure = closure;
+    frame->ip = threadedCode(fn);
+    reserveStack(fn->threaded.stackSize - argCount - 1);
+    countCall(fn);
+    return true;
+}
+
+// tailCall makes the call of OP_TAIL_CALL for the interpreter. A closure
+// goes on in the interpreter even when it has been compiled, so that tail
+// calls back and forth between native code and the interpreter never nest
+// on the native stack.
+NOINLINE static bool tailCall(CallFrame *frame, int argCount) {
+    Value callee = peek(argCount);
+    if (!IS_CLOUSRE(callee)) {
+        return call(callee, argCount) && runCompiled(frame);
+    }
+    return replaceFrame(frame, AS_CLOSURE(callee), argCount);
+}
+
+// compileOnFirstCall compiles the body of fn, which compile left for its
+// first call. An error in it is reported then, and fails the call.
+NOINLINE static bool compileOnFirstCall(ObjFn *fn) {
+    if (!compileLazyFn(fn)) {
+        runtimeError("Cannot compile function '%.*s'", fn->name->length,
+                     fn->name->str);
+        return false;
+    }
+    vm.firstCallCompiles++;
     return true;
 }
 
+// countCall compiles fn to native code once it has been called often enough.
+static inline void countCall(ObjFn *fn) {
+    if (fn->jit.calls < JIT_THRESHOLD && ++fn->jit.calls == JIT_THRESHOLD) {
+        jitCompile(fn);
+    }
+}
+
+// isClosureOfArity tells whether callee can be called by OP_CALL_CLOSURE.
+static inline bool isClosureOfArity(Value callee, int argCount) {
+    return IS_CLOUSRE(callee) && AS_CLOSURE(callee)->fn->arity == argCount;
+}
+
 static bool callNativeFn(ObjNativeFn *fn, int argCount) {
     if (argCount != fn->arity) {
         runtimeError("Expected %d arguments but got %d", fn->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAME_MAX) {
+    if (vm.frameCount == vm.frameMax) {
         runtimeError("Stack overflow");
         return false;
     }
 
     Value result = fn->fn(argCount, vm.stackTop - argCount);
+    if (IS_UNDEFINED(result)) {
+        return false;
+    }
     vm.stackTop -= argCount + 1;
     push(result);
     return true;
 }
 
+// resumeFiber runs fiber, called with argCount arguments, until it yields or
+// returns, and leaves the value it gave in place of the call. The argument
+// is what the yield it stopped at evaluates to, or the parameter of its
+// function on the first resume.
+static bool resumeFiber(ObjFiber *fiber, int argCount) {
+    if (argCount > 1) {
+        runtimeError("Expected at most 1 argument but got %d", argCount);
+        return false;
+    }
+    if (fiber->isDone) {
+        runtimeError("Cannot resume a fiber that has finished");
+        return false;
+    }
+    if (fiber->caller != NULL) {
+        runtimeError("Cannot resume a fiber that is running");
+        return false;
+    }
+
+    Value value = argCount == 1 ? pop() : NIL_VAL;
+    pop(); // The fiber, which vm.fiber keeps alive from here.
+    ObjFiber *caller = vm.fiber;
+    saveStacks(caller);
+    fiber->caller = caller;
+    vm.fiber = fiber;
+    bool isStarted = true;
+    if (fiber->closure != NULL) {
+        isStarted = startFiber(fiber->closure, value);
+        fiber->closure = NULL;
+    } else {
+        loadStacks(fiber);
+        push(value);
+    }
+
+    bool isOk = isStarted && run(0) == INTERPRET_OK;
+    Value result = isOk ? pop() : NIL_VAL;
+    fiber->caller = NULL;
+    if (isOk && vm.frameCount > 0) {
+        saveStacks(fiber);
+    } else {
+        fiber->isDone = true;
+        freeStacks();
+    }
+    loadStacks(caller);
+    vm.fiber = caller;
+    if (!isOk) {
+        return false;
+    }
+    push(result);
+    return true;
+}
+
+// startFiber gives the running fiber new stacks and calls closure on them,
+// with value as its argument if it takes one.
+static bool startFiber(ObjClosure *closure, Value value) {
+    initStacks();
+    push(OBJ_VAL(closure));
+    if (closure->fn->arity == 0) {
+        return callClosure(closure, 0);
+    }
+    push(value);
+    return callClosure(closure, 1);
+}
+
+// runCompiled runs the frame a call from the interpreter just pushed to
+// completion when its function has been compiled to native code. Fibers
+// other than the script's are only interpreted, so that a yield never has
+// native frames to unwind.
+static bool runCompiled(CallFrame *caller) {
+    CallFrame *callee = lastCallFrame();
+    if (callee == caller || callee->closure->fn->jit.entry == NULL ||
+        vm.fiber->caller != NULL) {
+        return true;
+    }
+    return jitRun(callee);
+}
+
+// finishCall runs the frame a call from native code pushed, if any, until it
+// returns, so the native caller finds the result on top of the stack. Calls
+// nested depth frames deep before the call.
+static bool finishCall(int depth) {
+    if (vm.frameCount == depth) {
+        return true;
+    }
+    CallFrame *callee = lastCallFrame();
+    if (callee->closure->fn->jit.entry != NULL) {
+        return jitRun(callee);
+    }
+    return run(vm.frameCount - 1) == INTERPRET_OK;
+}
+
+// interpretFrame runs frame, the one on top, from its ip until it returns.
+static bool interpretFrame(CallFrame *frame) {
+    return run(vm.frameCount - 1) == INTERPRET_OK;
+}
+
+bool callValue(int argCount) {
+    int depth = vm.frameCount;
+    return call(peek(argCount), argCount) && finishCall(depth);
+}
+
+bool invokeMethod(ObjString *name, int argCount, InlineCache *cache) {
+    int depth = vm.frameCount;
+    return invoke(name, argCount, cache) && finishCall(depth);
+}
+
+FrameRunner tailCallValue(int argCount) {
+    CallFrame *frame = lastCallFrame();
+    Value callee = peek(argCount);
+    if (!IS_CLOUSRE(callee)) {
+        // The interpreter picks up at the OP_RETURN after the call.
+        return callValue(argCount) ? interpretFrame : NULL;
+    }
+    if (!replaceFrame(frame, AS_CLOSURE(callee), argCount)) {
+        return NULL;
+    }
+    void *entry = frame->closure->fn->jit.entry;
+    return entry != NULL ? (FrameRunner)entry : interpretFrame;
+}
+
 static void defineMethod(ObjString *name) {
     Value method = peek(0);
     ObjClass *djClass = AS_CLASS(peek(1));
     mapPut(&djClass->methods, name, method);
+    djClass->version++;
     pop();
 }
 
+// getProperty replaces the instance on top of the stack with its field or
+// bound method called name.
+bool getProperty(ObjString *name, InlineCache *cache) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+
+    Value *field = cachedField(cache, instance);
+    if (field != NULL) {
+        vm.stackTop[-1] = *field;
+        return true;
+    }
+
+    Value value;
+    bool isMethod = true;
+    Value *method = cachedMethod(cache, instance);
+    if (method != NULL) {
+        value = *method;
+    } else if (!findProperty(instance, name, cache, &value, &isMethod)) {
+        runtimeError("Undefined property '%.*s'", name->length, name->str);
+        return false;
+    }
+    if (isMethod) {
+        value = OBJ_VAL(newObjBoundMethod(peek(0), AS_CLOSURE(value)));
+    }
+    pop(); // Instance.
+    push(value);
+    return true;
+}
+
+// setProperty sets the field name of the instance on top of the stack to
+// the value below it, and pops the instance. A cached set that adds the
+// field moves the instance straight to the next shape.
+bool setProperty(ObjString *name, InlineCache *cache) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+    ObjShape *shape = instance->shape;
+
+    CacheEntry *entry = findCacheEntry(cache, shape);
+    if (entry != NULL && entry->next == NULL && entry->index >= 0) {
+        instance->fields[entry->index] = peek(1);
+    } else if (entry != NULL && entry->next != NULL &&
+               entry->index < instance->capacity) {
+        instance->fields[entry->index] = peek(1);
+        instance->shape = entry->next;
+    } else {
+        setField(instance, name, peek(1));
+        if (shape != NULL && instance->shape == shape) {
+            fillCache(cache, (CacheEntry){shape, NULL, 0,
+                                          findField(shape, name), NIL_VAL});
+        } else if (shape != NULL && instance->shape != NULL) {
+            fillCache(cache, (CacheEntry){shape, instance->shape, 0,
+                                          shape->count, NIL_VAL});
+        }
+    }
+    pop();
+    return true;
+}
+
 static bool bindMethod(ObjClass *djClass, ObjString *name) {
     Value method;
     if (!mapGet(&djClass->methods, name, &method)) {
@@ -529,15 +1664,125 @@ static bool bindMethod(ObjClass *djClass, ObjString *name) {
     return true;
 }
 
+// findProperty looks up the field or method called name of instance, after
+// the inline cache of the site has missed, and fills the cache with what it
+// finds. Instances in dictionary mode are never cached.
+static bool findProperty(ObjInstance *instance, ObjString *name,
+                         InlineCache *cache, Value *value, bool *isMethod) {
+    ObjShape *shape = instance->shape;
+    if (shape == NULL) {
+        *isMethod = false;
+        if (mapGet(instance->dictionary, name, value)) {
+            return true;
+        }
+        *isMethod = true;
+        return mapGet(&instance->djClass->methods, name, value);
+    }
+    int index = findField(shape, name);
+    if (index != -1) {
+        *value = instance->fields[index];
+        *isMethod = false;
+        fillCache(cache, (CacheEntry){shape, NULL, 0, index, NIL_VAL});
+        return true;
+    }
+    if (!mapGet(&instance->djClass->methods, name, value)) {
+        return false;
+    }
+    *isMethod = true;
+    fillCache(cache, (CacheEntry){shape, NULL, instance->djClass->version, -1,
+                                  *value});
+    return true;
+}
+
+/* ----------------------------- INLINE CACHES ------------------------------ */
+
+static inline CacheEntry *findCacheEntry(InlineCache *cache,
+                                         ObjShape *shape) {
+    if (cache->count == IC_MEGAMORPHIC) {
+        return NULL;
+    }
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].shape == shape) {
+            return &cache->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// cachedField returns the slot of the field the cache found for the shape
+// of instance. Instances of one shape keep a field in the same slot.
+static inline Value *cachedField(InlineCache *cache, ObjInstance *instance) {
+    CacheEntry *entry = findCacheEntry(cache, instance->shape);
+    if (entry == NULL || entry->index < 0) {
+        return NULL;
+    }
+    return &instance->fields[entry->index];
+}
+
+// cachedMethod returns the method the cache found for the shape of
+// instance, unless the class has changed since. A shape without the field
+// cannot have gained one that shadows the method.
+static inline Value *cachedMethod(InlineCache *cache, ObjInstance *instance) {
+    CacheEntry *entry = findCacheEntry(cache, instance->shape);
+    if (entry == NULL || entry->index != -1 ||
+        entry->version != instance->djClass->version) {
+        return NULL;
+    }
+    return &entry->method;
+}
+
+// fillCache records entry for its shape, replacing what the cache had for
+// that shape. A site that has seen more than IC_ENTRIES shapes becomes
+// megamorphic and stops caching.
+static void fillCache(InlineCache *cache, CacheEntry entry) {
+    if (cache->count == IC_MEGAMORPHIC) {
+        return;
+    }
+    int i = 0;
+    while (i < cache->count && cache->entries[i].shape != entry.shape) {
+        i++;
+    }
+    if (i == IC_ENTRIES) {
+        cache->count = IC_MEGAMORPHIC;
+        return;
+    }
+    if (i == cache->count) {
+        cache->count++;
+    }
+    cache->entries[i] = entry;
+}
+
 static void defineNativeFn(const char *name, NativeFn native, int arity) {
     push(newObjStringInVal(name, (int)strlen(name)));
     push(OBJ_VAL(newObjNativeFn(native, arity)));
-    mapPut(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
-static void closeUpvalues(Value *last) {
+// globalSlot returns the index of the global called name in
+// vm.globalValues, giving it one that holds UNDEFINED_VAL the first time
+// the name is seen. Slots are never freed, so code can keep the index.
+int globalSlot(ObjString *name) {
+    Value slot;
+    if (mapGet(&vm.globalSlots, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+    push(OBJ_VAL(name));
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    int index = writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    mapPut(&vm.globalSlots, name, NUMBER_VAL((double)index));
+    pop();
+    return index;
+}
+
+void undefinedGlobalError(int slot) {
+    ObjString *name = AS_STRING(vm.globalNames.values[slot]);
+    runtimeError("Undefined Variable '%.*s'", name->length, name->str);
+}
+
+void closeUpvalues(Value *last) {
     while (vm.openUpvalues && vm.openUpvalues->location >= last) {
         ObjUpvalue *upvalue = vm.openUpvalues;
         // We retrieve the value from the stack and then modify the location of
@@ -573,13 +1818,36 @@ static ObjUpvalue *captureUpvalue(Value *local) {
     return createdUpvalue;
 }
 
+static Cell *threadedCode(ObjFn *fn) {
+    if (fn->threaded.cells == NULL) {
+        threadChunk(&fn->chunk, &fn->threaded, handlers);
+        fn->threaded.stackSize = maxStackDepth(&fn->chunk, fn->arity + 1);
+    }
+    return fn->threaded.cells;
+}
+
+// loadSlot reads a local of the running frame, which is cached in tos when it
+// is on top of the stack.
+static inline Value loadSlot(Value *slot, Value *sp, Value tos) {
+    return slot == sp ? tos : *slot;
+}
+
+// isInteger tells whether an integer-only op takes value.
+static inline bool isInteger(Value value) {
+    return IS_INT(value) || (IS_DOUBLE(value) && isInt32(AS_DOUBLE(value)));
+}
+
+static inline int32_t toInteger(Value value) {
+    return IS_INT(value) ? AS_INT(value) : (int32_t)AS_DOUBLE(value);
+}
+
 static bool isFalsey(Value val) {
     return IS_NIL(val) || (IS_NUMBER(val) && !AS_NUMBER(val)) ||
            (IS_BOOL(val) && !AS_BOOL(val));
 }
 
 static CallFrame *lastCallFrame() {
-    return &vm.frames[vm.frameCount - 1];
+    return frameAt(vm.frameCount - 1);
 }
 
 static Value makeStrTemplate(int numSpans) {
@@ -602,19 +1870,117 @@ static Value makeStrTemplate(int numSpans) {
     return OBJ_VAL(str);
 }
 
-static void resetStack() {
+// initStacks starts the value stack with room for a couple of frames, and
+// leaves the frames to be allocated by the first call.
+static void initStacks() {
+    vm.stackCapacity = STACK_HEADROOM * 2;
+    vm.stack = ALLOCATE(Value, vm.stackCapacity);
+    vm.stackLimit = vm.stack + vm.stackCapacity - STACK_HEADROOM;
     vm.stackTop = vm.stack;
+    vm.frameSegments = NULL;
+    vm.segmentCount = 0;
     vm.frameCount = 0;
+    vm.frameCapacity = 0;
+    vm.frameMax = frameMax;
     vm.openUpvalues = NULL;
 }
 
+// saveStacks moves the stacks of the VM to fiber, which stops running.
+static void saveStacks(ObjFiber *fiber) {
+    fiber->frameSegments = vm.frameSegments;
+    fiber->segmentCount = vm.segmentCount;
+    fiber->frameCount = vm.frameCount;
+    fiber->frameCapacity = vm.frameCapacity;
+    fiber->stack = vm.stack;
+    fiber->stackCapacity = vm.stackCapacity;
+    fiber->stackLimit = vm.stackLimit;
+    fiber->stackTop = vm.stackTop;
+    fiber->openUpvalues = vm.openUpvalues;
+}
+
+// loadStacks moves the stacks saveStacks left in fiber back to the VM, which
+// owns them while the fiber runs.
+static void loadStacks(ObjFiber *fiber) {
+    vm.frameSegments = fiber->frameSegments;
+    vm.segmentCount = fiber->segmentCount;
+    vm.frameCount = fiber->frameCount;
+    vm.frameCapacity = fiber->frameCapacity;
+    vm.stack = fiber->stack;
+    vm.stackCapacity = fiber->stackCapacity;
+    vm.stackLimit = fiber->stackLimit;
+    vm.stackTop = fiber->stackTop;
+    vm.openUpvalues = fiber->openUpvalues;
+    fiber->frameSegments = NULL;
+    fiber->segmentCount = 0;
+    fiber->frameCount = 0;
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->openUpvalues = NULL;
+}
+
+static void freeStacks() {
+    for (int i = 0; i < vm.segmentCount; i++) {
+        FREE(CallFrame, vm.frameSegments[i]);
+    }
+    FREE(CallFrame *, vm.frameSegments);
+    FREE(Value, vm.stack);
+}
+
+// reserveStack makes room for count more values above the top of the
+// stack, which are those the frame about to be pushed uses above its
+// arguments, with STACK_HEADROOM to spare.
+static inline void reserveStack(int count) {
+    if (vm.stackLimit - vm.stackTop < count) {
+        growStack(count + STACK_HEADROOM);
+    }
+}
+
+// growStack moves the stack to an allocation with room for count more
+// values, and relocates every pointer into it: the slots of the frames and
+// the locations of the open upvalues. The VM's callers reload theirs from
+// vm.stackTop after a call.
+NOINLINE static void growStack(int count) {
+    int used = (int)(vm.stackTop - vm.stack);
+    int capacity = vm.stackCapacity;
+    while (capacity - used < count) {
+        capacity *= 2;
+    }
+    Value *stack = ALLOCATE(Value, capacity);
+    memcpy(stack, vm.stack, sizeof(Value) * used);
+    for (int i = 0; i < vm.frameCount; i++) {
+        CallFrame *frame = frameAt(i);
+        frame->slots = stack + (frame->slots - vm.stack);
+    }
+    for (ObjUpvalue *upval = vm.openUpvalues; upval; upval = upval->next) {
+        upval->location = stack + (upval->location - vm.stack);
+    }
+    FREE(Value, vm.stack);
+    vm.stack = stack;
+    vm.stackCapacity = capacity;
+    vm.stackLimit = stack + capacity - STACK_HEADROOM;
+    vm.stackTop = stack + used;
+}
+
+// addFrameSegment makes room for more frames, unless calls already nest
+// vm.frameMax deep.
+NOINLINE static bool addFrameSegment() {
+    if (vm.frameCapacity >= vm.frameMax) {
+        return false;
+    }
+    vm.frameSegments =
+        reallocate(vm.frameSegments, sizeof(CallFrame *) * vm.segmentCount,
+                   sizeof(CallFrame *) * (vm.segmentCount + 1));
+    vm.frameSegments[vm.segmentCount++] = ALLOCATE(CallFrame, FRAME_SEGMENT);
+    int capacity = vm.segmentCount * FRAME_SEGMENT;
+    vm.frameCapacity = capacity < vm.frameMax ? capacity : vm.frameMax;
+    return true;
+}
+
 void push(Value value) {
     *(vm.stackTop++) = value;
-    vm.count++;
 }
 
 Value pop() {
-    vm.count--;
     return *(--vm.stackTop);
 }
 
@@ -622,12 +1988,34 @@ static Value peek(int depth) {
     return *(vm.stackTop - depth - 1);
 }
 
+// clockNative returns the CPU time of the calling thread, so that a script
+// run by a batch worker is not charged for the others.
 static Value clockNative(int argCount, Value *args) {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return NUMBER_VAL(now.tv_sec + now.tv_nsec / 1e9);
 }
 
 static Value printNative(int argCount, Value *args) {
-    printValue(*args);
-    printf("\n");
+    printValueToFile(vm.out, *args);
+    fputc('\n', vm.out);
     return NIL_VAL;
+}
+
+// fiberNative creates a fiber that runs the function args[0], which may take
+// the value of the first resume as its parameter.
+static Value fiberNative(int argCount, Value *args) {
+    if (!IS_CLOUSRE(*args) || AS_CLOSURE(*args)->fn->arity > 1) {
+        runtimeError("A fiber runs a function of at most 1 parameter");
+        return UNDEFINED_VAL;
+    }
+    return OBJ_VAL(newObjFiber(AS_CLOSURE(*args)));
+}
+
+static Value isDoneNative(int argCount, Value *args) {
+    if (!IS_FIBER(*args)) {
+        runtimeError("Expected a fiber");
+        return UNDEFINED_VAL;
+    }
+    return BOOL_VAL(AS_FIBER(*args)->isDone);
 }
\ No newline at end of file
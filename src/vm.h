@@ -6,26 +6,47 @@
 #include "object.h"
 #include "value.h"
 
-#define FRAME_MAX 256
-#define STACK_MAX (UINT8_COUNT * 64)
+// How deep calls may nest unless setFrameMax says otherwise.
+#define FRAME_MAX (1 << 14)
+// Frames are allocated this many at a time, and never move.
+#define FRAME_SEGMENT 64
+// Free slots the value stack keeps above the most a frame uses, for the
+// values the VM and the compiler push for a moment, e.g. to keep them from
+// the collector. A frame reserves its own slots when it is pushed.
+#define STACK_HEADROOM (UINT8_COUNT * 2)
 
-typedef struct {
+typedef struct CallFrame {
     ObjClosure *closure;
-    uint8_t *ip;
+    Cell *ip;
     Value *slots;
 } CallFrame;
 
+// The frames, value stack and open upvalues are those of the running fiber,
+// and move to its ObjFiber when another one is resumed or it yields.
 typedef struct {
-    CallFrame frames[FRAME_MAX];
-    Value stack[STACK_MAX];
+    CallFrame **frameSegments;
+    int segmentCount;
+    int frameCount;
+    int frameCapacity; // Frames in the segments, up to frameMax.
+    int frameMax;
+    // The stack grows by moving to a larger allocation, and every pointer
+    // into it is relocated then. The STACK_HEADROOM slots above stackLimit
+    // stay free of the values of frames.
+    Value *stack;
+    int stackCapacity;
+    Value *stackLimit;
     Value *stackTop;
     Obj *objs;
     Hashmap stringLiterals;
-    Hashmap globals;
+    Hashmap globalSlots;     // Global name to its index in globalValues.
+    ValueArray globalValues; // UNDEFINED_VAL until the global is defined.
+    ValueArray globalNames;  // The name of each global, for errors.
     ObjUpvalue *openUpvalues;
-    int frameCount;
-    int count;
+    ObjFiber *fiber; // The running fiber, the script's at first.
     ObjString *initString;
+    int firstCallCompiles; // Bodies compiled on their first call.
+    FILE *out; // Where print writes.
+    FILE *err; // Where errors are reported.
 } VM;
 
 typedef enum {
@@ -34,11 +55,39 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpreterResult;
 
-extern VM vm;
+extern ISOLATE_LOCAL VM vm;
 
 InterpreterResult interpret(const char *source);
+InterpreterResult interpretCached(const char *source, const char *cachePath);
 void initVM();
+void terminateVM();
+void initCompileContext();
+void setFrameMax(int max);
+void setOutput(FILE *out, FILE *err);
 void push(Value value);
 Value pop();
+int globalSlot(ObjString *name);
+
+// frameAt returns the frame index calls deep, where the script's is 0.
+static inline CallFrame *frameAt(int index) {
+    unsigned i = (unsigned)index;
+    return &vm.frameSegments[i / FRAME_SEGMENT][i % FRAME_SEGMENT];
+}
+
+// Native code from the JIT calls back into the VM through these, with the
+// stack written back to vm.stackTop and the ip of its frame saved. A frame
+// pushed by a call is run until it returns.
+bool callValue(int argCount);
+bool invokeMethod(ObjString *name, int argCount, InlineCache *cache);
+bool getProperty(ObjString *name, InlineCache *cache);
+bool setProperty(ObjString *name, InlineCache *cache);
+void undefinedGlobalError(int slot);
+void closeUpvalues(Value *last);
+
+// A FrameRunner runs a frame until it returns, and returns false on a runtime
+// error. tailCallValue returns the one native code jumps to in place of
+// returning after a tail call, or NULL on a runtime error.
+typedef bool (*FrameRunner)(CallFrame *frame);
+FrameRunner tailCallValue(int argCount);
 
 #endif
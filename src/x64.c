@@ -0,0 +1,290 @@
+#include "x64.h"
+#include "memory.h"
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+static void emitRex(bool isWide, int reg, int base);
+static void emitModRM(int reg, Register base, int32_t disp);
+static void emitRegisters(int reg, int rm);
+
+static ISOLATE_LOCAL Assembler *current = NULL;
+
+void initAssembler(Assembler *as) {
+    as->count = 0;
+    as->capacity = 0;
+    as->code = NULL;
+}
+
+void freeAssembler(Assembler *as) {
+    FREE(uint8_t, as->code);
+    initAssembler(as);
+}
+
+// finishAssembler copies the code into its own mapping, which is made
+// executable only once it is no longer writable. It returns NULL when the
+// platform cannot run the code.
+void *finishAssembler(Assembler *as) {
+#if defined(__x86_64__) && defined(__linux__)
+    void *code = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(code, as->code, as->count);
+    if (mprotect(code, as->count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, as->count);
+        return NULL;
+    }
+    return code;
+#else
+    return NULL;
+#endif
+}
+
+void freeMachineCode(void *code, size_t size) {
+#if defined(__x86_64__) && defined(__linux__)
+    if (code != NULL) {
+        munmap(code, size);
+    }
+#endif
+}
+
+void x64Use(Assembler *as) {
+    current = as;
+}
+
+int x64Offset() {
+    return current->count;
+}
+
+void x64Byte(uint8_t byte) {
+    if (IS_EXCEEDING_CAPACITY(current->count, current->capacity)) {
+        int oldCapacity = current->capacity;
+        current->capacity = GROW_CAPACITY(oldCapacity);
+        current->code =
+            reallocate(current->code, oldCapacity, current->capacity);
+    }
+    current->code[current->count++] = byte;
+}
+
+void x64Int32(int32_t value) {
+    uint32_t bits = (uint32_t)value;
+    for (int i = 0; i < 4; i++) {
+        x64Byte((bits >> (i * 8)) & 0xff);
+    }
+}
+
+void x64Int64(uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        x64Byte((value >> (i * 8)) & 0xff);
+    }
+}
+
+void x64Push(Register reg) {
+    emitRex(false, 0, reg);
+    x64Byte(0x50 | (reg & 7));
+}
+
+void x64Pop(Register reg) {
+    emitRex(false, 0, reg);
+    x64Byte(0x58 | (reg & 7));
+}
+
+void x64Ret() {
+    x64Byte(0xc3);
+}
+
+void x64Load(Register reg, Register base, int32_t disp) {
+    emitRex(true, reg, base);
+    x64Byte(0x8b);
+    emitModRM(reg, base, disp);
+}
+
+void x64Store(Register base, int32_t disp, Register reg) {
+    emitRex(true, reg, base);
+    x64Byte(0x89);
+    emitModRM(reg, base, disp);
+}
+
+void x64Lea(Register reg, Register base, int32_t disp) {
+    emitRex(true, reg, base);
+    x64Byte(0x8d);
+    emitModRM(reg, base, disp);
+}
+
+void x64MovImm(Register reg, uint64_t imm) {
+    emitRex(true, 0, reg);
+    x64Byte(0xb8 | (reg & 7));
+    x64Int64(imm);
+}
+
+void x64Mov(Register dst, Register src) {
+    emitRex(true, src, dst);
+    x64Byte(0x89);
+    emitRegisters(src, dst);
+}
+
+void x64Alu(AluOp op, Register dst, Register src) {
+    emitRex(true, src, dst);
+    x64Byte(op);
+    emitRegisters(src, dst);
+}
+
+void x64AluImm(AluOp op, Register dst, int32_t imm) {
+    emitRex(true, 0, dst);
+    x64Byte(0x81);
+    emitRegisters(op >> 3, dst);
+    x64Int32(imm);
+}
+
+void x64ShrImm(Register reg, uint8_t imm) {
+    emitRex(true, 0, reg);
+    x64Byte(0xc1);
+    emitRegisters(5, reg);
+    x64Byte(imm);
+}
+
+void x64MovqToXmm(int xmm, Register reg) {
+    x64Byte(0x66);
+    emitRex(true, xmm, reg);
+    x64Byte(0x0f);
+    x64Byte(0x6e);
+    emitRegisters(xmm, reg);
+}
+
+void x64MovqFromXmm(Register reg, int xmm) {
+    x64Byte(0x66);
+    emitRex(true, xmm, reg);
+    x64Byte(0x0f);
+    x64Byte(0x7e);
+    emitRegisters(xmm, reg);
+}
+
+void x64LoadXmm(int xmm, Register base, int32_t disp) {
+    x64Byte(0xf2); // movsd
+    emitRex(false, xmm, base);
+    x64Byte(0x0f);
+    x64Byte(0x10);
+    emitModRM(xmm, base, disp);
+}
+
+void x64StoreXmm(Register base, int32_t disp, int xmm) {
+    x64Byte(0xf2); // movsd
+    emitRex(false, xmm, base);
+    x64Byte(0x0f);
+    x64Byte(0x11);
+    emitModRM(xmm, base, disp);
+}
+
+void x64Movaps(int dst, int src) {
+    emitRex(false, dst, src);
+    x64Byte(0x0f);
+    x64Byte(0x28);
+    emitRegisters(dst, src);
+}
+
+void x64ScalarDouble(SseOp op, int dst, int src) {
+    x64Byte(0xf2);
+    emitRex(false, dst, src);
+    x64Byte(0x0f);
+    x64Byte(op);
+    emitRegisters(dst, src);
+}
+
+// x64Cvtsi2sd converts the low 32 bits of reg, as a signed int.
+void x64Cvtsi2sd(int xmm, Register reg) {
+    x64Byte(0xf2);
+    emitRex(false, xmm, reg);
+    x64Byte(0x0f);
+    x64Byte(0x2a);
+    emitRegisters(xmm, reg);
+}
+
+// x64Comisd sets the flags like an unsigned compare of a with b. An
+// unordered result sets ZF, PF and CF, which fails CC_A and CC_AE.
+void x64Comisd(int a, int b) {
+    x64Byte(0x66);
+    emitRex(false, a, b);
+    x64Byte(0x0f);
+    x64Byte(0x2f);
+    emitRegisters(a, b);
+}
+
+void x64Setcc(Condition cc, Register reg) {
+    emitRex(false, 0, reg);
+    x64Byte(0x0f);
+    x64Byte(0x90 | cc);
+    emitRegisters(0, reg);
+}
+
+void x64MovzxByte(Register dst, Register src) {
+    emitRex(false, dst, src);
+    x64Byte(0x0f);
+    x64Byte(0xb6);
+    emitRegisters(dst, src);
+}
+
+void x64Call(void *fn) {
+    x64MovImm(RAX, (uintptr_t)fn);
+    x64Byte(0xff); // call rax
+    x64Byte(0xd0);
+}
+
+// x64JumpReg jumps to the address in reg.
+void x64JumpReg(Register reg) {
+    emitRex(false, 0, reg);
+    x64Byte(0xff);
+    emitRegisters(4, reg);
+}
+
+// x64Jump and x64JumpIf return where their rel32 is, for x64PatchJump.
+int x64Jump() {
+    x64Byte(0xe9);
+    x64Int32(0);
+    return current->count - 4;
+}
+
+int x64JumpIf(Condition cc) {
+    x64Byte(0x0f);
+    x64Byte(0x80 | cc);
+    x64Int32(0);
+    return current->count - 4;
+}
+
+void x64PatchJump(int at, int target) {
+    int32_t rel = target - (at + 4);
+    memcpy(&current->code[at], &rel, sizeof(rel));
+}
+
+// emitRex emits a REX prefix when the instruction is 64 bits wide or uses
+// r8 and up, or xmm8 and up.
+static void emitRex(bool isWide, int reg, int base) {
+    uint8_t rex = 0x40 | (isWide ? 0x08 : 0) | ((reg >> 3) & 1) << 2 |
+                  ((base >> 3) & 1);
+    if (rex != 0x40) {
+        x64Byte(rex);
+    }
+}
+
+// emitModRM addresses [base + disp]. rsp and r12 need a SIB byte, and a
+// displacement is always present, which keeps rbp and r13 out of the
+// rip-relative encoding.
+static void emitModRM(int reg, Register base, int32_t disp) {
+    bool isShort = disp >= INT8_MIN && disp <= INT8_MAX;
+    x64Byte((isShort ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) {
+        x64Byte(0x24);
+    }
+    if (isShort) {
+        x64Byte((uint8_t)disp);
+    } else {
+        x64Int32(disp);
+    }
+}
+
+static void emitRegisters(int reg, int rm) {
+    x64Byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
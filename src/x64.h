@@ -0,0 +1,99 @@
+#ifndef dojo_x64_h
+#define dojo_x64_h
+
+#include "common.h"
+
+typedef enum {
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+} Register;
+
+// Condition codes of jcc and setcc. Flipping the lowest bit negates one.
+typedef enum {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+} Condition;
+
+// The "op r/m64, r64" opcodes. Shifted right by three they are also the
+// extension of the matching "op r/m64, imm32".
+typedef enum {
+    ALU_ADD = 0x01,
+    ALU_OR = 0x09,
+    ALU_AND = 0x21,
+    ALU_SUB = 0x29,
+    ALU_XOR = 0x31,
+    ALU_CMP = 0x39,
+} AluOp;
+
+// Scalar double arithmetic, in the order of the arithmetic opcodes.
+typedef enum {
+    SSE_ADD = 0x58,
+    SSE_SUB = 0x5c,
+    SSE_MUL = 0x59,
+    SSE_DIV = 0x5e,
+} SseOp;
+
+typedef struct {
+    int count;
+    int capacity;
+    uint8_t *code;
+} Assembler;
+
+void initAssembler(Assembler *as);
+void freeAssembler(Assembler *as);
+void *finishAssembler(Assembler *as);
+void freeMachineCode(void *code, size_t size);
+
+// Every x64 function below appends to the assembler passed to x64Use.
+void x64Use(Assembler *as);
+int x64Offset();
+
+void x64Byte(uint8_t byte);
+void x64Int32(int32_t value);
+void x64Int64(uint64_t value);
+void x64Push(Register reg);
+void x64Pop(Register reg);
+void x64Ret();
+void x64Load(Register reg, Register base, int32_t disp);
+void x64Store(Register base, int32_t disp, Register reg);
+void x64Lea(Register reg, Register base, int32_t disp);
+void x64MovImm(Register reg, uint64_t imm);
+void x64Mov(Register dst, Register src);
+void x64Alu(AluOp op, Register dst, Register src);
+void x64AluImm(AluOp op, Register dst, int32_t imm);
+void x64ShrImm(Register reg, uint8_t imm);
+void x64MovqToXmm(int xmm, Register reg);
+void x64MovqFromXmm(Register reg, int xmm);
+void x64LoadXmm(int xmm, Register base, int32_t disp);
+void x64StoreXmm(Register base, int32_t disp, int xmm);
+void x64Movaps(int dst, int src);
+void x64ScalarDouble(SseOp op, int dst, int src);
+void x64Cvtsi2sd(int xmm, Register reg);
+void x64Comisd(int a, int b);
+void x64Setcc(Condition cc, Register reg);
+void x64MovzxByte(Register dst, Register src);
+void x64Call(void *fn);
+void x64JumpReg(Register reg);
+int x64Jump();
+int x64JumpIf(Condition cc);
+void x64PatchJump(int at, int target);
+
+#endif
@@ -1,4 +1,7 @@
-DOJO="./build/dojo"
+DOJO=${DOJO:-"./build/dojo"}
+# Examples run without a cache, so that no .dojoc file is left next to them.
+# test_cache.sh clears CACHE to run its copies of them cached.
+CACHE=${CACHE---no-cache}
 assert() {
   expected="$1"
   input="$2"
@@ -6,7 +9,7 @@ assert() {
   echo -e "$input" > test.dojo
 
 
-  actual=`$DOJO test.dojo`
+  actual=`$DOJO $CACHE test.dojo`
 
   if [ "$actual" = "$expected" ]; then
     echo "$input => $actual"
@@ -20,7 +23,7 @@ assertFile() {
   file="$1"
   expected="$2"
 
-  actual=`$DOJO ${file}`
+  actual=`$DOJO $CACHE ${file}`
 
   if [ "${actual}" = "${expected}" ]; then
     echo "$file OK"
@@ -32,7 +35,7 @@ assertFile() {
 
 assertFileError() {
   file="$1"
-  actual=`$DOJO ${file}`
+  actual=`$DOJO $CACHE ${file}`
 
   if (($? > 0)); then
     echo "$file OK"
@@ -42,6 +45,20 @@ assertFileError() {
   fi
 }
 
+assertFileErrorOutput() {
+  file="$1"
+  expected="$2"
+
+  actual=`$DOJO $CACHE ${file} 2>&1 >/dev/null | sed 's/\x1b\[[0-9;]*m//g'`
+
+  if [ "${actual}" = "${expected}" ]; then
+    echo "$file OK"
+  else
+    printRedText "$expected expected, but got $actual"
+    exit 1
+  fi
+}
+
 printRedText() {
   RED='\033[0;31m'
   NC='\033[0m'
@@ -60,5 +77,5 @@ suite() {
 
 
 cleanup() {
-  rm -f test.dojo
+  rm -f test.dojo test.dojoc
 }
\ No newline at end of file
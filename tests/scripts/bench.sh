@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# Runs every script in tests/benchmarks a few times and reports the best
+# elapsed time printed by each one.
+
+DOJO=${DOJO:-"./build/dojo"}
+RUNS=${RUNS:-3}
+
+for bench in $(find ./tests/benchmarks -name '*.dojo' | sort)
+do
+    best=""
+    for ((i = 0; i < RUNS; i++))
+    do
+        elapsed=`$DOJO $bench | sed -n 's/^elapsed //p'`
+        if [[ -z "$best" ]] || awk "BEGIN { exit !($elapsed < $best) }"; then
+            best=$elapsed
+        fi
+    done
+    printf "%-12s %s\n" "$(basename $bench .dojo)" "$best"
+done
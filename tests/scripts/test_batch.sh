@@ -0,0 +1,52 @@
+#!/bin/bash
+
+source "$( dirname -- "$( readlink -f -- "$0"; )"; )/assert.sh"
+
+suite "batches should print the output of each script in the order given"
+
+expected='6
+7
+This is a template string 6
+0
+1
+2
+3
+4
+0
+1
+2
+3
+4
+5
+first'
+files="tests/examples/var/global.dojo tests/examples/loop/for.dojo tests/examples/batch/define.dojo"
+assertFile "$files" "$expected"
+DOJO="$DOJO --jobs=3" assertFile "$files" "$expected"
+DOJO="$DOJO --jobs=2 --no-jit" assertFile "$files" "$expected"
+DOJO="$DOJO --jobs=2 --registers" assertFile "$files" "$expected"
+DOJO="$DOJO --jobs 2" assertFile "$files" "$expected"
+DOJO="$DOJO --jobs 2 --no-jit" assertFile "$files" "$expected"
+
+suite "batches should keep running after a script fails"
+
+expected='0
+1
+2
+3
+4
+0
+1
+2
+3
+4
+5
+6
+7
+This is a template string 6'
+files="tests/examples/loop/for.dojo tests/examples/var/error_global.dojo tests/examples/var/global.dojo"
+DOJO="$DOJO --jobs=2" assertFile "$files" "$expected"
+DOJO="$DOJO --jobs=2" assertFileError "$files"
+
+suite "scripts of a batch should not see the globals of the ones before"
+
+DOJO="$DOJO --jobs=1" assertFileError "tests/examples/batch/define.dojo tests/examples/batch/error_undefined.dojo"
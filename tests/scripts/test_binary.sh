@@ -56,4 +56,56 @@ nil
 
 suite "should report error if binary ops are used with wrong types"
 
-assertFileError "tests/examples/binary/error_binary.dojo"
\ No newline at end of file
+assertFileError "tests/examples/binary/error_binary.dojo"
+
+suite "register backend should give the same results as the stack backend"
+
+expected='8
+11
+-15
+5
+-15
+<
+<=
+!>
+>=
+then
+>
+>=
+else
+3
+4'
+assertFile "tests/examples/binary/locals.dojo" "$expected"
+DOJO="$DOJO --registers" assertFile "tests/examples/binary/locals.dojo" "$expected"
+
+suite "integers should act like the doubles they stand for"
+
+expected='2.14748e+09
+-2.14748e+09
+4.29497e+09
+-0
+-0
+true
+3.5
+2
+-2
+2
+7
+5
+-2.14748e+09
+2
+-4
+6
+7
+2
+40197
+6
+700
+43'
+assertFile "tests/examples/binary/integer.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/binary/integer.dojo" "$expected"
+DOJO="$DOJO --registers" assertFile "tests/examples/binary/integer.dojo" "$expected"
+
+suite "integer-only operators should report error on other numbers"
+
+assertFileError "tests/examples/binary/error_integer.dojo"
@@ -0,0 +1,84 @@
+#!/bin/bash
+
+source "$( dirname -- "$( readlink -f -- "$0"; )"; )/assert.sh"
+CACHE=
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cp tests/examples/class/super.dojo tests/examples/functions/closure.dojo \
+   tests/examples/literals/string_template.dojo \
+   tests/examples/loop/error_trace.dojo tests/examples/functions/lazy.dojo \
+   tests/examples/functions/parallel_compile.dojo \
+   tests/examples/functions/error_lazy_uncalled.dojo \
+   tests/examples/functions/error_lazy_compile.dojo "$dir"
+
+suite "scripts should not be cached with --no-cache"
+
+DOJO="$DOJO --no-cache" assertFile "$dir/closure.dojo" 'one
+two'
+if [ -f "$dir/closure.dojoc" ]; then
+  printRedText "$dir/closure.dojoc was written"
+  exit 1
+fi
+
+suite "scripts run from their cache should print what they printed when compiled"
+
+for name in super closure string_template lazy parallel_compile; do
+  expected=`$DOJO --no-cache "$dir/$name.dojo"`
+  assertFile "$dir/$name.dojo" "$expected"
+  if [ ! -f "$dir/$name.dojoc" ]; then
+    printRedText "$dir/$name.dojoc was not written"
+    exit 1
+  fi
+  assertFile "$dir/$name.dojo" "$expected"
+  DOJO="$DOJO --registers" assertFile "$dir/$name.dojo" "$expected"
+  DOJO="$DOJO --registers" assertFile "$dir/$name.dojo" "$expected"
+done
+
+suite "scripts run from their cache should report runtime errors"
+
+assertFileError "$dir/error_trace.dojo"
+assertFileError "$dir/error_trace.dojo"
+
+suite "scripts with errors in functions should fail without being cached, called or not"
+
+for name in error_lazy_compile error_lazy_uncalled; do
+  expected=`$DOJO --no-cache "$dir/$name.dojo" 2>&1 >/dev/null`
+  for i in 1 2; do
+    actual=`$DOJO "$dir/$name.dojo" 2>&1 >/dev/null`
+    if [ "$actual" = "$expected" ]; then
+      echo "$dir/$name.dojo OK"
+    else
+      printRedText "$expected expected, but got $actual"
+      exit 1
+    fi
+  done
+  assertFileError "$dir/$name.dojo"
+  if [ -f "$dir/$name.dojoc" ]; then
+    printRedText "$dir/$name.dojoc was written"
+    exit 1
+  fi
+done
+
+suite "scripts read from stdin should run without being cached"
+
+actual=`$DOJO - < "$dir/super.dojo"`
+expected=`$DOJO --no-cache "$dir/super.dojo"`
+if [ "$actual" = "$expected" ] && [ ! -f ./-c ]; then
+  echo "- OK"
+else
+  printRedText "$expected expected, but got $actual"
+  exit 1
+fi
+
+suite "sources as long as a page should end where their file does"
+
+{ echo 'print("page")'; printf '//%.0s' {1..2040}; echo x; } > "$dir/page.dojo"
+assertFile "$dir/page.dojo" 'page'
+
+suite "a changed script should be compiled again"
+
+printf 'print("changed")\n' >> "$dir/closure.dojo"
+assertFile "$dir/closure.dojo" 'one
+two
+changed'
@@ -45,4 +45,33 @@ parent'
 
 suite "should report error if this or super is used outside of class scope"
 
-assertFileError "tests/examples/class/error_wrong_scope.dojo"
\ No newline at end of file
+assertFileError "tests/examples/class/error_wrong_scope.dojo"
+
+suite "property access and calls should see through their inline caches"
+
+expected='2.021e+06
+3.032e+06
+2.065e+06
+10
+12
+10
+1.12425e+06
+base
+override
+base
+20'
+assertFile "tests/examples/class/inline_cache.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/class/inline_cache.dojo" "$expected"
+
+suite "instances should share shapes and fall back to a dictionary"
+
+expected='566500
+93000
+111
+5
+780
+1
+1781
+2'
+assertFile "tests/examples/class/shape.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/class/shape.dojo" "$expected"
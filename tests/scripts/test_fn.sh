@@ -23,3 +23,172 @@ assertFileError "tests/examples/functions/error_stack_overflow.dojo"
 
 
 
+
+suite "Functions compiled by the JIT should give the same results as the interpreter"
+
+expected='2.70165e+07
+3000
+3001'
+assertFile "tests/examples/functions/jit.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/functions/jit.dojo" "$expected"
+DOJO="$DOJO --registers" assertFile "tests/examples/functions/jit.dojo" "$expected"
+
+suite "Functions compiled by the JIT should report runtime errors"
+
+assertFileError "tests/examples/functions/error_jit.dojo"
+
+suite "Quickened calls should fall back when the callee changes"
+
+expected='1820
+14
+8
+5.75'
+assertFile "tests/examples/functions/quicken.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/functions/quicken.dojo" "$expected"
+
+suite "Quickened arithmetic and compares should fall back when the operands change"
+
+expected='14
+2.14748e+09
+-2.14748e+09
+4.29497e+09
+2.25
+4.5
+10
+true
+false
+true
+false
+2'
+assertFile "tests/examples/functions/quicken_numbers.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/functions/quicken_numbers.dojo" "$expected"
+expected='Operands must be numbers 
+[Line 3] in add
+[Line 7] in script'
+DOJO="$DOJO --no-jit" assertFileErrorOutput "tests/examples/functions/error_quicken_numbers.dojo" "$expected"
+
+suite "Quickened calls should report a wrong number of arguments"
+
+assertFileError "tests/examples/functions/error_quicken_arity.dojo"
+
+suite "Calls in tail position should run in constant stack space"
+
+expected='5.00005e+09
+3.015e+07
+5.00005e+09
+false
+0
+0
+7
+done'
+assertFile "tests/examples/functions/tail_call.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/functions/tail_call.dojo" "$expected"
+DOJO="$DOJO --registers" assertFile "tests/examples/functions/tail_call.dojo" "$expected"
+
+suite "Compiled functions should tail call natives, classes and fibers"
+
+expected='8.997e+06
+<Empty instance>'
+assertFile "tests/examples/functions/tail_call_native.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/functions/tail_call_native.dojo" "$expected"
+DOJO="$DOJO --registers" assertFile "tests/examples/functions/tail_call_native.dojo" "$expected"
+
+suite "Calls in tail position should report a wrong number of arguments"
+
+assertFileError "tests/examples/functions/error_tail_call.dojo"
+
+suite "Deep recursion should grow the stack and keep closures on it working"
+
+expected='10000
+22
+4.5015e+06
+12000'
+assertFile "tests/examples/functions/deep_recursion.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/functions/deep_recursion.dojo" "$expected"
+DOJO="$DOJO --registers" assertFile "tests/examples/functions/deep_recursion.dojo" "$expected"
+
+suite "Deeply nested expressions should grow the stack for their operands"
+
+expected='1101
+2202
+2202
+2202'
+assertFile "tests/examples/functions/deep_expression.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/functions/deep_expression.dojo" "$expected"
+DOJO="$DOJO --registers" assertFile "tests/examples/functions/deep_expression.dojo" "$expected"
+
+suite "Calls should overflow the stack past the configured depth"
+
+DOJO="$DOJO --max-frames=100" assertFileError "tests/examples/functions/error_max_frames.dojo"
+
+suite "Fibers should resume where they yielded, on stacks of their own"
+
+expected='0
+1
+false
+end
+true
+6
+2.66867e+09
+15000
+2
+5000
+11
+12
+42
+<fiber>'
+assertFile "tests/examples/functions/fiber.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/functions/fiber.dojo" "$expected"
+DOJO="$DOJO --registers" assertFile "tests/examples/functions/fiber.dojo" "$expected"
+
+suite "Should report error if yielding outside a fiber"
+
+assertFileError "tests/examples/functions/error_yield.dojo"
+
+suite "Should report error if resuming a fiber that has finished or is running"
+
+expected='Cannot resume a fiber that has finished
+[Line 6] in script'
+assertFileErrorOutput "tests/examples/functions/error_fiber_done.dojo" "$expected"
+expected='Cannot resume a fiber that is running
+[Line 4] in f'
+assertFileErrorOutput "tests/examples/functions/error_fiber_running.dojo" "$expected"
+
+suite "Global functions compiled on their first call should behave as if compiled upfront"
+
+expected='610
+2
+defined after the function'
+assertFile "tests/examples/functions/lazy.dojo" "$expected"
+DOJO="$DOJO --registers" assertFile "tests/examples/functions/lazy.dojo" "$expected"
+
+suite "Compile errors in global functions should fail the script before it runs"
+
+errors="[line 4] Error at 'this': Cannot use 'this' keyword outside of class"
+for name in error_lazy_uncalled error_lazy_compile; do
+  assertFile "tests/examples/functions/$name.dojo" ""
+  assertFileErrorOutput "tests/examples/functions/$name.dojo" "$errors"
+  DOJO="$DOJO --compile-jobs=2" assertFile "tests/examples/functions/$name.dojo" ""
+  DOJO="$DOJO --compile-jobs=2" assertFileErrorOutput "tests/examples/functions/$name.dojo" "$errors"
+done
+
+suite "Syntax errors in functions that are never called should still be reported"
+
+assertFileError "tests/examples/functions/error_lazy_syntax.dojo"
+
+suite "Bodies compiled by a pool of workers should behave as if compiled on one thread"
+
+expected='6
+10
+hello dojo
+<fn unknown>'
+assertFile "tests/examples/functions/parallel_compile.dojo" "$expected"
+DOJO="$DOJO --compile-jobs=4" assertFile "tests/examples/functions/parallel_compile.dojo" "$expected"
+DOJO="$DOJO --compile-jobs=2 --registers" assertFile "tests/examples/functions/parallel_compile.dojo" "$expected"
+
+suite "Errors in bodies compiled by a pool of workers should be reported as if compiled on one thread"
+
+expected="[line 6] Error at 'return': Cannot return a value form an initializer
+[line 11] Error at 'this': Cannot use 'this' keyword outside of class"
+assertFileErrorOutput "tests/examples/functions/error_parallel_compile.dojo" "$expected"
+DOJO="$DOJO --compile-jobs=4" assertFileErrorOutput "tests/examples/functions/error_parallel_compile.dojo" "$expected"
@@ -15,4 +15,8 @@ string'
 
 suite "string template should interpolate expressions and strings properly"
 
-assertFile "tests/examples/literals/string_template.dojo" 'This is a template string false it works! true see for yourself 4.25 dojo'
\ No newline at end of file
+assertFile "tests/examples/literals/string_template.dojo" 'This is a template string false it works! true see for yourself 4.25 dojo'
+
+suite "an unterminated template string is an error, not a crash"
+
+assertFileError "tests/examples/literals/error_unterminated_template.dojo"
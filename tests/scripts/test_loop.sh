@@ -54,3 +54,23 @@ assertFileError "tests/examples/loop/error_while_expression.dojo"
 suite "should report error if break and continue were used outside of a loop"
 
 assertFileError "tests/examples/loop/error_break_and_continue.dojo"
+
+suite "traced loops should leave through their guards with the interpreter's results"
+
+expected='-248500
+1000
+0
+245344
+true
+501
+1.515e+06
+576
+89700
+800'
+assertFile "tests/examples/loop/trace.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/loop/trace.dojo" "$expected"
+DOJO="$DOJO --registers" assertFile "tests/examples/loop/trace.dojo" "$expected"
+
+suite "traced loops should report runtime errors after leaving the trace"
+
+assertFileError "tests/examples/loop/error_trace.dojo"
@@ -29,3 +29,18 @@ assertFileError "tests/examples/var/error_global.dojo"
 suite "Should stop invalid assignment"
 
 assertFileError "tests/examples/var/error_assignment.dojo" 
+
+suite "Should read and write globals through their slots"
+
+expected='2400
+later
+again
+3.998e+06
+2
+true'
+assertFile "tests/examples/var/global_slots.dojo" "$expected"
+DOJO="$DOJO --no-jit" assertFile "tests/examples/var/global_slots.dojo" "$expected"
+
+suite "Should stop assignment to an undefined global from compiled code"
+
+assertFileError "tests/examples/var/error_undefined_global.dojo"